@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <wayland-client.h>
+
+#include "buffer_cache.h"
+#include "common.h"
+#include "wayland.h"
+#include "shm.h"
+#include "dmabuf.h"
+#include "xmalloc.h"
+
+static struct wl_list cache = { &cache, &cache };
+
+static void destroy(struct buffer *buffer) {
+    if (buffer->dmabuf) {
+        destroy_dmabuf_buffer(buffer);
+    } else if (buffer->wl_buffer) {
+        destroy_buffer(buffer);
+    }
+    wl_list_remove(&buffer->cache_link);
+    free(buffer);
+}
+
+static void buffer_release_handler(void *data, struct wl_buffer *wl_buffer) {
+    struct buffer *buffer = data;
+
+    buffer->busy = false;
+    if (buffer->stale && !buffer->in_use) {
+        destroy(buffer);
+    }
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    .release = buffer_release_handler,
+};
+
+/* shm buffers with a memfd of their own are only handed out to those who asked for one */
+static struct buffer *find(struct output *output, bool dmabuf, bool sealable, uint32_t format,
+                           int32_t width, int32_t height, int32_t stride) {
+    struct buffer *buffer;
+    wl_list_for_each(buffer, &cache, cache_link) {
+        if (buffer->in_use || buffer->busy || buffer->stale) {
+            continue;
+        }
+        if ((buffer->memfd >= 0) != sealable) {
+            continue;
+        }
+        if (buffer->output == output && buffer->dmabuf == dmabuf && buffer->format == format
+                && buffer->width == width && buffer->height == height
+                && buffer->stride == stride) {
+            DEBUG("buffer cache: reusing %ix%i buffer for %s", width, height, output->name);
+            buffer->in_use = true;
+            return buffer;
+        }
+    }
+
+    return NULL;
+}
+
+struct buffer *buffer_cache_find(struct output *output, bool dmabuf, uint32_t format,
+                                 int32_t width, int32_t height, int32_t stride) {
+    return find(output, dmabuf, false, format, width, height, stride);
+}
+
+/*
+ * Buffers are only allocated when nothing in cache fits, which means what output needs has
+ * changed (eg -g region of another size in daemon mode). Unused buffers of that output that
+ * don't fit are unlikely to be needed again, so they go instead of piling up.
+ */
+static void evict(struct output *output, bool dmabuf, uint32_t format,
+                  int32_t width, int32_t height, int32_t stride) {
+    struct buffer *buffer, *buffer_tmp;
+    wl_list_for_each_safe(buffer, buffer_tmp, &cache, cache_link) {
+        if (buffer->output != output || buffer->in_use || buffer->stale) {
+            continue;
+        }
+        if (buffer->dmabuf == dmabuf && buffer->format == format
+                && buffer->width == width && buffer->height == height
+                && buffer->stride == stride) {
+            continue;
+        }
+
+        DEBUG("buffer cache: evicting %ix%i buffer for %s",
+              buffer->width, buffer->height, output->name);
+        if (buffer->busy) {
+            /* destroyed once compositor releases it */
+            buffer->stale = true;
+        } else {
+            destroy(buffer);
+        }
+    }
+}
+
+struct buffer *buffer_cache_new(struct output *output, bool dmabuf, uint32_t format,
+                                int32_t width, int32_t height, int32_t stride) {
+    evict(output, dmabuf, format, width, height, stride);
+
+    struct buffer *buffer = xcalloc(1, sizeof(*buffer));
+    buffer->output = output;
+    buffer->format = format;
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = stride;
+    buffer->in_use = true;
+    buffer->dmabuf_fd = -1;
+    buffer->memfd = -1;
+    wl_list_insert(&cache, &buffer->cache_link);
+
+    return buffer;
+}
+
+struct buffer *get_shm_buffer(struct output *output, enum wl_shm_format format,
+                              int32_t width, int32_t height, int32_t stride) {
+    struct buffer *buffer = buffer_cache_find(output, false, format, width, height, stride);
+    if (buffer == NULL) {
+        buffer = buffer_cache_new(output, false, format, width, height, stride);
+        create_buffer(buffer, format, width, height, stride);
+    }
+
+    return buffer;
+}
+
+struct buffer *get_sealable_buffer(struct output *output, enum wl_shm_format format,
+                                   int32_t width, int32_t height, int32_t stride) {
+    struct buffer *buffer = find(output, false, true, format, width, height, stride);
+    if (buffer == NULL) {
+        buffer = buffer_cache_new(output, false, format, width, height, stride);
+        create_sealable_buffer(buffer, format, width, height, stride);
+    }
+
+    return buffer;
+}
+
+void buffer_cache_release(struct buffer *buffer) {
+    buffer->in_use = false;
+    if (buffer->stale && !buffer->busy) {
+        destroy(buffer);
+    }
+}
+
+void buffer_cache_drop(struct buffer *buffer) {
+    destroy(buffer);
+}
+
+void buffer_cache_retire(struct buffer *buffer) {
+    buffer->stale = true;
+}
+
+void attach_buffer(struct wl_surface *surface, struct buffer *buffer) {
+    if (!buffer->release_listener) {
+        wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+        buffer->release_listener = true;
+    }
+    buffer->busy = true;
+
+    wl_surface_attach(surface, buffer->wl_buffer, 0, 0);
+}
+
+void buffer_cache_invalidate(struct output *output) {
+    struct buffer *buffer, *buffer_tmp;
+    wl_list_for_each_safe(buffer, buffer_tmp, &cache, cache_link) {
+        if (buffer->output != output) {
+            continue;
+        }
+
+        DEBUG("buffer cache: dropping %ix%i buffer for %s",
+              buffer->width, buffer->height, output->name);
+        if (buffer->in_use || buffer->busy) {
+            /* destroyed once nobody uses it, output might be gone by then */
+            buffer->stale = true;
+            buffer->output = NULL;
+        } else {
+            destroy(buffer);
+        }
+    }
+}
+
+void buffer_cache_cleanup(void) {
+    struct buffer *buffer, *buffer_tmp;
+    wl_list_for_each_safe(buffer, buffer_tmp, &cache, cache_link) {
+        destroy(buffer);
+    }
+}
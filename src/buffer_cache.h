@@ -0,0 +1,46 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <wayland-client.h>
+
+#include "wayland.h"
+
+/*
+ * Buffers are not destroyed when screen is unfrozen but kept around together with
+ * their wl_buffers and mappings, and handed out again on the next freeze of the same
+ * output. In daemon mode this means repeated freezes don't allocate or fault anything in.
+ */
+
+/* returns unused buffer with matching parameters or NULL */
+struct buffer *buffer_cache_find(struct output *output, bool dmabuf, uint32_t format,
+                                 int32_t width, int32_t height, int32_t stride);
+/*
+ * returns empty buffer that is tracked by cache, caller has to allocate it. Unused buffers of
+ * the same output that don't match are evicted, so cache doesn't grow with every size change.
+ */
+struct buffer *buffer_cache_new(struct output *output, bool dmabuf, uint32_t format,
+                                int32_t width, int32_t height, int32_t stride);
+/* shm buffer from cache, allocated from shm pool if there is none */
+struct buffer *get_shm_buffer(struct output *output, enum wl_shm_format format,
+                              int32_t width, int32_t height, int32_t stride);
+/* same, but every buffer has a memfd of its own, see create_sealable_buffer */
+struct buffer *get_sealable_buffer(struct output *output, enum wl_shm_format format,
+                                   int32_t width, int32_t height, int32_t stride);
+
+/* buffer goes back to cache and can be reused once compositor releases it */
+void buffer_cache_release(struct buffer *buffer);
+/* destroys buffer right away, for buffers that failed to allocate */
+void buffer_cache_drop(struct buffer *buffer);
+/* buffer is never handed out again and is destroyed once released, eg when sealed */
+void buffer_cache_retire(struct buffer *buffer);
+
+/* attaches buffer and keeps it from being reused until compositor releases it */
+void attach_buffer(struct wl_surface *surface, struct buffer *buffer);
+
+/* called when output mode or transform changes, cached buffers won't fit anymore */
+void buffer_cache_invalidate(struct output *output);
+void buffer_cache_cleanup(void);
+
+#endif /* #ifndef BUFFER_CACHE_H */
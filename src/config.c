@@ -6,8 +6,25 @@
 struct config config = {
     .output = NULL,
     .fork_child = false,
-    .timeout = 0,
+    .prespawn_child = false,
+    .timeout_ms = 0,
     .child_kill_signal = SIGTERM,
     .cursor = false,
+    .copy_overlay = false,
+    .threads = 0,
+    .shm_backing = SHM_BACKING_DEFAULT,
+    .shm_prefault = false,
+    .dmabuf = false,
+    .capture_timeout_ms = 2000,
+    .trace_file = NULL,
+    .daemon_mode = false,
+    .socket_path = NULL,
+    .export_frames = false,
+    .dump_file = NULL,
+    .dump_format = DUMP_FORMAT_PPM,
+    .encode_preset = ENCODE_PRESET_FAST,
+    .select_region = false,
+    .pick_color = false,
+    .use_region = false,
 };
 
@@ -2,13 +2,58 @@
 #define CONFIG_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+enum shm_backing {
+    SHM_BACKING_DEFAULT,
+    SHM_BACKING_THP,
+    SHM_BACKING_HUGETLB,
+};
+
+enum dump_format {
+    DUMP_FORMAT_PPM,
+    DUMP_FORMAT_FARBFELD,
+    DUMP_FORMAT_RAW,
+    DUMP_FORMAT_QOI,
+    DUMP_FORMAT_PNG,
+};
+
+enum encode_preset {
+    ENCODE_PRESET_NONE,
+    ENCODE_PRESET_FAST,
+    ENCODE_PRESET_BALANCED,
+    ENCODE_PRESET_SMALL,
+};
 
 struct config {
     char *output;
     bool fork_child;
-    unsigned int timeout;
+    /* -B, child is started right away and waits for freeze on FRZSCR_READY_FD */
+    bool prespawn_child;
+    uint64_t timeout_ms;
     int child_kill_signal;
     bool cursor;
+    bool copy_overlay;
+    unsigned int threads;
+    enum shm_backing shm_backing;
+    bool shm_prefault;
+    bool dmabuf;
+    /* outputs not captured by then are left unfrozen */
+    uint64_t capture_timeout_ms;
+    char *trace_file;
+    bool daemon_mode;
+    char *socket_path;
+    bool export_frames;
+    char *dump_file;
+    enum dump_format dump_format;
+    enum encode_preset encode_preset;
+    bool select_region;
+    bool pick_color;
+    /* -g, in global logical coordinates */
+    bool use_region;
+    struct {
+        int32_t x, y, w, h;
+    } region;
 };
 
 extern struct config config;
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "common.h"
+#include "config.h"
+#include "xmalloc.h"
+
+char *daemon_socket_path(void) {
+    if (config.socket_path != NULL) {
+        return xstrdup(config.socket_path);
+    }
+
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir == NULL) {
+        return NULL;
+    }
+    const char *display = getenv("WAYLAND_DISPLAY");
+    if (display == NULL) {
+        display = "wayland-0";
+    }
+
+    int len = snprintf(NULL, 0, "%s/frzscr-%s.sock", runtime_dir, display);
+    char *path = xmalloc(len + 1);
+    snprintf(path, len + 1, "%s/frzscr-%s.sock", runtime_dir, display);
+
+    return path;
+}
+
+static int make_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+int daemon_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (make_addr(path, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        EWARN("failed to create socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    DEBUG("connected to daemon at %s", path);
+    return fd;
+}
+
+int daemon_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (make_addr(path, &addr) < 0) {
+        EDIE("invalid socket path %s", path);
+    }
+
+    int fd = daemon_connect(path);
+    if (fd >= 0) {
+        close(fd);
+        DIE("another daemon is already listening on %s", path);
+    }
+    /* nobody is listening, so it's a leftover from a daemon that crashed */
+    if (unlink(path) < 0 && errno != ENOENT) {
+        EDIE("failed to remove stale socket %s", path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        EDIE("failed to create socket");
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        EDIE("failed to bind socket to %s", path);
+    }
+    if (listen(fd, 8) < 0) {
+        EDIE("failed to listen on %s", path);
+    }
+
+    DEBUG("listening on %s", path);
+    return fd;
+}
+
+static bool send_msg(int fd, const void *msg, size_t size) {
+    ssize_t ret;
+    do {
+        ret = send(fd, msg, size, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        EWARN("failed to send message");
+        return false;
+    }
+    return true;
+}
+
+static bool recv_msg(int fd, void *msg, size_t size) {
+    ssize_t ret;
+    do {
+        ret = recv(fd, msg, size, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        EWARN("failed to receive message");
+        return false;
+    } else if (ret == 0) {
+        return false;
+    } else if ((size_t)ret != size) {
+        WARN("received message of size %zd, expected %zu", ret, size);
+        return false;
+    }
+    return true;
+}
+
+bool daemon_send_request(int fd, const struct daemon_request *request) {
+    return send_msg(fd, request, sizeof(*request));
+}
+
+bool daemon_recv_request(int fd, struct daemon_request *request) {
+    if (!recv_msg(fd, request, sizeof(*request))) {
+        return false;
+    }
+    request->output[sizeof(request->output) - 1] = '\0';
+    return true;
+}
+
+bool daemon_send_reply(int fd, int32_t error) {
+    struct daemon_reply reply = { .error = error };
+    return send_msg(fd, &reply, sizeof(reply));
+}
+
+int32_t daemon_recv_reply(int fd) {
+    struct daemon_reply reply;
+    if (!recv_msg(fd, &reply, sizeof(reply))) {
+        return -1;
+    }
+    return reply.error;
+}
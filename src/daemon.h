@@ -0,0 +1,56 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * With -D frzscr stays connected to the compositor and waits for requests on a unix socket.
+ * Other instances forward their freeze to it and run the child themselves.
+ * Screen is unfrozen on DAEMON_UNFREEZE or when the client that froze it disconnects,
+ * DAEMON_REFRESH captures it again.
+ */
+
+enum daemon_command {
+    DAEMON_FREEZE,
+    DAEMON_UNFREEZE,
+    DAEMON_REFRESH,
+};
+
+#define DAEMON_FLAG_CURSOR       (1 << 0)
+#define DAEMON_FLAG_COPY_OVERLAY (1 << 1)
+#define DAEMON_FLAG_REGION       (1 << 2)
+
+struct daemon_request {
+    uint32_t command;
+    uint32_t flags;
+    /* empty string means all outputs */
+    char output[64];
+    /* only with DAEMON_FLAG_REGION */
+    int32_t region_x, region_y, region_width, region_height;
+};
+
+struct daemon_reply {
+    /* 0 on success, errno value otherwise */
+    int32_t error;
+};
+
+/*
+ * config.socket_path or $XDG_RUNTIME_DIR/frzscr-$WAYLAND_DISPLAY.sock, must be freed.
+ * Returns NULL if XDG_RUNTIME_DIR is not set.
+ */
+char *daemon_socket_path(void);
+
+/* dies if another daemon is already listening on path */
+int daemon_listen(const char *path);
+/* returns -1 if nobody is listening on path */
+int daemon_connect(const char *path);
+
+bool daemon_send_request(int fd, const struct daemon_request *request);
+/* returns false on error or if peer disconnected */
+bool daemon_recv_request(int fd, struct daemon_request *request);
+bool daemon_send_reply(int fd, int32_t error);
+/* blocks until reply arrives, returns -1 if daemon went away */
+int32_t daemon_recv_reply(int fd);
+
+#endif /* #ifndef DAEMON_H */
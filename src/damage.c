@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <wayland-util.h>
+
+#include "damage.h"
+#include "common.h"
+#include "xmalloc.h"
+
+/* small enough to keep a tooltip from damaging half the screen, big enough for memcmp */
+#define DAMAGE_TILE_SIZE 64
+
+bool rect_intersect(const struct rect *a, const struct rect *b, struct rect *out) {
+    int32_t x1 = a->x > b->x ? a->x : b->x;
+    int32_t y1 = a->y > b->y ? a->y : b->y;
+    int32_t x2 = a->x + a->w < b->x + b->w ? a->x + a->w : b->x + b->w;
+    int32_t y2 = a->y + a->h < b->y + b->h ? a->y + a->h : b->y + b->h;
+
+    if (x1 >= x2 || y1 >= y2) {
+        return false;
+    }
+    *out = (struct rect){ .x = x1, .y = y1, .w = x2 - x1, .h = y2 - y1 };
+    return true;
+}
+
+void damage_add(struct wl_array *damage, int32_t x, int32_t y, int32_t w, int32_t h) {
+    struct rect *rect = wl_array_add(damage, sizeof(*rect));
+    if (rect == NULL) {
+        DIE("wl_array_add() failed");
+    }
+    *rect = (struct rect){ .x = x, .y = y, .w = w, .h = h };
+}
+
+static bool tile_differs(const uint8_t *a, const uint8_t *b, int32_t stride, int bpp,
+                         int32_t x, int32_t y, int32_t w, int32_t h) {
+    size_t offset = (size_t)y * stride + (size_t)x * bpp;
+    for (int32_t row = 0; row < h; row++, offset += stride) {
+        if (memcmp(a + offset, b + offset, (size_t)w * bpp) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void find_damage(struct wl_array *damage, const void *a, const void *b,
+                 int32_t w, int32_t h, int32_t stride, int bytes_per_pixel,
+                 const struct wl_array *hint) {
+    int32_t cols = (w + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    int32_t rows = (h + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    bool *check = xcalloc((size_t)cols * rows, sizeof(*check));
+
+    if (hint == NULL || hint->size == 0) {
+        memset(check, true, (size_t)cols * rows * sizeof(*check));
+    } else {
+        const struct rect *r;
+        wl_array_for_each(r, hint) {
+            int32_t x0 = r->x < 0 ? 0 : r->x / DAMAGE_TILE_SIZE;
+            int32_t y0 = r->y < 0 ? 0 : r->y / DAMAGE_TILE_SIZE;
+            int32_t x1 = (r->x + r->w + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+            int32_t y1 = (r->y + r->h + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+            for (int32_t ty = y0; ty < y1 && ty < rows; ty++) {
+                for (int32_t tx = x0; tx < x1 && tx < cols; tx++) {
+                    check[ty * cols + tx] = true;
+                }
+            }
+        }
+    }
+
+    /* adjacent dirty tiles in a row are merged, rows are not, that's good enough */
+    for (int32_t ty = 0; ty < rows; ty++) {
+        int32_t y = ty * DAMAGE_TILE_SIZE;
+        int32_t th = y + DAMAGE_TILE_SIZE > h ? h - y : DAMAGE_TILE_SIZE;
+        int32_t run_start = -1;
+
+        for (int32_t tx = 0; tx <= cols; tx++) {
+            bool dirty = false;
+            if (tx < cols && check[ty * cols + tx]) {
+                int32_t x = tx * DAMAGE_TILE_SIZE;
+                int32_t tw = x + DAMAGE_TILE_SIZE > w ? w - x : DAMAGE_TILE_SIZE;
+                dirty = tile_differs(a, b, stride, bytes_per_pixel, x, y, tw, th);
+            }
+
+            if (dirty && run_start < 0) {
+                run_start = tx * DAMAGE_TILE_SIZE;
+            } else if (!dirty && run_start >= 0) {
+                int32_t run_end = tx * DAMAGE_TILE_SIZE > w ? w : tx * DAMAGE_TILE_SIZE;
+                damage_add(damage, run_start, y, run_end - run_start, th);
+                run_start = -1;
+            }
+        }
+    }
+
+    free(check);
+}
@@ -0,0 +1,27 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <wayland-util.h>
+
+struct rect {
+    int32_t x, y, w, h;
+};
+
+/* stores overlap of a and b in out, returns false if there's none */
+bool rect_intersect(const struct rect *a, const struct rect *b, struct rect *out);
+
+/* appends rect to array of struct rect */
+void damage_add(struct wl_array *damage, int32_t x, int32_t y, int32_t w, int32_t h);
+
+/*
+ * Compares two w x h images with the same stride tile by tile and appends rectangles
+ * that differ to damage. Only tiles touching rectangles in hint are compared, empty hint
+ * means whole image.
+ */
+void find_damage(struct wl_array *damage, const void *a, const void *b,
+                 int32_t w, int32_t h, int32_t stride, int bytes_per_pixel,
+                 const struct wl_array *hint);
+
+#endif /* #ifndef DAMAGE_H */
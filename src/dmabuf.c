@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/udmabuf.h>
+#include <linux/dma-buf.h>
+#include <wayland-client.h>
+
+#include "linux-dmabuf-v1.h"
+
+#include "dmabuf.h"
+#include "common.h"
+#include "wayland.h"
+#include "xmalloc.h"
+
+#define DRM_FORMAT_ARGB8888 0x34325241 /* AR24 */
+#define DRM_FORMAT_XRGB8888 0x34325258 /* XR24 */
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+struct dmabuf_request {
+    struct buffer *buffer;
+    struct zwp_linux_buffer_params_v1 *params;
+    dmabuf_buffer_callback callback;
+    void *data;
+    struct wl_list link;
+};
+
+static int udmabuf_fd = -1;
+/* struct dmabuf_request waiting for compositor to import the buffer */
+static struct wl_list requests = { &requests, &requests };
+
+uint32_t drm_format_from_shm(enum wl_shm_format format) {
+    switch (format) {
+    case WL_SHM_FORMAT_ARGB8888:
+        return DRM_FORMAT_ARGB8888;
+    case WL_SHM_FORMAT_XRGB8888:
+        return DRM_FORMAT_XRGB8888;
+    default:
+        return format;
+    }
+}
+
+static void params_created_handler(void *data, struct zwp_linux_buffer_params_v1 *params,
+                                   struct wl_buffer *wl_buffer) {
+    struct dmabuf_request *request = data;
+
+    DEBUG("compositor imported dmabuf %ix%i", request->buffer->width, request->buffer->height);
+    request->buffer->wl_buffer = wl_buffer;
+    zwp_linux_buffer_params_v1_destroy(params);
+    wl_list_remove(&request->link);
+
+    request->callback(request->buffer, true, request->data);
+    free(request);
+}
+
+static void params_failed_handler(void *data, struct zwp_linux_buffer_params_v1 *params) {
+    struct dmabuf_request *request = data;
+
+    WARN("compositor failed to import dmabuf");
+    zwp_linux_buffer_params_v1_destroy(params);
+    wl_list_remove(&request->link);
+
+    request->callback(request->buffer, false, request->data);
+    free(request);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener params_listener = {
+    .created = params_created_handler,
+    .failed = params_failed_handler,
+};
+
+bool create_dmabuf_buffer(struct buffer *buffer, uint32_t drm_format,
+                          uint32_t width, uint32_t height, uint32_t stride,
+                          dmabuf_buffer_callback callback, void *data) {
+    if (wayland.linux_dmabuf == NULL) {
+        DEBUG("compositor does not support zwp_linux_dmabuf_v1");
+        return false;
+    }
+
+    if (udmabuf_fd < 0) {
+        udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+        if (udmabuf_fd < 0) {
+            EWARN("failed to open /dev/udmabuf");
+            return false;
+        }
+    }
+
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = stride;
+    buffer->size = ALIGN_UP((size_t)stride * height, (size_t)sysconf(_SC_PAGESIZE));
+
+    /* udmabuf wants memfd that can't shrink under it */
+    int memfd = memfd_create("frzscr-dmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        EWARN("failed to create memfd");
+        return false;
+    }
+    if (ftruncate(memfd, buffer->size) < 0) {
+        EWARN("ftruncate() failed");
+        goto err_close_memfd;
+    }
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        EWARN("failed to seal memfd");
+        goto err_close_memfd;
+    }
+
+    struct udmabuf_create create = {
+        .memfd = memfd,
+        .flags = UDMABUF_FLAGS_CLOEXEC,
+        .offset = 0,
+        .size = buffer->size,
+    };
+    buffer->dmabuf_fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+    if (buffer->dmabuf_fd < 0) {
+        EWARN("UDMABUF_CREATE failed");
+        goto err_close_memfd;
+    }
+
+    buffer->data = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (buffer->data == MAP_FAILED) {
+        EWARN("mmap failed");
+        goto err_close_dmabuf;
+    }
+    if (madvise(buffer->data, buffer->size, MADV_DONTFORK) < 0) {
+        EWARN("madvise(MADV_DONTFORK) failed");
+    }
+    close(memfd);
+
+    buffer->dmabuf = true;
+    buffer->wl_buffer = NULL;
+
+    struct dmabuf_request *request = xcalloc(1, sizeof(*request));
+    request->buffer = buffer;
+    request->callback = callback;
+    request->data = data;
+
+    struct zwp_linux_buffer_params_v1 *params =
+        zwp_linux_dmabuf_v1_create_params(wayland.linux_dmabuf);
+    zwp_linux_buffer_params_v1_add_listener(params, &params_listener, request);
+    request->params = params;
+    wl_list_insert(&requests, &request->link);
+    /* modifier is linear (0) since udmabuf is just plain memory */
+    zwp_linux_buffer_params_v1_add(params, buffer->dmabuf_fd, 0, 0, stride, 0, 0);
+    zwp_linux_buffer_params_v1_create(params, width, height, drm_format, 0);
+
+    DEBUG("created udmabuf %ux%u stride %u format 0x%08x", width, height, stride, drm_format);
+
+    return true;
+
+err_close_dmabuf:
+    close(buffer->dmabuf_fd);
+err_close_memfd:
+    close(memfd);
+    return false;
+}
+
+void cancel_dmabuf_buffer(struct buffer *buffer) {
+    struct dmabuf_request *request;
+    wl_list_for_each(request, &requests, link) {
+        if (request->buffer == buffer) {
+            /* events for destroyed params are dropped, so callback never comes */
+            zwp_linux_buffer_params_v1_destroy(request->params);
+            wl_list_remove(&request->link);
+            free(request);
+            return;
+        }
+    }
+}
+
+void destroy_dmabuf_buffer(struct buffer *buffer) {
+    if (buffer->wl_buffer) {
+        wl_buffer_destroy(buffer->wl_buffer);
+    }
+    if (munmap(buffer->data, buffer->size) < 0) {
+        EWARN("munmap() failed");
+    }
+    close(buffer->dmabuf_fd);
+
+    buffer->wl_buffer = NULL;
+    buffer->data = NULL;
+    buffer->dmabuf = false;
+}
+
+static void dmabuf_sync(struct buffer *buffer, uint64_t flags) {
+    if (!buffer->dmabuf) {
+        return;
+    }
+
+    struct dma_buf_sync sync = { .flags = flags };
+    while (ioctl(buffer->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            EWARN("DMA_BUF_IOCTL_SYNC failed");
+            break;
+        }
+    }
+}
+
+void dmabuf_begin_cpu_access(struct buffer *buffer) {
+    dmabuf_sync(buffer, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+}
+
+void dmabuf_end_cpu_access(struct buffer *buffer) {
+    dmabuf_sync(buffer, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+void dmabuf_cleanup(void) {
+    if (udmabuf_fd >= 0) {
+        close(udmabuf_fd);
+        udmabuf_fd = -1;
+    }
+}
+
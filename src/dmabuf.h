@@ -0,0 +1,39 @@
+#ifndef DMABUF_H
+#define DMABUF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <wayland-client.h>
+
+#include "wayland.h"
+
+struct dmabuf_format {
+    uint32_t format; /* drm fourcc */
+    uint64_t modifier;
+};
+
+/* drm fourcc codes match wl_shm ones except for argb8888 and xrgb8888 */
+uint32_t drm_format_from_shm(enum wl_shm_format format);
+
+typedef void (*dmabuf_buffer_callback)(struct buffer *buffer, bool success, void *data);
+
+/*
+ * Allocates linear buffer from memfd through udmabuf, so no gpu is needed on our side,
+ * and asks compositor to import it. callback is called once compositor accepts or
+ * rejects the buffer. Returns false if buffer can't be allocated at all.
+ */
+bool create_dmabuf_buffer(struct buffer *buffer, uint32_t drm_format,
+                          uint32_t width, uint32_t height, uint32_t stride,
+                          dmabuf_buffer_callback callback, void *data);
+/* forgets import request of buffer that's still pending, its callback won't be called */
+void cancel_dmabuf_buffer(struct buffer *buffer);
+void destroy_dmabuf_buffer(struct buffer *buffer);
+
+/* brackets cpu reads of buffer->data, no-op for shm buffers */
+void dmabuf_begin_cpu_access(struct buffer *buffer);
+void dmabuf_end_cpu_access(struct buffer *buffer);
+
+void dmabuf_cleanup(void);
+
+#endif /* #ifndef DMABUF_H */
+
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "dump.h"
+#include "encode.h"
+#include "screenshot.h"
+#include "wayland.h"
+#include "dmabuf.h"
+#include "rotate.h"
+#include "config.h"
+#include "timing.h"
+#include "utils.h"
+#include "common.h"
+#include "xmalloc.h"
+
+/* multiple of rotate tile size, and small enough for the band to stay in cache */
+#define BAND_ROWS 64
+
+struct writer {
+    int fd;
+};
+
+bool parse_dump_format(const char *name, enum dump_format *format) {
+    if (STREQ(name, "ppm")) {
+        *format = DUMP_FORMAT_PPM;
+    } else if (STREQ(name, "farbfeld")) {
+        *format = DUMP_FORMAT_FARBFELD;
+    } else if (STREQ(name, "raw")) {
+        *format = DUMP_FORMAT_RAW;
+    } else if (STREQ(name, "qoi")) {
+        *format = DUMP_FORMAT_QOI;
+    } else if (STREQ(name, "png")) {
+        *format = DUMP_FORMAT_PNG;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool write_all(struct writer *writer, const void *data, size_t size) {
+    const uint8_t *p = data;
+
+    while (size > 0) {
+        ssize_t ret = write(writer->fd, p, size);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            EWARN("failed to write frame");
+            return false;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static bool write_header(struct writer *writer, struct screenshot *screenshot,
+                         enum dump_format format, int w, int h, int stride) {
+    char header[256];
+    int len;
+
+    switch (format) {
+    case DUMP_FORMAT_PPM:
+        len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", w, h);
+        break;
+    case DUMP_FORMAT_FARBFELD:
+        memcpy(header, "farbfeld", 8);
+        put_be32((uint8_t *)header + 8, w);
+        put_be32((uint8_t *)header + 12, h);
+        len = 16;
+        break;
+    case DUMP_FORMAT_RAW:
+        /* output name, wl_shm format, width, height, stride */
+        len = snprintf(header, sizeof(header), "frzscr %s 0x%08x %d %d %d\n",
+                       screenshot->output->name, screenshot->format, w, h, stride);
+        break;
+    default:
+        DIE("UNREACHABLE: dump format is %d", format);
+    }
+
+    return write_all(writer, header, len);
+}
+
+static void convert_rows(uint8_t *dest, const uint8_t *src, int w, int rows, size_t src_stride,
+                         const struct pixel_layout *l, enum dump_format format) {
+    for (int y = 0; y < rows; y++) {
+        const uint8_t *s = src + y * src_stride;
+        for (int x = 0; x < w; x++, s += l->bytes_per_pixel) {
+            uint8_t a = l->a >= 0 ? s[l->a] : 0xff;
+            if (format == DUMP_FORMAT_PPM) {
+                *dest++ = s[l->r];
+                *dest++ = s[l->g];
+                *dest++ = s[l->b];
+            } else {
+                /* 16 bit big endian, v * 257 is just the byte repeated */
+                *dest++ = s[l->r]; *dest++ = s[l->r];
+                *dest++ = s[l->g]; *dest++ = s[l->g];
+                *dest++ = s[l->b]; *dest++ = s[l->b];
+                *dest++ = a; *dest++ = a;
+            }
+        }
+    }
+}
+
+static bool dump_encoded(struct writer *writer, struct screenshot *screenshot,
+                         enum dump_format format) {
+    struct encode_source source;
+    if (!encode_source_init(&source, screenshot)) {
+        WARN("can't convert format 0x%08x of %s, use raw format instead",
+             screenshot->format, screenshot->output->name);
+        return false;
+    }
+
+    struct encoded_image image;
+    dmabuf_begin_cpu_access(screenshot->buffer);
+    if (format == DUMP_FORMAT_QOI) {
+        encode_qoi(&source, &image);
+    } else {
+        encode_png(&source, config.encode_preset, &image);
+    }
+    dmabuf_end_cpu_access(screenshot->buffer);
+
+    bool ok = true;
+    for (size_t i = 0; i < image.n_parts && ok; i++) {
+        ok = write_all(writer, image.parts[i].data, image.parts[i].size);
+    }
+    encoded_image_free(&image);
+
+    return ok;
+}
+
+static bool dump_screenshot(struct writer *writer, struct screenshot *screenshot,
+                            enum dump_format format) {
+    if (format == DUMP_FORMAT_QOI || format == DUMP_FORMAT_PNG) {
+        return dump_encoded(writer, screenshot, format);
+    }
+
+    struct buffer *buffer = screenshot->buffer;
+    const char *name = screenshot->output->name;
+    enum wl_output_transform transform = screenshot->output->transform;
+    int bpp = get_bytes_per_pixel(screenshot->format);
+
+    struct pixel_layout layout;
+    if (format != DUMP_FORMAT_RAW && !get_pixel_layout(screenshot->format, &layout)) {
+        WARN("can't convert format 0x%08x of %s, use raw format instead", screenshot->format, name);
+        return false;
+    }
+
+    bool swap_axes = transform == WL_OUTPUT_TRANSFORM_90 || transform == WL_OUTPUT_TRANSFORM_270
+                  || transform == WL_OUTPUT_TRANSFORM_FLIPPED_90
+                  || transform == WL_OUTPUT_TRANSFORM_FLIPPED_270;
+    int w = swap_axes ? buffer->height : buffer->width;
+    int h = swap_axes ? buffer->width : buffer->height;
+    bool rotate = transform != WL_OUTPUT_TRANSFORM_NORMAL;
+    size_t stride = rotate ? (size_t)w * bpp : (size_t)buffer->stride;
+
+    if (!write_header(writer, screenshot, format, w, h, stride)) {
+        return false;
+    }
+
+    uint8_t *band = rotate ? xmalloc(stride * BAND_ROWS) : NULL;
+    uint8_t *out = NULL;
+    if (format != DUMP_FORMAT_RAW) {
+        out = xmalloc((size_t)w * (format == DUMP_FORMAT_PPM ? 3 : 8) * BAND_ROWS);
+    }
+
+    bool ok = true;
+    dmabuf_begin_cpu_access(buffer);
+    for (int y = 0; y < h && ok; y += BAND_ROWS) {
+        int rows = y + BAND_ROWS > h ? h - y : BAND_ROWS;
+
+        const uint8_t *pixels;
+        if (rotate) {
+            rotate_image_rows(band, buffer->data, buffer->width, buffer->height, bpp,
+                              transform, y, rows);
+            pixels = band;
+        } else {
+            pixels = (const uint8_t *)buffer->data + y * stride;
+        }
+
+        /*
+         * not vmspliced into pipes: pipe would keep referencing pages of capture buffer,
+         * which refresh or the next freeze captures into while reader is still behind
+         */
+        if (format == DUMP_FORMAT_RAW) {
+            ok = write_all(writer, pixels, stride * rows);
+        } else {
+            convert_rows(out, pixels, w, rows, stride, &layout, format);
+            ok = write_all(writer, out, (size_t)w * (format == DUMP_FORMAT_PPM ? 3 : 8) * rows);
+        }
+    }
+    dmabuf_end_cpu_access(buffer);
+
+    free(band);
+    free(out);
+
+    return ok;
+}
+
+void dump_screenshots(struct wl_list *screenshots, const char *path, enum dump_format format) {
+    uint64_t start = timing_now();
+    struct writer writer;
+    bool is_stdout = STREQ(path, "-");
+
+    if (is_stdout) {
+        writer.fd = STDOUT_FILENO;
+    } else {
+        writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (writer.fd < 0) {
+            EWARN("failed to open %s", path);
+            return;
+        }
+    }
+
+    /* reader going away shouldn't kill us while screen is frozen, and child gets default back */
+    struct sigaction ignore = { .sa_handler = SIG_IGN }, old_sigpipe;
+    sigaction(SIGPIPE, &ignore, &old_sigpipe);
+
+    struct screenshot *screenshot;
+    wl_list_for_each(screenshot, screenshots, link) {
+        if (!dump_screenshot(&writer, screenshot, format)) {
+            break;
+        }
+        DEBUG("wrote frame of %s to %s", screenshot->output->name, path);
+    }
+
+    sigaction(SIGPIPE, &old_sigpipe, NULL);
+
+    if (!is_stdout) {
+        close(writer.fd);
+    } else if (!config.fork_child) {
+        /* nothing else is going to be written, let whoever reads it see EOF */
+        int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+
+    timing_record("dump", NULL, start);
+}
@@ -0,0 +1,19 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdbool.h>
+#include <wayland-util.h>
+
+#include "config.h"
+
+/* returns false if name is not a known format */
+bool parse_dump_format(const char *name, enum dump_format *format);
+
+/*
+ * Writes every screenshot in the list to path ("-" for stdout) one after another, rotated
+ * to logical orientation. Frames are rotated and converted a few rows at a time, untransformed
+ * raw frames are written straight from the capture buffer.
+ */
+void dump_screenshots(struct wl_list *screenshots, const char *path, enum dump_format format);
+
+#endif /* #ifndef DUMP_H */
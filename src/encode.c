@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "encode.h"
+#include "wayland.h"
+#include "rotate.h"
+#include "threadpool.h"
+#include "xmalloc.h"
+
+bool encode_source_init(struct encode_source *source, struct screenshot *screenshot) {
+    struct buffer *buffer = screenshot->buffer;
+    enum wl_output_transform transform = screenshot->output->transform;
+
+    if (!get_pixel_layout(screenshot->format, &source->layout)) {
+        return false;
+    }
+
+    bool swap_axes = transform == WL_OUTPUT_TRANSFORM_90 || transform == WL_OUTPUT_TRANSFORM_270
+                  || transform == WL_OUTPUT_TRANSFORM_FLIPPED_90
+                  || transform == WL_OUTPUT_TRANSFORM_FLIPPED_270;
+
+    source->buffer = buffer;
+    source->transform = transform;
+    source->width = swap_axes ? buffer->height : buffer->width;
+    source->height = swap_axes ? buffer->width : buffer->height;
+    source->channels = source->layout.a >= 0 ? 4 : 3;
+
+    return true;
+}
+
+size_t encode_source_tmp_size(const struct encode_source *source, int rows) {
+    if (source->transform == WL_OUTPUT_TRANSFORM_NORMAL) {
+        return 0;
+    }
+    return (size_t)source->width * source->layout.bytes_per_pixel * rows;
+}
+
+void encode_source_rows(const struct encode_source *source, uint8_t *dest, uint8_t *tmp,
+                        int y, int rows) {
+    const struct pixel_layout *l = &source->layout;
+    struct buffer *buffer = source->buffer;
+    const uint8_t *src;
+    size_t src_stride;
+
+    if (source->transform == WL_OUTPUT_TRANSFORM_NORMAL) {
+        src_stride = buffer->stride;
+        src = (const uint8_t *)buffer->data + y * src_stride;
+    } else {
+        src_stride = (size_t)source->width * l->bytes_per_pixel;
+        rotate_image_rows(tmp, buffer->data, buffer->width, buffer->height, l->bytes_per_pixel,
+                          source->transform, y, rows);
+        src = tmp;
+    }
+
+    for (int row = 0; row < rows; row++) {
+        const uint8_t *s = src + row * src_stride;
+        if (source->channels == 4) {
+            for (int x = 0; x < source->width; x++, s += l->bytes_per_pixel) {
+                *dest++ = s[l->r];
+                *dest++ = s[l->g];
+                *dest++ = s[l->b];
+                *dest++ = s[l->a];
+            }
+        } else {
+            for (int x = 0; x < source->width; x++, s += l->bytes_per_pixel) {
+                *dest++ = s[l->r];
+                *dest++ = s[l->g];
+                *dest++ = s[l->b];
+            }
+        }
+    }
+}
+
+int encode_rows_per_task(const struct encode_source *source, int band_rows) {
+    /* few tasks per thread so faster threads can pick up slack */
+    unsigned int tasks = threadpool_size() * 2;
+    int rows = (source->height + tasks - 1) / tasks;
+    rows = (rows + band_rows - 1) / band_rows * band_rows;
+    return rows;
+}
+
+void encoded_image_free(struct encoded_image *image) {
+    for (size_t i = 0; i < image->n_parts; i++) {
+        free(image->parts[i].data);
+    }
+    free(image->parts);
+    image->parts = NULL;
+    image->n_parts = 0;
+}
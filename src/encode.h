@@ -0,0 +1,53 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "screenshot.h"
+#include "config.h"
+#include "utils.h"
+
+/* screenshot pixels in logical orientation, handed out as packed 8 bit RGB or RGBA rows */
+struct encode_source {
+    struct buffer *buffer;
+    enum wl_output_transform transform;
+    struct pixel_layout layout;
+    int width, height;
+    /* 3 or 4, depending on whether format has alpha */
+    int channels;
+};
+
+struct encoded_part {
+    uint8_t *data;
+    size_t size;
+};
+
+/* encoded file as pieces that have to be written out in order */
+struct encoded_image {
+    struct encoded_part *parts;
+    size_t n_parts;
+};
+
+/* returns false if format of screenshot can't be converted */
+bool encode_source_init(struct encode_source *source, struct screenshot *screenshot);
+
+/* size of scratch buffer encode_source_rows needs for that many rows */
+size_t encode_source_tmp_size(const struct encode_source *source, int rows);
+
+/* packs rows [y, y + rows) into dest */
+void encode_source_rows(const struct encode_source *source, uint8_t *dest, uint8_t *tmp,
+                        int y, int rows);
+
+/* rows each task of an encoder gets, every task except last is a multiple of band_rows */
+int encode_rows_per_task(const struct encode_source *source, int band_rows);
+
+void encoded_image_free(struct encoded_image *image);
+
+/* encoders split image in row ranges that are encoded on threadpool independently */
+void encode_qoi(const struct encode_source *source, struct encoded_image *image);
+void encode_png(const struct encode_source *source, enum encode_preset preset,
+                struct encoded_image *image);
+
+#endif /* #ifndef ENCODE_H */
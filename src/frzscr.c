@@ -1,12 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <wayland-util.h>
 
 #include "screenshot.h"
@@ -15,6 +21,15 @@
 #include "overlay.h"
 #include "config.h"
 #include "utils.h"
+#include "threadpool.h"
+#include "shm.h"
+#include "timing.h"
+#include "timer.h"
+#include "daemon.h"
+#include "handoff.h"
+#include "dump.h"
+#include "select.h"
+#include "pick.h"
 #include "xmalloc.h"
 
 #define EPOLL_MAX_EVENTS 16
@@ -26,14 +41,39 @@ void print_help_and_exit(FILE *stream, int exit_status) {
         "frzscr - freeze screen\n"
         "\n"
         "usage:\n"
-        "    frzscr [-Cvh] [-o OUTPUT] [-t TIMEOUT] [-s SIGNUM] [-c CMD [ARG]...]\n"
+        "    frzscr [-BCRPdDGpevh] [-o OUTPUT] [-g GEOMETRY] [-t TIMEOUT] [-s SIGNUM] [-j THREADS]\n"
+        "           [-W TIMEOUT] [-H thp|hugetlb] [-T FILE] [-S SOCKET]\n"
+        "           [-w FILE [-f FORMAT] [-z PRESET]] [-c CMD [ARG]...]\n"
         "\n"
         "command line options:\n"
         "    -o OUTPUT       only freeze this output (eg eDP-1)\n"
-        "    -t TIMEOUT      kill child (with -c) and exit after TIMEOUT seconds\n"
+        "    -g GEOMETRY     only freeze region \"X,Y WxH\" in global coordinates (eg from slurp)\n"
+        "    -G              select region with pointer once frozen, print it and pass it to\n"
+        "                    child as FRZSCR_SELECTION\n"
+        "    -p              pick color with pointer once frozen, print it and pass it to\n"
+        "                    child as FRZSCR_COLOR\n"
+        "    -t TIMEOUT      kill child (with -c) and exit after TIMEOUT seconds, or\n"
+        "                    milliseconds with ms suffix (eg 1.5, 250ms)\n"
         "    -s SIGNUM       signal that will be sent to child instead of SIGTERM\n"
+        "    -W TIMEOUT      leave outputs that aren't captured within TIMEOUT unfrozen\n"
+        "                    (default: 2s, same syntax as -t)\n"
+        "    -j THREADS      use THREADS threads for image processing (default: all cpus)\n"
+        "    -H thp|hugetlb  back buffers with transparent huge pages or hugetlbfs\n"
+        "    -P              prefault buffers when allocating them\n"
+        "    -d              capture into dma-bufs if compositor supports it\n"
+        "    -T FILE         write phase timings to FILE in trace event format\n"
+        "    -D              run as daemon and freeze screen on requests from other instances\n"
+        "    -S SOCKET       daemon socket path (default: $XDG_RUNTIME_DIR/frzscr-$WAYLAND_DISPLAY.sock)\n"
+        "    -e              pass captured frames to child as sealed memfds (see FRZSCR_* in man)\n"
+        "    -w FILE         write captured frames to FILE (- for stdout) once frozen\n"
+        "    -f FORMAT       format for -w: ppm (default), farbfeld, qoi, png or raw\n"
+        "    -z PRESET       png compression: none, fast (default), balanced or small\n"
         "    -c CMD [ARG]... fork CMD and wait for it to exit (terminates option list)\n"
+        "    -B              start CMD before freezing, it can wait for the freeze by reading\n"
+        "                    a line from fd FRZSCR_READY_FD\n"
         "    -C              include cursor in overlay\n"
+        "    -R              rotate screenshot into a separate buffer instead of\n"
+        "                    letting compositor apply output transform\n"
         "    -v              enable debug output\n"
         "    -h              print this help message and exit\n"
     ;
@@ -45,7 +85,7 @@ void print_help_and_exit(FILE *stream, int exit_status) {
 void parse_command_line(int *argc, char ***argv) {
     int opt;
 
-    while ((opt = getopt(*argc, *argv, "o:t:s:Chv")) != -1) {
+    while ((opt = getopt(*argc, *argv, "o:t:s:W:j:g:H:T:S:w:f:z:BCRPdDGpehv")) != -1) {
         switch (opt) {
         case 'o':
             DEBUG("output name supplied on command line: %s", optarg);
@@ -53,13 +93,15 @@ void parse_command_line(int *argc, char ***argv) {
             break;
         case 't':
             DEBUG("timeout supplied on command line: %s", optarg);
-            unsigned long t;
-            if (!str_to_ulong(optarg, &t)) {
+            if (!parse_duration(optarg, &config.timeout_ms)) {
                 DIE("invalid timeout specified");
-            } else if (t > UINT_MAX) {
-                DIE("timeout is too big");
             }
-            config.timeout = t;
+            break;
+        case 'W':
+            DEBUG("capture timeout supplied on command line: %s", optarg);
+            if (!parse_duration(optarg, &config.capture_timeout_ms) || config.capture_timeout_ms == 0) {
+                DIE("invalid capture timeout specified");
+            }
             break;
         case 's':
             DEBUG("signal supplied on command line: %s", optarg);
@@ -69,9 +111,93 @@ void parse_command_line(int *argc, char ***argv) {
             }
             config.child_kill_signal = sig;
             break;
+        case 'j':
+            DEBUG("thread count supplied on command line: %s", optarg);
+            unsigned long threads;
+            if (!str_to_ulong(optarg, &threads) || threads < 1) {
+                DIE("invalid thread count specified");
+            } else if (threads > UINT_MAX) {
+                DIE("thread count is too big");
+            }
+            config.threads = threads;
+            break;
+        case 'g':
+            DEBUG("region supplied on command line: %s", optarg);
+            if (!parse_geometry(optarg, &config.region.x, &config.region.y,
+                                &config.region.w, &config.region.h)) {
+                DIE("invalid region specified");
+            }
+            config.use_region = true;
+            break;
+        case 'H':
+            DEBUG("huge page mode supplied on command line: %s", optarg);
+            if (STREQ(optarg, "thp")) {
+                config.shm_backing = SHM_BACKING_THP;
+            } else if (STREQ(optarg, "hugetlb")) {
+                config.shm_backing = SHM_BACKING_HUGETLB;
+            } else {
+                DIE("invalid huge page mode specified");
+            }
+            break;
+        case 'T':
+            DEBUG("trace file supplied on command line: %s", optarg);
+            config.trace_file = xstrdup(optarg);
+            break;
+        case 'S':
+            DEBUG("socket path supplied on command line: %s", optarg);
+            config.socket_path = xstrdup(optarg);
+            break;
+        case 'w':
+            DEBUG("dump file supplied on command line: %s", optarg);
+            config.dump_file = xstrdup(optarg);
+            break;
+        case 'f':
+            DEBUG("dump format supplied on command line: %s", optarg);
+            if (!parse_dump_format(optarg, &config.dump_format)) {
+                DIE("invalid dump format specified");
+            }
+            break;
+        case 'z':
+            DEBUG("compression preset supplied on command line: %s", optarg);
+            if (STREQ(optarg, "none")) {
+                config.encode_preset = ENCODE_PRESET_NONE;
+            } else if (STREQ(optarg, "fast")) {
+                config.encode_preset = ENCODE_PRESET_FAST;
+            } else if (STREQ(optarg, "balanced")) {
+                config.encode_preset = ENCODE_PRESET_BALANCED;
+            } else if (STREQ(optarg, "small")) {
+                config.encode_preset = ENCODE_PRESET_SMALL;
+            } else {
+                DIE("invalid compression preset specified");
+            }
+            break;
+        case 'D':
+            config.daemon_mode = true;
+            break;
+        case 'B':
+            config.prespawn_child = true;
+            break;
+        case 'G':
+            config.select_region = true;
+            break;
+        case 'p':
+            config.pick_color = true;
+            break;
+        case 'e':
+            config.export_frames = true;
+            break;
+        case 'P':
+            config.shm_prefault = true;
+            break;
+        case 'd':
+            config.dmabuf = true;
+            break;
         case 'C':
             config.cursor = true;
             break;
+        case 'R':
+            config.copy_overlay = true;
+            break;
         case 'h':
             print_help_and_exit(stdout, 0);
             break;
@@ -86,10 +212,491 @@ void parse_command_line(int *argc, char ***argv) {
     }
 }
 
+/* stores part of output to freeze relative to it, returns false if output isn't frozen at all */
+static bool get_target_region(struct output *output, struct rect *region) {
+    if (config.output != NULL && !STREQ(output->name, config.output)) {
+        return false;
+    }
+    if (!config.use_region) {
+        *region = (struct rect){
+            .x = 0,
+            .y = 0,
+            .w = output->logical_geometry.w,
+            .h = output->logical_geometry.h,
+        };
+        return true;
+    }
+
+    struct rect rect = {
+        .x = config.region.x,
+        .y = config.region.y,
+        .w = config.region.w,
+        .h = config.region.h,
+    };
+    return output_intersect(output, &rect, region);
+}
+
+/* mode is in buffer pixels, and compositors hand out 4 bytes per pixel formats pretty much always */
+static size_t estimate_shm_size(struct output *output, const struct rect *region) {
+    size_t size = (size_t)output->mode.w * output->mode.h * 4;
+    /* only screencopy can capture part of an output */
+    if (wayland.screencopy_manager != NULL && !output_region_is_whole(output, region)) {
+        size = size * region->w / output->logical_geometry.w * region->h / output->logical_geometry.h;
+    }
+    /*
+     * with -d screenshots hopefully end up in dmabufs and pool only grows if they don't,
+     * with -e they always get memfds of their own
+     */
+    int n_buffers = (config.dmabuf || config.export_frames ? 0 : 1) + (config.copy_overlay ? 1 : 0);
+    return size * n_buffers;
+}
+
+static void on_screenshot_ready(struct screenshot *screenshot, void *data) {
+    overlay_set_screenshot(data, screenshot);
+}
+
+/* outputs that couldn't be captured are left unfrozen instead of aborting the freeze */
+static void drop_failed_outputs(void) {
+    struct screenshot *screenshot, *screenshot_tmp;
+    wl_list_for_each_safe(screenshot, screenshot_tmp, &wayland.screenshots, link) {
+        if (screenshot->state != SCREENSHOT_FAILED) {
+            continue;
+        }
+        overlay_cleanup(screenshot->on_ready_data);
+        screenshot_cleanup(screenshot);
+    }
+}
+
+/* returns 0, ENODEV if no output matched or EIO if none of them could be captured */
+static int freeze(uint64_t start) {
+    struct output *output;
+    struct rect region;
+    size_t shm_size = 0;
+    bool output_found = false;
+    wl_list_for_each(output, &wayland.outputs, link) {
+        if (get_target_region(output, &region)) {
+            shm_size += estimate_shm_size(output, &region);
+            output_found = true;
+        }
+    }
+    if (!output_found) {
+        return ENODEV;
+    }
+    shm_pool_reserve(shm_size);
+
+    /* overlays are set up while captures are in flight and shown as soon as frames arrive */
+    wl_list_for_each(output, &wayland.outputs, link) {
+        if (get_target_region(output, &region)) {
+            struct overlay *overlay = create_overlay(output, &region);
+            wl_list_insert(&wayland.overlays, &overlay->link);
+            wl_list_insert(&wayland.screenshots,
+                           &take_screenshot(output, &region, on_screenshot_ready, overlay)->link);
+        }
+    }
+    wait_for_screenshots(&wayland.screenshots);
+    drop_failed_outputs();
+    if (wl_list_empty(&wayland.screenshots)) {
+        wayland_prune_outputs();
+        return EIO;
+    }
+    wait_for_overlays(&wayland.overlays);
+
+    wl_display_roundtrip(wayland.display);
+    timing_record("freeze", NULL, start);
+
+    return 0;
+}
+
+/* captures outputs again with overlays hidden and only redraws what changed */
+static void refresh(void) {
+    uint64_t start = timing_now();
+
+    /* hide and capture requests go out together, so the next frame is captured without overlays */
+    struct overlay *overlay;
+    wl_list_for_each(overlay, &wayland.overlays, link) {
+        overlay_hide(overlay);
+        refresh_screenshot(overlay->screenshot);
+    }
+    wait_for_screenshots(&wayland.screenshots);
+    wait_for_overlays(&wayland.overlays);
+
+    wl_display_flush(wayland.display);
+    timing_record("refresh", NULL, start);
+}
+
+/*
+ * Unmaps overlays and flushes, so that the screen is live again before anything slow
+ * like killing the child or unmapping buffers happens. start is when unfreeze was triggered.
+ */
+static void hide_overlays(uint64_t start) {
+    bool hidden = false;
+    struct overlay *overlay;
+    wl_list_for_each(overlay, &wayland.overlays, link) {
+        hidden |= overlay->mapped;
+        overlay_unmap(overlay);
+    }
+    if (!hidden) {
+        return;
+    }
+    wl_display_flush(wayland.display);
+    timing_record("unfreeze", NULL, start);
+}
+
+static void unfreeze(void) {
+    hide_overlays(timing_now());
+
+    /* overlays go first since they might still have screenshot buffers attached */
+    struct overlay *overlay, *overlay_tmp;
+    wl_list_for_each_safe(overlay, overlay_tmp, &wayland.overlays, link) {
+        overlay_cleanup(overlay);
+    }
+
+    struct screenshot *screenshot, *screenshot_tmp;
+    wl_list_for_each_safe(screenshot, screenshot_tmp, &wayland.screenshots, link) {
+        screenshot_cleanup(screenshot);
+    }
+
+    wayland_prune_outputs();
+    wl_display_flush(wayland.display);
+}
+
+/*
+ * posix_spawn shares our address space until exec instead of copying page tables
+ * of every mapped frame like fork would, so spawning doesn't get slower with more outputs.
+ */
+static pid_t spawn_child(char **argv) {
+    posix_spawnattr_t attr;
+    if (posix_spawnattr_init(&attr) != 0) {
+        DIE("posix_spawnattr_init() failed");
+    }
+    /* child gets its own process group, so that all of its children can be killed too */
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int ret = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        EERR("failed to start %s", argv[0]);
+        return -1;
+    }
+    DEBUG("started child with pid %d", pid);
+    return pid;
+}
+
+/*
+ * Pipe the prespawned child waits on. Read end is inherited by the child and its
+ * number is passed in FRZSCR_READY_FD, write end is returned.
+ */
+static int create_ready_pipe(int *read_fd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        EDIE("pipe2() failed");
+    }
+    if (fcntl(fds[0], F_SETFD, 0) < 0) {
+        EDIE("failed to clear FD_CLOEXEC");
+    }
+
+    char fd_str[16];
+    snprintf(fd_str, sizeof(fd_str), "%d", fds[0]);
+    if (setenv("FRZSCR_READY_FD", fd_str, 1) < 0) {
+        EDIE("failed to set FRZSCR_READY_FD");
+    }
+    *read_fd = fds[0];
+    return fds[1];
+}
+
+/* if freeze fails we exit without writing, and child reads EOF instead of a line */
+static void release_child(int ready_fd) {
+    /* child might have closed its end already, that shouldn't kill us */
+    struct sigaction ignore = { .sa_handler = SIG_IGN }, old_sigpipe;
+    sigaction(SIGPIPE, &ignore, &old_sigpipe);
+    if (write(ready_fd, "\n", 1) < 0) {
+        EWARN("failed to notify child that screen is frozen");
+    }
+    sigaction(SIGPIPE, &old_sigpipe, NULL);
+    close(ready_fd);
+}
+
+static void timeout_expired(void *data) {
+    bool *timed_out = data;
+
+    DEBUG("timeout expired");
+    *timed_out = true;
+}
+
+static int setup_signalfd(void) {
+    /* block signals so we can catch them later */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        EDIE("failed to block signals");
+    }
+
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        EDIE("failed to set up signalfd");
+    }
+
+    return signal_fd;
+}
+
+static void epoll_add(int epoll_fd, int fd) {
+    struct epoll_event epoll_event = {0};
+
+    epoll_event.events = EPOLLIN;
+    epoll_event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &epoll_event) == -1) {
+        EDIE("failed to add fd %d to epoll list", fd);
+    }
+}
+
+static void handle_daemon_client(int client_fd, int *frozen_by) {
+    struct daemon_request request;
+
+    if (!daemon_recv_request(client_fd, &request)) {
+        DEBUG("client %d disconnected", client_fd);
+        if (*frozen_by == client_fd) {
+            unfreeze();
+            timing_report();
+            timing_cleanup();
+            *frozen_by = -1;
+        }
+        close(client_fd);
+        return;
+    }
+
+    switch (request.command) {
+    case DAEMON_FREEZE:
+        DEBUG("client %d requested freeze of output %s", client_fd,
+              request.output[0] != '\0' ? request.output : "(all)");
+        if (*frozen_by >= 0) {
+            daemon_send_reply(client_fd, EBUSY);
+            break;
+        }
+
+        free(config.output);
+        config.output = request.output[0] != '\0' ? xstrdup(request.output) : NULL;
+        config.cursor = request.flags & DAEMON_FLAG_CURSOR;
+        config.copy_overlay = request.flags & DAEMON_FLAG_COPY_OVERLAY;
+        config.use_region = request.flags & DAEMON_FLAG_REGION;
+        config.region.x = request.region_x;
+        config.region.y = request.region_y;
+        config.region.w = request.region_width;
+        config.region.h = request.region_height;
+
+        int error = freeze(timing_now());
+        if (error != 0) {
+            daemon_send_reply(client_fd, error);
+            break;
+        }
+        *frozen_by = client_fd;
+        daemon_send_reply(client_fd, 0);
+        break;
+    case DAEMON_REFRESH:
+        DEBUG("client %d requested refresh", client_fd);
+        if (*frozen_by != client_fd) {
+            daemon_send_reply(client_fd, EPERM);
+            break;
+        }
+
+        refresh();
+        daemon_send_reply(client_fd, 0);
+        break;
+    case DAEMON_UNFREEZE:
+        DEBUG("client %d requested unfreeze", client_fd);
+        if (*frozen_by != client_fd) {
+            daemon_send_reply(client_fd, EPERM);
+            break;
+        }
+
+        unfreeze();
+        timing_report();
+        timing_cleanup();
+        *frozen_by = -1;
+        daemon_send_reply(client_fd, 0);
+        break;
+    default:
+        WARN("client %d sent unknown command %u", client_fd, request.command);
+        daemon_send_reply(client_fd, EINVAL);
+        break;
+    }
+}
+
+static void run_daemon(void) {
+    char *socket_path = daemon_socket_path();
+    if (socket_path == NULL) {
+        DIE("XDG_RUNTIME_DIR is not set, use -S to specify socket path");
+    }
+
+    wayland_init();
+
+    int listen_fd = daemon_listen(socket_path);
+    int signal_fd = setup_signalfd();
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        EDIE("failed to set up epoll");
+    }
+    epoll_add(epoll_fd, wayland.fd);
+    epoll_add(epoll_fd, signal_fd);
+    epoll_add(epoll_fd, listen_fd);
+
+    /* client that currently holds the screen frozen */
+    int frozen_by = -1;
+
+    int number_fds = -1;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (1) {
+        /* requests are only flushed by roundtrips otherwise */
+        wl_display_flush(wayland.display);
+
+        do {
+            number_fds = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        } while (number_fds == -1 && errno == EINTR);
+
+        if (number_fds == -1) {
+            EDIE("epoll_wait error");
+        }
+
+        for (int n = 0; n < number_fds; n++) {
+            int fd = events[n].data.fd;
+            if (fd == wayland.fd) {
+                if (wl_display_dispatch(wayland.display) == -1) {
+                    EDIE("wl_display_dispatch failed");
+                }
+            } else if (fd == signal_fd) {
+                struct signalfd_siginfo siginfo;
+                ssize_t bytes_read = read(signal_fd, &siginfo, sizeof(siginfo));
+                if (bytes_read != sizeof(siginfo)) {
+                    EDIE("failed to read signalfd_siginfo from signal_fd");
+                }
+
+                if (siginfo.ssi_signo == SIGINT || siginfo.ssi_signo == SIGTERM) {
+                    DEBUG("received signal %d, exiting", siginfo.ssi_signo);
+                    goto cleanup;
+                } else if (siginfo.ssi_signo == SIGUSR1 && frozen_by >= 0) {
+                    DEBUG("received SIGUSR1, refreshing");
+                    refresh();
+                }
+            } else if (fd == listen_fd) {
+                int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (client_fd < 0) {
+                    EWARN("failed to accept connection");
+                    continue;
+                }
+                DEBUG("client %d connected", client_fd);
+                epoll_add(epoll_fd, client_fd);
+            } else {
+                handle_daemon_client(fd, &frozen_by);
+            }
+        }
+    }
+
+cleanup:
+    if (frozen_by >= 0) {
+        unfreeze();
+    }
+
+    close(listen_fd);
+    if (unlink(socket_path) < 0) {
+        EWARN("failed to remove socket %s", socket_path);
+    }
+    free(socket_path);
+
+    wayland_cleanup();
+    threadpool_cleanup();
+
+    close(epoll_fd);
+    close(signal_fd);
+
+    exit(0);
+}
+
+/* returns -1 if there is no daemon to forward to */
+static int freeze_with_daemon(void) {
+    char *socket_path = daemon_socket_path();
+    if (socket_path == NULL) {
+        return -1;
+    }
+    int daemon_fd = daemon_connect(socket_path);
+    free(socket_path);
+    if (daemon_fd < 0) {
+        return -1;
+    }
+
+    struct daemon_request request = {
+        .command = DAEMON_FREEZE,
+        .flags = (config.cursor ? DAEMON_FLAG_CURSOR : 0)
+               | (config.copy_overlay ? DAEMON_FLAG_COPY_OVERLAY : 0),
+    };
+    if (config.use_region) {
+        request.flags |= DAEMON_FLAG_REGION;
+        request.region_x = config.region.x;
+        request.region_y = config.region.y;
+        request.region_width = config.region.w;
+        request.region_height = config.region.h;
+    }
+    if (config.output != NULL) {
+        if (strlen(config.output) >= sizeof(request.output)) {
+            DIE("output name %s is too long", config.output);
+        }
+        strcpy(request.output, config.output);
+    }
+
+    if (!daemon_send_request(daemon_fd, &request)) {
+        DIE("failed to send freeze request to daemon");
+    }
+    int32_t error = daemon_recv_reply(daemon_fd);
+    if (error < 0) {
+        DIE("daemon disconnected");
+    } else if (error == ENODEV) {
+        DIE("output %s not found", config.output);
+    } else if (error == EBUSY) {
+        DIE("screen is already frozen by another client");
+    } else if (error == EIO) {
+        DIE("daemon failed to capture any output");
+    } else if (error > 0) {
+        errno = error;
+        EDIE("daemon failed to freeze screen");
+    }
+
+    return daemon_fd;
+}
+
+static void refresh_with_daemon(int daemon_fd) {
+    struct daemon_request request = { .command = DAEMON_REFRESH };
+
+    if (daemon_send_request(daemon_fd, &request) && daemon_recv_reply(daemon_fd) != 0) {
+        WARN("daemon failed to refresh screen");
+    }
+}
+
+static void unfreeze_with_daemon(int daemon_fd) {
+    struct daemon_request request = { .command = DAEMON_UNFREEZE };
+
+    /* wait for reply so the screen is unfrozen by the time we exit */
+    if (daemon_send_request(daemon_fd, &request) && daemon_recv_reply(daemon_fd) != 0) {
+        WARN("daemon failed to unfreeze screen");
+    }
+    close(daemon_fd);
+}
+
 int main(int argc, char **argv) {
+    uint64_t start = timing_now();
     int exit_status = 0;
     int signal_fd = -1;
     int epoll_fd = -1;
+    int daemon_fd = -1;
+    /* when main loop woke up for the event that ends the freeze */
+    uint64_t unfreeze_start = 0;
     pid_t child_pid = -1;
 
     int child_argc = -1;
@@ -111,6 +718,9 @@ int main(int argc, char **argv) {
     }
 
     if (config.fork_child) {
+        if (config.daemon_mode) {
+            DIE("-c can't be used with -D");
+        }
         if (child_argc < 1) {
             DIE("empty child command");
         }
@@ -120,90 +730,144 @@ int main(int argc, char **argv) {
         }
     }
 
-    wayland_init();
+    if (config.daemon_mode) {
+        if (config.select_region) {
+            DIE("-G can't be used with -D");
+        }
+        if (config.pick_color) {
+            DIE("-p can't be used with -D");
+        }
+        run_daemon();
+    }
 
-    struct output *output;
-    if (config.output == NULL) {
-        wl_list_for_each(output, &wayland.outputs, link) {
-            wl_list_insert(&wayland.screenshots, &take_screenshot(output)->link);
+    if (config.select_region && config.pick_color) {
+        DIE("-G and -p can't be used together");
+    }
+
+    int ready_fd = -1;
+    if (config.prespawn_child) {
+        if (!config.fork_child) {
+            DIE("-B needs a command given with -c");
         }
-    } else {
-        bool output_found = false;
-        wl_list_for_each(output, &wayland.outputs, link) {
-            if (STREQ(output->name, config.output)) {
-                wl_list_insert(&wayland.screenshots, &take_screenshot(output)->link);
-                output_found = true;
-                break;
-            }
+        /* these are only known once frozen, but child's environment is fixed at start */
+        if (config.select_region || config.pick_color || config.export_frames) {
+            DIE("-B can't be used with -G, -p or -e");
+        }
+
+        /* child can exit before freeze is done, SIGCHLD mustn't get lost until main loop */
+        signal_fd = setup_signalfd();
+
+        uint64_t phase_start = timing_now();
+        int read_fd;
+        ready_fd = create_ready_pipe(&read_fd);
+        child_pid = spawn_child(child_argv);
+        close(read_fd);
+        if (child_pid < 0) {
+            exit(1);
         }
-        if (!output_found) {
+        timing_record("spawn", NULL, phase_start);
+    }
+
+    /* selection needs input on overlays and written or exported frames have to be ours */
+    bool bypass_daemon = config.select_region || config.pick_color || config.export_frames
+                         || config.dump_file != NULL;
+    daemon_fd = bypass_daemon ? -1 : freeze_with_daemon();
+    if (daemon_fd >= 0) {
+        timing_record("freeze", NULL, start);
+    } else {
+        uint64_t phase_start = timing_now();
+        wayland_init();
+        timing_record("connect", NULL, phase_start);
+
+        int error = freeze(start);
+        if (error == ENODEV) {
             DIE("output %s not found", config.output);
+        } else if (error != 0) {
+            DIE("failed to capture any output");
         }
     }
 
-    struct screenshot *screenshot, *screenshot_tmp;
-    wl_list_for_each(screenshot, &wayland.screenshots, link) {
-        wl_list_insert(&wayland.overlays, &create_overlay_from_screenshot(screenshot)->link);
+    /* counts from the freeze, so it also ends selecting or picking that nobody finishes */
+    bool timed_out = false;
+    if (config.timeout_ms > 0) {
+        DEBUG("setting timeout for %" PRIu64 " ms", config.timeout_ms);
+        timer_add(timing_now() + config.timeout_ms * 1000000, timeout_expired, &timed_out);
     }
 
-    wl_display_roundtrip(wayland.display);
+    if (config.select_region) {
+        struct rect selection;
+        if (!select_region(&wayland.overlays, &timed_out, &selection)) {
+            DEBUG("region selection cancelled");
+            exit_status = 1;
+            goto cleanup;
+        }
 
-    if (config.fork_child) {
-        child_pid = fork();
-        switch (child_pid) {
-        case -1:
-            EDIE("fork() failed");
-        case 0:
-            // child
-            if (setpgid(0, 0) < 0) {
-                EWARN("setpgid failed, might fail to kill all children");
-            }
-            execvp(child_argv[0], child_argv);
-            EDIE("execvp() failed");
-        default:
-            // parent, just continue
-            break;
+        char geometry[64];
+        snprintf(geometry, sizeof(geometry), "%d,%d %dx%d",
+                 selection.x, selection.y, selection.w, selection.h);
+        printf("%s\n", geometry);
+        fflush(stdout);
+        if (setenv("FRZSCR_SELECTION", geometry, 1) < 0) {
+            EWARN("failed to set FRZSCR_SELECTION");
         }
     }
 
-    if (config.timeout > 0) {
-        DEBUG("setting alarm for %d seconds", config.timeout);
-        alarm(config.timeout);
+    if (config.pick_color) {
+        struct color color;
+        if (!pick_color(&wayland.overlays, &timed_out, &color)) {
+            DEBUG("color picking cancelled");
+            exit_status = 1;
+            goto cleanup;
+        }
+
+        print_color(stdout, &color);
+        fflush(stdout);
+        char hex[8];
+        color_to_hex(&color, hex);
+        if (setenv("FRZSCR_COLOR", hex, 1) < 0) {
+            EWARN("failed to set FRZSCR_COLOR");
+        }
     }
 
-    /* block signals so we can catch them later */
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGTERM);
-    sigaddset(&mask, SIGCHLD);
-    sigaddset(&mask, SIGALRM);
-    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
-        EDIE("failed to block signals");
+    if (config.dump_file != NULL) {
+        dump_screenshots(&wayland.screenshots, config.dump_file, config.dump_format);
     }
 
-    /* set up signalfd */
-    if ((signal_fd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1) {
-        EDIE("failed to set up signalfd");
+    if (config.fork_child && config.export_frames) {
+        export_screenshots(&wayland.screenshots);
+    }
+
+    if (ready_fd >= 0) {
+        release_child(ready_fd);
+        ready_fd = -1;
+        timing_record("release", NULL, start);
+    } else if (config.fork_child) {
+        uint64_t phase_start = timing_now();
+        child_pid = spawn_child(child_argv);
+        if (child_pid < 0) {
+            exit_status = 1;
+            goto cleanup;
+        }
+        timing_record("spawn", NULL, phase_start);
+    }
+
+    if (signal_fd < 0) {
+        signal_fd = setup_signalfd();
     }
 
     /* set up epoll */
     if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
         EDIE("failed to set up epoll");
     }
-
-    struct epoll_event epoll_event = {0};
-    /* add wayland fd to epoll interest list */
-    epoll_event.events = EPOLLIN;
-    epoll_event.data.fd = wayland.fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wayland.fd, &epoll_event) == -1) {
-        EDIE("failed to add wayland fd to epoll list");
-    }
-    /* add signal fd to epoll interest list */
-    epoll_event.events = EPOLLIN;
-    epoll_event.data.fd = signal_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &epoll_event) == -1) {
-        EDIE("failed to add signal fd to epoll list");
+    /* with daemon, the only thing that can happen on its socket is daemon going away */
+    int connection_fd = daemon_fd >= 0 ? daemon_fd : wayland.fd;
+    epoll_add(epoll_fd, connection_fd);
+    epoll_add(epoll_fd, signal_fd);
+    epoll_add(epoll_fd, timer_fd());
+
+    /* timer can fire in the dispatch that ends selecting or picking, it won't fire again */
+    if (timed_out) {
+        goto cleanup;
     }
 
     int number_fds = -1;
@@ -213,6 +877,7 @@ int main(int argc, char **argv) {
         do {
             number_fds = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
         } while (number_fds == -1 && errno == EINTR); /* epoll_wait can fail with EINTR */
+        unfreeze_start = timing_now();
 
         if (number_fds == -1) {
             EDIE("epoll_wait error");
@@ -220,11 +885,17 @@ int main(int argc, char **argv) {
 
         /* handle events */
         for (int n = 0; n < number_fds; n++) {
-            if (events[n].data.fd == wayland.fd) {
+            if (events[n].data.fd == daemon_fd) {
+                WARN("daemon disconnected");
+                exit_status = 1;
+                goto cleanup;
+            } else if (events[n].data.fd == wayland.fd) {
                 /* wayland events */
                 if (wl_display_dispatch(wayland.display) == -1) {
                     EDIE("wl_display_dispatch failed");
                 }
+            } else if (events[n].data.fd == timer_fd()) {
+                timer_dispatch();
             } else if (events[n].data.fd == signal_fd) {
                 /* signals */
                 struct signalfd_siginfo siginfo;
@@ -253,15 +924,37 @@ int main(int argc, char **argv) {
                     }
                     child_pid = -1;
                     goto cleanup;
-                case SIGALRM:
-                    DEBUG("received SIGALRM");
-                    goto cleanup;
+                case SIGUSR1:
+                    DEBUG("received SIGUSR1, refreshing");
+                    if (daemon_fd >= 0) {
+                        refresh_with_daemon(daemon_fd);
+                    } else {
+                        refresh();
+                    }
+                    break;
                 }
             }
         }
+
+        /* timers can also fire while refresh waits for captures */
+        if (timed_out) {
+            goto cleanup;
+        }
     }
 
 cleanup:
+    /* screen goes live first, everything below can take its time */
+    if (unfreeze_start == 0) {
+        unfreeze_start = timing_now();
+    }
+    if (daemon_fd >= 0) {
+        unfreeze_with_daemon(daemon_fd);
+        timing_record("unfreeze", NULL, unfreeze_start);
+    } else {
+        hide_overlays(unfreeze_start);
+    }
+
+    uint64_t teardown_start = timing_now();
     if (child_pid > 0) {
         DEBUG("sending signal %d to pgid %d", config.child_kill_signal, child_pid);
         if (kill(-child_pid, config.child_kill_signal) < 0) {
@@ -273,16 +966,22 @@ cleanup:
         };
     }
 
-    wl_list_for_each_safe(screenshot, screenshot_tmp, &wayland.screenshots, link) {
-        screenshot_cleanup(screenshot);
+    if (daemon_fd < 0) {
+        handoff_cleanup();
+        unfreeze();
+        wayland_cleanup();
+        threadpool_cleanup();
     }
+    timing_record("teardown", NULL, teardown_start);
 
-    struct overlay *overlay, *overlay_tmp;
-    wl_list_for_each_safe(overlay, overlay_tmp, &wayland.overlays, link) {
-        overlay_cleanup(overlay);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        DEBUG("page faults: %ld minor, %ld major", usage.ru_minflt, usage.ru_majflt);
     }
 
-    wayland_cleanup();
+    timing_report();
+    timing_cleanup();
+    timer_cleanup();
 
     if (epoll_fd > 0) {
         close(epoll_fd);
@@ -293,4 +992,3 @@ cleanup:
 
     exit(exit_status);
 }
-
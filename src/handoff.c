@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "wlr-screencopy-unstable-v1.h"
+
+#include "handoff.h"
+#include "screenshot.h"
+#include "wayland.h"
+#include "buffer_cache.h"
+#include "common.h"
+
+static int frame_fds[64];
+static int n_frame_fds = 0;
+
+/* not in older headers, needs linux 5.1 */
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+/*
+ * F_SEAL_WRITE can't be added while compositor and we have the frame mapped writable.
+ * F_SEAL_FUTURE_WRITE leaves those mappings alone, but nobody can write to the memfd or map
+ * it writable anymore, and nothing writes into the existing mappings once buffer is retired.
+ */
+#define FRAME_SEALS (F_SEAL_FUTURE_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/* frame was captured straight into a memfd of its own, which is sealed instead of copied */
+static int create_frame_fd(struct buffer *buffer) {
+    if (n_frame_fds == sizeof(frame_fds) / sizeof(frame_fds[0])) {
+        WARN("too many frames to export");
+        return -1;
+    }
+    if (buffer->memfd < 0) {
+        WARN("frame is not in a memfd of its own");
+        return -1;
+    }
+
+    if (fcntl(buffer->memfd, F_ADD_SEALS, FRAME_SEALS) < 0) {
+        EWARN("failed to seal memfd");
+        return -1;
+    }
+    /* frame child sees must not be captured into again, eg on refresh */
+    buffer_cache_retire(buffer);
+
+    /* duplicate has no FD_CLOEXEC, child inherits it */
+    int fd = dup(buffer->memfd);
+    if (fd < 0) {
+        EWARN("failed to duplicate memfd");
+        return -1;
+    }
+
+    frame_fds[n_frame_fds++] = fd;
+    return fd;
+}
+
+static void set_output_env(int index, const char *key, const char *fmt, ...) {
+    char name[64];
+    char value[256];
+    va_list args;
+
+    snprintf(name, sizeof(name), "FRZSCR_OUTPUT_%d_%s", index, key);
+    va_start(args, fmt);
+    vsnprintf(value, sizeof(value), fmt, args);
+    va_end(args);
+
+    if (setenv(name, value, 1) < 0) {
+        EWARN("failed to set %s", name);
+    }
+}
+
+void export_screenshots(struct wl_list *screenshots) {
+    int index = 0;
+
+    struct screenshot *screenshot;
+    wl_list_for_each(screenshot, screenshots, link) {
+        struct buffer *buffer = screenshot->buffer;
+        struct output *output = screenshot->output;
+
+        int fd = create_frame_fd(buffer);
+        if (fd < 0) {
+            WARN("failed to export screenshot of %s", output->name);
+            continue;
+        }
+
+        set_output_env(index, "NAME", "%s", output->name);
+        set_output_env(index, "FD", "%d", fd);
+        set_output_env(index, "OFFSET", "%d", 0);
+        set_output_env(index, "FORMAT", "%u", screenshot->format);
+        set_output_env(index, "WIDTH", "%d", buffer->width);
+        set_output_env(index, "HEIGHT", "%d", buffer->height);
+        set_output_env(index, "STRIDE", "%d", buffer->stride);
+        set_output_env(index, "TRANSFORM", "%d", output->transform);
+        set_output_env(index, "Y_INVERT", "%d",
+                       !!(screenshot->flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT));
+        /* frame covers only the region if compositor could capture just that */
+        if (screenshot->region_only) {
+            set_output_env(index, "GEOMETRY", "%d,%d %dx%d",
+                           output->logical_geometry.x + screenshot->region.x,
+                           output->logical_geometry.y + screenshot->region.y,
+                           screenshot->region.w, screenshot->region.h);
+        } else {
+            set_output_env(index, "GEOMETRY", "%d,%d %dx%d",
+                           output->logical_geometry.x, output->logical_geometry.y,
+                           output->logical_geometry.w, output->logical_geometry.h);
+        }
+
+        DEBUG("exported screenshot of %s as FRZSCR_OUTPUT_%d (fd %d)", output->name, index, fd);
+        index++;
+    }
+
+    char value[16];
+    snprintf(value, sizeof(value), "%d", index);
+    setenv("FRZSCR_OUTPUTS", value, 1);
+}
+
+void handoff_cleanup(void) {
+    for (int i = 0; i < n_frame_fds; i++) {
+        close(frame_fds[i]);
+    }
+    n_frame_fds = 0;
+}
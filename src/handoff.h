@@ -0,0 +1,14 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <wayland-util.h>
+
+/*
+ * Passes captured frames to the child: with -e every frame is captured into a memfd of its
+ * own, which is sealed against writes and inherited by the child, and its layout is described
+ * in FRZSCR_* environment variables.
+ */
+void export_screenshots(struct wl_list *screenshots);
+void handoff_cleanup(void);
+
+#endif /* #ifndef HANDOFF_H */
@@ -7,12 +7,17 @@
 
 #include "wlr-layer-shell-unstable-v1.h"
 #include "viewporter.h"
+#include "alpha-modifier-v1.h"
 
 #include "common.h"
 #include "overlay.h"
 #include "wayland.h"
-#include "shm.h"
-#include "utils.h"
+#include "buffer_cache.h"
+#include "dmabuf.h"
+#include "rotate.h"
+#include "config.h"
+#include "timing.h"
+#include "damage.h"
 #include "xmalloc.h"
 
 #define ANCHOR_ALL \
@@ -21,12 +26,21 @@
     | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT   \
     | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT  )
 
+static void attach_screenshot(struct overlay *overlay);
+
 static void layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *layer_surface,
                                     uint32_t serial, uint32_t width, uint32_t height) {
     struct overlay *overlay = data;
 
     zwlr_layer_surface_v1_ack_configure(overlay->layer_surface, serial);
-    wl_surface_commit(overlay->wl_surface);
+    overlay->configured = true;
+
+    /* screenshot might be in the middle of refresh */
+    if (overlay->screenshot != NULL && overlay->screenshot->state == SCREENSHOT_READY && !overlay->attached) {
+        attach_screenshot(overlay);
+    } else {
+        wl_surface_commit(overlay->wl_surface);
+    }
 }
 
 static void layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *layer_surface) {
@@ -63,52 +77,176 @@ static const struct wl_surface_listener surface_listener = {
     .preferred_buffer_transform = surface_preferred_buffer_transform,
 };
 
-struct overlay *create_overlay_from_screenshot(struct screenshot *screenshot) {
-    struct overlay *overlay = xcalloc(1, sizeof(*overlay));
+/* brings back buffer up to date with screenshot and swaps it to the front */
+static void update_copy(struct overlay *overlay, int32_t buf_w, int32_t buf_h) {
+    struct screenshot *screenshot = overlay->screenshot;
+    struct buffer *src = screenshot->buffer;
+    enum wl_output_transform transform = screenshot->output->transform;
+    int bpp = src->stride / src->width;
+    struct buffer *back = overlay->back_buffer;
 
-    overlay->wl_surface = wl_compositor_create_surface(wayland.compositor);
-    if (overlay->wl_surface == NULL) {
-        DIE("couldn't create a wl_surface");
+    /*
+     * compositor may still be reading back buffer if it didn't release it yet, drawing into
+     * it would tear. Cache hands it out again once it's released, take another one meanwhile.
+     */
+    if (back != NULL && (back->busy || back->width != buf_w || back->height != buf_h)) {
+        if (back->busy) {
+            DEBUG("back buffer on %s is still busy, redrawing into another one",
+                  overlay->output->name);
+        }
+        buffer_cache_release(back);
+        back = NULL;
     }
-    wl_surface_add_listener(overlay->wl_surface, &surface_listener, overlay);
+    bool copy_all = back == NULL || !overlay->back_valid;
+    if (back == NULL) {
+        DEBUG("creating buffer %ix%i stride %i", buf_w, buf_h, buf_w * bpp);
+        back = get_shm_buffer(overlay->output, screenshot->format, buf_w, buf_h, buf_w * bpp);
+    }
+
+    uint64_t start = timing_now();
+    size_t bytes = 0;
+    dmabuf_begin_cpu_access(src);
+    if (copy_all) {
+        rotate_image(back->data, src->data, src->width, src->height, bpp, transform);
+        bytes = (size_t)src->stride * src->height;
+    } else {
+        /* back buffer missed the previous refresh as well as this one */
+        const struct wl_array *damages[] = { &overlay->back_damage, &screenshot->damage };
+        for (size_t i = 0; i < 2; i++) {
+            const struct rect *r;
+            wl_array_for_each(r, damages[i]) {
+                rotate_image_rect(back->data, src->data, src->width, src->height, bpp,
+                                  transform, r->x, r->y, r->w, r->h);
+                bytes += (size_t)r->w * r->h * bpp;
+            }
+        }
+    }
+    dmabuf_end_cpu_access(src);
+    /* read + write */
+    timing_record_bytes("rotate", overlay->output->name, start, 2 * bytes);
+
+    overlay->back_buffer = overlay->buffer;
+    overlay->buffer = back;
+
+    /* old front buffer lags behind by whatever changed in this capture */
+    overlay->back_valid = screenshot->prev_buffer != NULL;
+    overlay->back_damage.size = 0;
+    if (wl_array_copy(&overlay->back_damage, &screenshot->damage) < 0) {
+        DIE("wl_array_copy() failed");
+    }
+}
 
-    int32_t bpp = screenshot->buffer.stride / screenshot->buffer.width;
-    int32_t buf_w, buf_h, buf_stride;
+/* damage is in screenshot buffer space, and it's only known after a refresh */
+static void damage_surface(struct overlay *overlay, bool damage_all) {
+    struct screenshot *screenshot = overlay->screenshot;
+
+    if (damage_all) {
+        wl_surface_damage_buffer(overlay->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
+        return;
+    }
+
+    const struct rect *r;
+    wl_array_for_each(r, &screenshot->damage) {
+        int x = r->x, y = r->y, w = r->w, h = r->h;
+        if (config.copy_overlay) {
+            rotate_rect(screenshot->buffer->width, screenshot->buffer->height,
+                        screenshot->output->transform, &x, &y, &w, &h);
+        }
+        wl_surface_damage_buffer(overlay->wl_surface, x, y, w, h);
+    }
+}
+
+static void attach_screenshot(struct overlay *overlay) {
+    struct screenshot *screenshot = overlay->screenshot;
+    uint64_t start = timing_now();
+
+    int32_t buf_w, buf_h;
     switch (screenshot->output->transform) {
     case WL_OUTPUT_TRANSFORM_NORMAL:
     case WL_OUTPUT_TRANSFORM_180:
     case WL_OUTPUT_TRANSFORM_FLIPPED:
     case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-        buf_w = screenshot->buffer.width;
-        buf_h = screenshot->buffer.height;
+        buf_w = screenshot->buffer->width;
+        buf_h = screenshot->buffer->height;
         break;
     case WL_OUTPUT_TRANSFORM_90:
     case WL_OUTPUT_TRANSFORM_270:
     case WL_OUTPUT_TRANSFORM_FLIPPED_90:
     case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-        buf_w = screenshot->buffer.height;
-        buf_h = screenshot->buffer.width;
+        buf_w = screenshot->buffer->height;
+        buf_h = screenshot->buffer->width;
         break;
     default:
         DIE("UNREACHABLE: wl_output_transform is %d", screenshot->output->transform);
     }
-    buf_stride = buf_w * bpp;
+
+    /* compositor has nothing to apply partial damage to after blank buffer or on first attach */
+    bool damage_all = !overlay->mapped || overlay->blank != NULL || screenshot->prev_buffer == NULL;
+
+    if (screenshot->region_only || output_region_is_whole(overlay->output, &overlay->region)) {
+        wp_viewport_set_source(overlay->viewport,
+                               wl_fixed_from_int(0), wl_fixed_from_int(0),
+                               wl_fixed_from_int(buf_w), wl_fixed_from_int(buf_h));
+    } else {
+        /* buffer holds whole output, cut region out of it in buffer pixels */
+        double scale_x = (double)buf_w / overlay->output->logical_geometry.w;
+        double scale_y = (double)buf_h / overlay->output->logical_geometry.h;
+        wp_viewport_set_source(overlay->viewport,
+                               wl_fixed_from_double(overlay->region.x * scale_x),
+                               wl_fixed_from_double(overlay->region.y * scale_y),
+                               wl_fixed_from_double(overlay->region.w * scale_x),
+                               wl_fixed_from_double(overlay->region.h * scale_y));
+    }
+
+    if (config.copy_overlay) {
+        update_copy(overlay, buf_w, buf_h);
+        attach_buffer(overlay->wl_surface, overlay->buffer);
+    } else {
+        /* screenshot is in output buffer space, let compositor undo the transform for us */
+        DEBUG("attaching screenshot buffer directly with transform %d",
+              screenshot->output->transform);
+        wl_surface_set_buffer_transform(overlay->wl_surface, screenshot->output->transform);
+        attach_buffer(overlay->wl_surface, screenshot->buffer);
+    }
+    damage_surface(overlay, damage_all);
+    if (overlay->alpha_surface != NULL) {
+        wp_alpha_modifier_surface_v1_set_multiplier(overlay->alpha_surface, UINT32_MAX);
+    }
+    wl_surface_commit(overlay->wl_surface);
+
+    if (overlay->blank != NULL) {
+        buffer_cache_release(overlay->blank);
+        overlay->blank = NULL;
+    }
+
+    overlay->attached = true;
+    overlay->mapped = true;
+    timing_record("attach", overlay->output->name, start);
+    DEBUG("attached screenshot to overlay on %s", overlay->output->name);
+}
+
+struct overlay *create_overlay(struct output *output, const struct rect *region) {
+    struct overlay *overlay = xcalloc(1, sizeof(*overlay));
+    overlay->output = output;
+    overlay->region = *region;
+    wl_array_init(&overlay->back_damage);
+
+    overlay->wl_surface = wl_compositor_create_surface(wayland.compositor);
+    if (overlay->wl_surface == NULL) {
+        DIE("couldn't create a wl_surface");
+    }
+    wl_surface_add_listener(overlay->wl_surface, &surface_listener, overlay);
 
     overlay->viewport = wp_viewporter_get_viewport(wayland.viewporter, overlay->wl_surface);
     if (overlay->viewport == NULL) {
         DIE("could not create viewport");
     }
-    wp_viewport_set_destination(overlay->viewport,
-                                screenshot->output->logical_geometry.w,
-                                screenshot->output->logical_geometry.h);
-    wp_viewport_set_source(overlay->viewport,
-                           wl_fixed_from_int(0), wl_fixed_from_int(0),
-                           wl_fixed_from_int(buf_w), wl_fixed_from_int(buf_h));
+    wp_viewport_set_destination(overlay->viewport, region->w, region->h);
 
     overlay->layer_surface =
         zwlr_layer_shell_v1_get_layer_surface(wayland.layer_shell,
                                               overlay->wl_surface,
-                                              screenshot->output->wl_output,
+                                              output->wl_output,
                                               ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY,
                                               "frzscr");
     if (overlay->layer_surface == NULL) {
@@ -116,33 +254,87 @@ struct overlay *create_overlay_from_screenshot(struct screenshot *screenshot) {
     }
     zwlr_layer_surface_v1_add_listener(overlay->layer_surface, &layer_surface_listener, overlay);
 
-    int32_t output_w = screenshot->output->logical_geometry.w;
-    int32_t output_h = screenshot->output->logical_geometry.h;
-
-    zwlr_layer_surface_v1_set_size(overlay->layer_surface, output_w, output_h);
-    zwlr_layer_surface_v1_set_anchor(overlay->layer_surface, ANCHOR_ALL);
+    zwlr_layer_surface_v1_set_size(overlay->layer_surface, region->w, region->h);
+    if (output_region_is_whole(output, region)) {
+        zwlr_layer_surface_v1_set_anchor(overlay->layer_surface, ANCHOR_ALL);
+    } else {
+        zwlr_layer_surface_v1_set_anchor(overlay->layer_surface,
+                                         ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP
+                                         | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
+        zwlr_layer_surface_v1_set_margin(overlay->layer_surface, region->y, 0, 0, region->x);
+    }
     zwlr_layer_surface_v1_set_exclusive_zone(overlay->layer_surface, -1);
 
+    /* no buffer yet, so surface stays unmapped and can't end up in the screenshot */
     wl_surface_commit(overlay->wl_surface);
-    wl_display_roundtrip(wayland.display);
 
-    int bytes_per_pixel = screenshot->buffer.stride / screenshot->buffer.width;
+    return overlay;
+}
+
+void overlay_set_screenshot(struct overlay *overlay, struct screenshot *screenshot) {
+    overlay->screenshot = screenshot;
+    if (overlay->configured) {
+        attach_screenshot(overlay);
+    }
+}
 
-    DEBUG("creating buffer %ix%i stride %i", buf_w, buf_h, buf_stride);
-    create_buffer(&overlay->buffer, screenshot->format, buf_w, buf_h, buf_stride);
+void overlay_hide(struct overlay *overlay) {
+    if (wayland.alpha_modifier != NULL) {
+        if (overlay->alpha_surface == NULL) {
+            overlay->alpha_surface =
+                wp_alpha_modifier_v1_get_surface(wayland.alpha_modifier, overlay->wl_surface);
+        }
+        /* buffer stays attached, so compositor keeps its copy and only needs damage later */
+        wp_alpha_modifier_surface_v1_set_multiplier(overlay->alpha_surface, 0);
+    } else {
+        /* unmapping would mean waiting for configure again, stretch a transparent pixel instead */
+        overlay->blank = get_shm_buffer(overlay->output, WL_SHM_FORMAT_ARGB8888, 1, 1, 4);
+        memset(overlay->blank->data, 0, 4);
+        wp_viewport_set_source(overlay->viewport,
+                               wl_fixed_from_int(0), wl_fixed_from_int(0),
+                               wl_fixed_from_int(1), wl_fixed_from_int(1));
+        wl_surface_set_buffer_transform(overlay->wl_surface, WL_OUTPUT_TRANSFORM_NORMAL);
+        attach_buffer(overlay->wl_surface, overlay->blank);
+        wl_surface_damage_buffer(overlay->wl_surface, 0, 0, 1, 1);
+    }
+    wl_surface_commit(overlay->wl_surface);
 
-    rotate_image(overlay->buffer.data, screenshot->buffer.data,
-                 screenshot->buffer.width, screenshot->buffer.height,
-                 bytes_per_pixel,
-                 screenshot->output->transform);
+    overlay->attached = false;
+}
 
-    wl_surface_attach(overlay->wl_surface, overlay->buffer.wl_buffer, 0, 0);
+void overlay_unmap(struct overlay *overlay) {
+    if (!overlay->mapped) {
+        return;
+    }
+    wl_surface_attach(overlay->wl_surface, NULL, 0, 0);
     wl_surface_commit(overlay->wl_surface);
 
-    return overlay;
+    overlay->attached = false;
+    overlay->mapped = false;
+}
+
+static bool overlays_attached(struct wl_list *overlays) {
+    struct overlay *overlay;
+    wl_list_for_each(overlay, overlays, link) {
+        if (!overlay->attached) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void wait_for_overlays(struct wl_list *overlays) {
+    while (!overlays_attached(overlays)) {
+        if (wl_display_dispatch(wayland.display) < 0) {
+            EDIE("wl_display_dispatch() failed");
+        }
+    }
 }
 
 void overlay_cleanup(struct overlay *overlay) {
+    if (overlay->alpha_surface) {
+        wp_alpha_modifier_surface_v1_destroy(overlay->alpha_surface);
+    }
     if (overlay->layer_surface) {
         zwlr_layer_surface_v1_destroy(overlay->layer_surface);
     }
@@ -152,7 +344,17 @@ void overlay_cleanup(struct overlay *overlay) {
     if (overlay->wl_surface) {
         wl_surface_destroy(overlay->wl_surface);
     }
-    destroy_buffer(&overlay->buffer);
+    /* buffer is only allocated when screenshot is copied */
+    if (overlay->buffer) {
+        buffer_cache_release(overlay->buffer);
+    }
+    if (overlay->back_buffer) {
+        buffer_cache_release(overlay->back_buffer);
+    }
+    if (overlay->blank) {
+        buffer_cache_release(overlay->blank);
+    }
+    wl_array_release(&overlay->back_damage);
     wl_list_remove(&overlay->link);
     free(overlay);
 }
@@ -1,20 +1,47 @@
 #ifndef WINDOW_H
 #define WINDOW_H
 
+#include <stdbool.h>
 #include <wayland-util.h>
 
 #include "screenshot.h"
 
 struct overlay {
-    struct buffer buffer;
+    struct buffer *buffer; /* only with -R, owned by buffer cache */
+    struct output *output;
+    /* part of output covered, relative to output in logical coordinates */
+    struct rect region;
+    struct screenshot *screenshot;
+    bool configured;
+    bool attached;
+    bool mapped;
+
+    /* with -R refreshes go into back buffer, which lags behind by back_damage (struct rect) */
+    struct buffer *back_buffer;
+    struct wl_array back_damage;
+    bool back_valid;
+
+    /* transparent pixel shown during refresh if compositor lacks alpha modifier */
+    struct buffer *blank;
+
     struct wl_surface *wl_surface;
     struct zwlr_layer_surface_v1 *layer_surface;
     struct wp_viewport *viewport;
+    struct wp_alpha_modifier_surface_v1 *alpha_surface;
 
     struct wl_list link;
 };
 
-struct overlay *create_overlay_from_screenshot(struct screenshot *screenshot);
+/* creates unmapped layer surface over region of output, it's shown once screenshot is set */
+struct overlay *create_overlay(struct output *output, const struct rect *region);
+/* attaches screenshot right away if surface is already configured, or on configure otherwise */
+void overlay_set_screenshot(struct overlay *overlay, struct screenshot *screenshot);
+/* makes overlay transparent so that output can be captured again without it */
+void overlay_hide(struct overlay *overlay);
+/* takes overlay off the screen with a null buffer, cleanup can then happen at leisure */
+void overlay_unmap(struct overlay *overlay);
+/* dispatches wayland events until every overlay in the list has its screenshot attached */
+void wait_for_overlays(struct wl_list *overlays);
 void overlay_cleanup(struct overlay *overlay);
 
 #endif /* #ifndef WINDOW_H */
@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/input-event-codes.h>
+#include <wayland-client.h>
+
+#include "wlr-layer-shell-unstable-v1.h"
+#include "cursor-shape-v1.h"
+
+#include "common.h"
+#include "pick.h"
+#include "overlay.h"
+#include "screenshot.h"
+#include "wayland.h"
+#include "buffer_cache.h"
+#include "dmabuf.h"
+#include "rotate.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+/* odd, so that picked pixel is in the middle */
+#define LOUPE_PIXELS 15
+#define LOUPE_ZOOM 8
+#define LOUPE_SIZE (LOUPE_PIXELS * LOUPE_ZOOM)
+/* distance from pointer, so the loupe doesn't hide what's being picked */
+#define LOUPE_OFFSET 24
+
+#define LOUPE_BORDER_COLOR 0xff808080
+#define LOUPE_CENTER_COLOR 0xffffffff
+/* shown for pixels outside the frozen frame */
+#define LOUPE_EMPTY_COLOR 0xff000000
+
+/*
+ * Loupe is a small subsurface, so following the pointer only repaints the loupe
+ * and not the frozen screen underneath.
+ */
+struct loupe_view {
+    struct overlay *overlay;
+
+    struct wl_surface *wl_surface;
+    struct wl_subsurface *subsurface;
+    bool visible;
+};
+
+struct picker {
+    struct loupe_view *views;
+    size_t n_views;
+
+    struct wl_pointer *pointer;
+    struct wl_keyboard *keyboard;
+    struct wp_cursor_shape_device_v1 *cursor_shape;
+
+    /* view pointer is over and pointer position relative to it in logical coordinates */
+    struct loupe_view *focus;
+    double x, y;
+
+    bool done, cancelled;
+    struct color color;
+};
+
+/* transformed screenshot is what the overlay shows, in buffer pixels */
+static void get_frame_size(struct screenshot *screenshot, int *w, int *h) {
+    bool swap_axes = screenshot->output->transform & WL_OUTPUT_TRANSFORM_90;
+    *w = swap_axes ? screenshot->buffer->height : screenshot->buffer->width;
+    *h = swap_axes ? screenshot->buffer->width : screenshot->buffer->height;
+}
+
+/* maps pointer position on overlay to pixel of transformed screenshot */
+static void get_frame_position(struct loupe_view *view, double x, double y,
+                               int *frame_x, int *frame_y) {
+    struct overlay *overlay = view->overlay;
+    struct screenshot *screenshot = overlay->screenshot;
+    int w, h;
+    get_frame_size(screenshot, &w, &h);
+
+    double fx, fy;
+    if (screenshot->region_only) {
+        fx = x * w / overlay->region.w;
+        fy = y * h / overlay->region.h;
+    } else {
+        /* buffer holds whole output */
+        fx = (overlay->region.x + x) * w / overlay->output->logical_geometry.w;
+        fy = (overlay->region.y + y) * h / overlay->output->logical_geometry.h;
+    }
+
+    *frame_x = fx < 0 ? 0 : fx >= w ? w - 1 : (int)fx;
+    *frame_y = fy < 0 ? 0 : fy >= h ? h - 1 : (int)fy;
+}
+
+/* returns false if pixel is outside of the frame, cpu access has to be started by caller */
+static bool read_pixel(struct screenshot *screenshot, int x, int y, struct color *color) {
+    struct buffer *buffer = screenshot->buffer;
+    int w, h;
+    get_frame_size(screenshot, &w, &h);
+    if (x < 0 || y < 0 || x >= w || y >= h) {
+        return false;
+    }
+
+    unrotate_point(buffer->width, buffer->height, screenshot->output->transform, &x, &y);
+    const uint8_t *pixel = (const uint8_t *)buffer->data + (size_t)y * buffer->stride
+                           + (size_t)x * get_bytes_per_pixel(screenshot->format);
+    return decode_pixel(screenshot->format, pixel, color);
+}
+
+static void fill_rect(uint32_t *dest, int x, int y, int w, int h, uint32_t color) {
+    for (int row = y; row < y + h; row++) {
+        for (int col = x; col < x + w; col++) {
+            dest[row * LOUPE_SIZE + col] = color;
+        }
+    }
+}
+
+static void draw_frame(uint32_t *dest, int x, int y, int size, uint32_t color) {
+    fill_rect(dest, x, y, size, 1, color);
+    fill_rect(dest, x, y + size - 1, size, 1, color);
+    fill_rect(dest, x, y, 1, size, color);
+    fill_rect(dest, x + size - 1, y, 1, size, color);
+}
+
+/* nearest neighbour upscale of pixels around x, y of the frame */
+static void draw_loupe(uint32_t *dest, struct screenshot *screenshot, int x, int y) {
+    dmabuf_begin_cpu_access(screenshot->buffer);
+    for (int row = 0; row < LOUPE_PIXELS; row++) {
+        uint32_t *line = dest + row * LOUPE_ZOOM * LOUPE_SIZE;
+        for (int col = 0; col < LOUPE_PIXELS; col++) {
+            struct color c;
+            uint32_t argb = LOUPE_EMPTY_COLOR;
+            if (read_pixel(screenshot, x + col - LOUPE_PIXELS / 2, y + row - LOUPE_PIXELS / 2, &c)) {
+                argb = 0xff000000 | (uint32_t)(c.r >> 8) << 16 | (c.g >> 8) << 8 | c.b >> 8;
+            }
+            for (int i = 0; i < LOUPE_ZOOM; i++) {
+                line[col * LOUPE_ZOOM + i] = argb;
+            }
+        }
+        /* rest of the cell rows are the same */
+        for (int i = 1; i < LOUPE_ZOOM; i++) {
+            memcpy(line + i * LOUPE_SIZE, line, LOUPE_SIZE * sizeof(*line));
+        }
+    }
+    dmabuf_end_cpu_access(screenshot->buffer);
+
+    draw_frame(dest, 0, 0, LOUPE_SIZE, LOUPE_BORDER_COLOR);
+    int center = LOUPE_PIXELS / 2 * LOUPE_ZOOM;
+    draw_frame(dest, center, center, LOUPE_ZOOM, LOUPE_CENTER_COLOR);
+}
+
+static void view_hide(struct loupe_view *view) {
+    if (!view->visible) {
+        return;
+    }
+    wl_surface_attach(view->wl_surface, NULL, 0, 0);
+    wl_surface_commit(view->wl_surface);
+    view->visible = false;
+}
+
+static void update_loupe(struct picker *picker) {
+    struct loupe_view *view = picker->focus;
+    if (view == NULL) {
+        return;
+    }
+    struct overlay *overlay = view->overlay;
+
+    int frame_x, frame_y;
+    get_frame_position(view, picker->x, picker->y, &frame_x, &frame_y);
+
+    /* busy buffers are skipped by cache, so this doesn't draw into one that's on screen */
+    struct buffer *buffer = get_shm_buffer(overlay->output, WL_SHM_FORMAT_ARGB8888,
+                                           LOUPE_SIZE, LOUPE_SIZE, LOUPE_SIZE * 4);
+    draw_loupe(buffer->data, overlay->screenshot, frame_x, frame_y);
+    attach_buffer(view->wl_surface, buffer);
+    wl_surface_damage_buffer(view->wl_surface, 0, 0, LOUPE_SIZE, LOUPE_SIZE);
+    wl_surface_commit(view->wl_surface);
+    buffer_cache_release(buffer);
+    view->visible = true;
+
+    /* flip to the other side of pointer near right and bottom edges */
+    int x = (int)picker->x + LOUPE_OFFSET;
+    int y = (int)picker->y + LOUPE_OFFSET;
+    if (x + LOUPE_SIZE > overlay->region.w) {
+        x = (int)picker->x - LOUPE_OFFSET - LOUPE_SIZE;
+    }
+    if (y + LOUPE_SIZE > overlay->region.h) {
+        y = (int)picker->y - LOUPE_OFFSET - LOUPE_SIZE;
+    }
+    /* position is parent state, committing parent without new buffer repaints nothing */
+    wl_subsurface_set_position(view->subsurface, x, y);
+    wl_surface_commit(overlay->wl_surface);
+}
+
+static struct loupe_view *find_view(struct picker *picker, struct wl_surface *surface) {
+    for (size_t i = 0; i < picker->n_views; i++) {
+        if (picker->views[i].overlay->wl_surface == surface) {
+            return &picker->views[i];
+        }
+    }
+    return NULL;
+}
+
+static void pointer_enter(void *data, struct wl_pointer *pointer, uint32_t serial,
+                          struct wl_surface *surface, wl_fixed_t surface_x, wl_fixed_t surface_y) {
+    struct picker *picker = data;
+
+    picker->focus = find_view(picker, surface);
+    picker->x = wl_fixed_to_double(surface_x);
+    picker->y = wl_fixed_to_double(surface_y);
+
+    if (picker->cursor_shape != NULL) {
+        wp_cursor_shape_device_v1_set_shape(picker->cursor_shape, serial,
+                                            WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_CROSSHAIR);
+    }
+    if (wl_pointer_get_version(pointer) < 5) {
+        update_loupe(picker);
+    }
+}
+
+static void pointer_leave(void *data, struct wl_pointer *pointer, uint32_t serial,
+                          struct wl_surface *surface) {
+    struct picker *picker = data;
+
+    if (picker->focus != NULL) {
+        view_hide(picker->focus);
+    }
+    picker->focus = NULL;
+}
+
+static void pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time,
+                           wl_fixed_t surface_x, wl_fixed_t surface_y) {
+    struct picker *picker = data;
+
+    picker->x = wl_fixed_to_double(surface_x);
+    picker->y = wl_fixed_to_double(surface_y);
+    /* otherwise redrawn once per frame event */
+    if (wl_pointer_get_version(pointer) < 5) {
+        update_loupe(picker);
+    }
+}
+
+static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial,
+                           uint32_t time, uint32_t button, uint32_t state) {
+    struct picker *picker = data;
+
+    if (state != WL_POINTER_BUTTON_STATE_PRESSED) {
+        return;
+    }
+    if (button == BTN_RIGHT) {
+        picker->cancelled = true;
+        picker->done = true;
+    } else if (button == BTN_LEFT && picker->focus != NULL) {
+        struct screenshot *screenshot = picker->focus->overlay->screenshot;
+        int x, y;
+        get_frame_position(picker->focus, picker->x, picker->y, &x, &y);
+
+        dmabuf_begin_cpu_access(screenshot->buffer);
+        bool ok = read_pixel(screenshot, x, y, &picker->color);
+        dmabuf_end_cpu_access(screenshot->buffer);
+        if (!ok) {
+            WARN("can't read pixels of format 0x%08x", screenshot->format);
+            return;
+        }
+        picker->done = true;
+    }
+}
+
+static void pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time,
+                         uint32_t axis, wl_fixed_t value) {
+    // no-op
+}
+
+static void pointer_frame(void *data, struct wl_pointer *pointer) {
+    struct picker *picker = data;
+
+    update_loupe(picker);
+}
+
+static void pointer_axis_source(void *data, struct wl_pointer *pointer, uint32_t axis_source) {
+    // no-op
+}
+
+static void pointer_axis_stop(void *data, struct wl_pointer *pointer, uint32_t time,
+                              uint32_t axis) {
+    // no-op
+}
+
+static void pointer_axis_discrete(void *data, struct wl_pointer *pointer, uint32_t axis,
+                                  int32_t discrete) {
+    // no-op
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+    .enter = pointer_enter,
+    .leave = pointer_leave,
+    .motion = pointer_motion,
+    .button = pointer_button,
+    .axis = pointer_axis,
+    .frame = pointer_frame,
+    .axis_source = pointer_axis_source,
+    .axis_stop = pointer_axis_stop,
+    .axis_discrete = pointer_axis_discrete,
+};
+
+static void keyboard_keymap(void *data, struct wl_keyboard *keyboard, uint32_t format,
+                            int32_t fd, uint32_t size) {
+    /* only escape is handled, and evdev keycode is enough for that */
+    close(fd);
+}
+
+static void keyboard_enter(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+                           struct wl_surface *surface, struct wl_array *keys) {
+    // no-op
+}
+
+static void keyboard_leave(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+                           struct wl_surface *surface) {
+    // no-op
+}
+
+static void keyboard_key(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+                         uint32_t time, uint32_t key, uint32_t state) {
+    struct picker *picker = data;
+
+    if (key == KEY_ESC && state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+        picker->cancelled = true;
+        picker->done = true;
+    }
+}
+
+static void keyboard_modifiers(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+                               uint32_t mods_depressed, uint32_t mods_latched,
+                               uint32_t mods_locked, uint32_t group) {
+    // no-op
+}
+
+static void keyboard_repeat_info(void *data, struct wl_keyboard *keyboard,
+                                 int32_t rate, int32_t delay) {
+    // no-op
+}
+
+static const struct wl_keyboard_listener keyboard_listener = {
+    .keymap = keyboard_keymap,
+    .enter = keyboard_enter,
+    .leave = keyboard_leave,
+    .key = keyboard_key,
+    .modifiers = keyboard_modifiers,
+    .repeat_info = keyboard_repeat_info,
+};
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+    int *pending = data;
+
+    (*pending)--;
+    wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done,
+};
+
+static void view_init(struct loupe_view *view, struct overlay *overlay) {
+    view->overlay = overlay;
+
+    view->wl_surface = wl_compositor_create_surface(wayland.compositor);
+    if (view->wl_surface == NULL) {
+        DIE("couldn't create a wl_surface");
+    }
+    view->subsurface = wl_subcompositor_get_subsurface(wayland.subcompositor,
+                                                       view->wl_surface, overlay->wl_surface);
+    if (view->subsurface == NULL) {
+        DIE("couldn't create a wl_subsurface");
+    }
+    /* commits on loupe shouldn't wait for overlay */
+    wl_subsurface_set_desync(view->subsurface);
+
+    /* pointer has to stay on overlay surface, or its coordinates would be relative to this */
+    struct wl_region *empty = wl_compositor_create_region(wayland.compositor);
+    wl_surface_set_input_region(view->wl_surface, empty);
+    wl_region_destroy(empty);
+
+    /* escape has to reach us, pointer input doesn't need this */
+    zwlr_layer_surface_v1_set_keyboard_interactivity(overlay->layer_surface, 1);
+    wl_surface_commit(overlay->wl_surface);
+}
+
+/* pending is decremented once overlay is drawn without the loupe */
+static void view_finish(struct loupe_view *view, int *pending) {
+    view_hide(view);
+    wl_subsurface_destroy(view->subsurface);
+    wl_surface_destroy(view->wl_surface);
+
+    struct wl_callback *callback = wl_surface_frame(view->overlay->wl_surface);
+    wl_callback_add_listener(callback, &frame_listener, pending);
+    (*pending)++;
+
+    zwlr_layer_surface_v1_set_keyboard_interactivity(view->overlay->layer_surface, 0);
+    wl_surface_commit(view->overlay->wl_surface);
+}
+
+bool pick_color(struct wl_list *overlays, const bool *stop, struct color *color) {
+    struct picker picker = {0};
+
+    if (!(wayland.seat_capabilities & WL_SEAT_CAPABILITY_POINTER)) {
+        WARN("seat has no pointer, can't pick color");
+        return false;
+    }
+
+    picker.n_views = wl_list_length(overlays);
+    picker.views = xcalloc(picker.n_views, sizeof(*picker.views));
+    struct overlay *overlay;
+    size_t i = 0;
+    wl_list_for_each(overlay, overlays, link) {
+        view_init(&picker.views[i++], overlay);
+    }
+
+    picker.pointer = wl_seat_get_pointer(wayland.seat);
+    wl_pointer_add_listener(picker.pointer, &pointer_listener, &picker);
+    if (wayland.cursor_shape_manager != NULL) {
+        picker.cursor_shape = wp_cursor_shape_manager_v1_get_pointer(wayland.cursor_shape_manager,
+                                                                     picker.pointer);
+    }
+    if (wayland.seat_capabilities & WL_SEAT_CAPABILITY_KEYBOARD) {
+        picker.keyboard = wl_seat_get_keyboard(wayland.seat);
+        wl_keyboard_add_listener(picker.keyboard, &keyboard_listener, &picker);
+    }
+
+    while (!picker.done && !*stop) {
+        wayland_dispatch_timed();
+    }
+
+    if (picker.cursor_shape != NULL) {
+        wp_cursor_shape_device_v1_destroy(picker.cursor_shape);
+    }
+    /* release request needs seat version 3 */
+    if (wl_pointer_get_version(picker.pointer) >= 3) {
+        wl_pointer_release(picker.pointer);
+    } else {
+        wl_pointer_destroy(picker.pointer);
+    }
+    if (picker.keyboard != NULL && wl_keyboard_get_version(picker.keyboard) >= 3) {
+        wl_keyboard_release(picker.keyboard);
+    } else if (picker.keyboard != NULL) {
+        wl_keyboard_destroy(picker.keyboard);
+    }
+    /* child might capture the screen right away, so loupe has to be gone by then */
+    int pending = 0;
+    for (i = 0; i < picker.n_views; i++) {
+        view_finish(&picker.views[i], &pending);
+    }
+    free(picker.views);
+    while (pending > 0) {
+        wayland_dispatch_timed();
+    }
+
+    if (!picker.done) {
+        DEBUG("timed out while picking color");
+        return false;
+    }
+    if (picker.cancelled) {
+        return false;
+    }
+    *color = picker.color;
+    DEBUG("picked color %04x %04x %04x", color->r, color->g, color->b);
+    return true;
+}
+
+void color_to_hex(const struct color *color, char *hex) {
+    snprintf(hex, 8, "#%02x%02x%02x", color->r >> 8, color->g >> 8, color->b >> 8);
+}
+
+void print_color(FILE *stream, const struct color *color) {
+    double r = color->r / 65535.0, g = color->g / 65535.0, b = color->b / 65535.0;
+    double max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+    double min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    double d = max - min;
+    double l = (max + min) / 2;
+    double h = 0, s = 0;
+    if (d > 0) {
+        s = l > 0.5 ? d / (2 - max - min) : d / (max + min);
+        if (max == r) {
+            h = (g - b) / d + (g < b ? 6 : 0);
+        } else if (max == g) {
+            h = (b - r) / d + 2;
+        } else {
+            h = (r - g) / d + 4;
+        }
+        h *= 60;
+    }
+
+    char hex[8];
+    color_to_hex(color, hex);
+    fprintf(stream, "%s\n", hex);
+    fprintf(stream, "rgb(%d, %d, %d)\n", color->r >> 8, color->g >> 8, color->b >> 8);
+    fprintf(stream, "hsl(%d, %.0f%%, %.0f%%)\n", (int)(h + 0.5) % 360, s * 100, l * 100);
+}
@@ -0,0 +1,22 @@
+#ifndef PICK_H
+#define PICK_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <wayland-util.h>
+
+#include "utils.h"
+
+/*
+ * Shows a magnifier next to the pointer over overlays in the list and reads color of the
+ * clicked pixel straight from the captured frame. Returns false if user cancelled with
+ * Escape or right button, or once *stop is set by a timer (see timer.h).
+ */
+bool pick_color(struct wl_list *overlays, const bool *stop, struct color *color);
+
+/* "#rrggbb", hex has to fit 8 bytes */
+void color_to_hex(const struct color *color, char *hex);
+/* prints color as hex, rgb() and hsl(), one per line */
+void print_color(FILE *stream, const struct color *color);
+
+#endif /* #ifndef PICK_H */
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "encode.h"
+#include "threadpool.h"
+#include "common.h"
+#include "xmalloc.h"
+
+#define BAND_ROWS 64
+
+/* deflate stored blocks are at most this big */
+#define STORED_BLOCK_MAX 65535
+
+enum png_filter {
+    PNG_FILTER_NONE = 0,
+    PNG_FILTER_SUB = 1,
+    PNG_FILTER_UP = 2,
+    PNG_FILTER_AVG = 3,
+    PNG_FILTER_PAETH = 4,
+};
+
+struct png_job {
+    const struct encode_source *source;
+    enum encode_preset preset;
+    int rows_per_task;
+    unsigned int n_tasks;
+    struct encoded_part *parts;
+    uint32_t *adlers;
+    size_t *lengths;
+};
+
+/* growable output of one task, starts with IDAT chunk header */
+struct png_out {
+    uint8_t *data;
+    size_t size, cap;
+};
+
+static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+#ifdef HAVE_ZLIB
+#define png_crc32(crc, data, size) crc32((crc), (data), (size))
+#define png_adler32(adler, data, size) adler32((adler), (data), (size))
+#define png_adler32_combine(a, b, len) adler32_combine((a), (b), (len))
+#else
+static uint32_t crc_table[256];
+
+static void init_crc_table(void) {
+    if (crc_table[1] != 0) {
+        return;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t png_crc32(uint32_t crc, const uint8_t *data, size_t size) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#define ADLER_BASE 65521
+
+static uint32_t png_adler32(uint32_t adler, const uint8_t *data, size_t size) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+
+    while (size > 0) {
+        /* largest n for which b can't overflow */
+        size_t n = size < 5552 ? size : 5552;
+        size -= n;
+        while (n-- > 0) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return b << 16 | a;
+}
+
+/* same as zlib's adler32_combine */
+static uint32_t png_adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    uint32_t rem = len2 % ADLER_BASE;
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = rem * sum1 % ADLER_BASE;
+
+    sum1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum2 >= 2 * ADLER_BASE) sum2 -= 2 * ADLER_BASE;
+    if (sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+    return sum1 | sum2 << 16;
+}
+#endif
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void out_reserve(struct png_out *out, size_t size) {
+    if (out->size + size > out->cap) {
+        out->cap = (out->size + size) * 3 / 2;
+        out->data = xrealloc(out->data, out->cap);
+    }
+}
+
+static void out_append(struct png_out *out, const void *data, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    out_reserve(out, size);
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+}
+
+/* appends chunk with header and crc */
+static void out_chunk(struct png_out *out, const char *type, const void *data, size_t size) {
+    uint8_t header[8];
+    put_be32(header, size);
+    memcpy(header + 4, type, 4);
+    out_append(out, header, 8);
+    out_append(out, data, size);
+
+    /* crc covers type and data, which are contiguous now */
+    uint8_t crc[4];
+    put_be32(crc, png_crc32(0, out->data + out->size - size - 4, size + 4));
+    out_append(out, crc, 4);
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    } else if (pb <= pc) {
+        return b;
+    }
+    return c;
+}
+
+static void filter_row(uint8_t *dest, const uint8_t *row, const uint8_t *prev, size_t len,
+                       int bpp, enum png_filter filter) {
+    *dest++ = filter;
+    switch (filter) {
+    case PNG_FILTER_NONE:
+        memcpy(dest, row, len);
+        break;
+    case PNG_FILTER_SUB:
+        memcpy(dest, row, bpp);
+        for (size_t i = bpp; i < len; i++) {
+            dest[i] = row[i] - row[i - bpp];
+        }
+        break;
+    case PNG_FILTER_UP:
+        for (size_t i = 0; i < len; i++) {
+            dest[i] = row[i] - prev[i];
+        }
+        break;
+    case PNG_FILTER_AVG:
+        for (size_t i = 0; i < (size_t)bpp; i++) {
+            dest[i] = row[i] - (prev[i] >> 1);
+        }
+        for (size_t i = bpp; i < len; i++) {
+            dest[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+        }
+        break;
+    case PNG_FILTER_PAETH:
+        for (size_t i = 0; i < (size_t)bpp; i++) {
+            dest[i] = row[i] - prev[i];
+        }
+        for (size_t i = bpp; i < len; i++) {
+            dest[i] = row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]);
+        }
+        break;
+    }
+}
+
+/* usual heuristic of picking filter with smallest sum of residuals taken as signed */
+static void filter_row_adaptive(uint8_t *dest, uint8_t *scratch, const uint8_t *row,
+                                const uint8_t *prev, size_t len, int bpp) {
+    uint64_t best = UINT64_MAX;
+
+    for (enum png_filter filter = PNG_FILTER_NONE; filter <= PNG_FILTER_PAETH; filter++) {
+        filter_row(scratch, row, prev, len, bpp, filter);
+
+        uint64_t sum = 0;
+        for (size_t i = 1; i <= len; i++) {
+            sum += abs((int8_t)scratch[i]);
+        }
+        if (sum < best) {
+            best = sum;
+            memcpy(dest, scratch, len + 1);
+        }
+    }
+}
+
+/* raw deflate data made of stored blocks, for when speed is all that matters */
+static void store_band(struct png_out *out, const uint8_t *data, size_t size, bool last) {
+    while (size > 0) {
+        size_t n = size < STORED_BLOCK_MAX ? size : STORED_BLOCK_MAX;
+        uint8_t header[5] = {
+            last && n == size ? 1 : 0,
+            n & 0xff, n >> 8,
+            ~n & 0xff, (~n >> 8) & 0xff,
+        };
+        out_append(out, header, sizeof(header));
+        out_append(out, data, n);
+        data += n;
+        size -= n;
+    }
+}
+
+#ifdef HAVE_ZLIB
+static void deflate_band(z_stream *strm, struct png_out *out, const uint8_t *data, size_t size,
+                         int flush) {
+    strm->next_in = (uint8_t *)data;
+    strm->avail_in = size;
+    do {
+        out_reserve(out, deflateBound(strm, strm->avail_in) + 16);
+        strm->next_out = out->data + out->size;
+        strm->avail_out = out->cap - out->size;
+        deflate(strm, flush);
+        out->size = strm->next_out - out->data;
+    } while (strm->avail_out == 0);
+}
+
+static void get_deflate_params(enum encode_preset preset, int *level, int *strategy) {
+    switch (preset) {
+    case ENCODE_PRESET_FAST:
+        *level = 1;
+        *strategy = Z_DEFAULT_STRATEGY;
+        break;
+    case ENCODE_PRESET_BALANCED:
+        *level = 4;
+        *strategy = Z_DEFAULT_STRATEGY;
+        break;
+    case ENCODE_PRESET_SMALL:
+        *level = 9;
+        *strategy = Z_DEFAULT_STRATEGY;
+        break;
+    default:
+        DIE("UNREACHABLE: encode preset is %d", preset);
+    }
+}
+#endif
+
+/*
+ * Each task filters and deflates its own row range into a separate IDAT chunk. Filters still
+ * see row above the range, only deflate window starts fresh, so ranges are byte aligned raw
+ * deflate streams that are simply concatenated: all but last end with a sync flush.
+ */
+static void png_encode_task(void *data, unsigned int task) {
+    struct png_job *job = data;
+    const struct encode_source *source = job->source;
+    int channels = source->channels;
+    size_t row_len = (size_t)source->width * channels;
+    int y0 = task * job->rows_per_task;
+    int y1 = y0 + job->rows_per_task > source->height ? source->height : y0 + job->rows_per_task;
+    bool last = task == job->n_tasks - 1;
+
+    /* first row of band buffer is the row above current band */
+    uint8_t *band = xcalloc(BAND_ROWS + 1, row_len);
+    uint8_t *filtered = xmalloc((row_len + 1) * BAND_ROWS);
+    uint8_t *scratch = xmalloc(row_len + 1);
+    size_t tmp_size = encode_source_tmp_size(source, BAND_ROWS);
+    uint8_t *tmp = tmp_size > 0 ? xmalloc(tmp_size) : NULL;
+
+    struct png_out out = {0};
+    out_reserve(&out, 8 + (row_len + 1) * (y1 - y0) / 2);
+    /* length is filled in at the end */
+    out.size = 8;
+    memcpy(out.data + 4, "IDAT", 4);
+
+#ifdef HAVE_ZLIB
+    z_stream strm = {0};
+    if (job->preset != ENCODE_PRESET_NONE) {
+        int level, strategy;
+        get_deflate_params(job->preset, &level, &strategy);
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+            DIE("failed to initialize deflate stream");
+        }
+    }
+#endif
+
+    if (y0 > 0) {
+        encode_source_rows(source, band, tmp, y0 - 1, 1);
+    }
+
+    uint32_t adler = 1;
+    size_t length = 0;
+    for (int y = y0; y < y1; y += BAND_ROWS) {
+        int rows = y + BAND_ROWS > y1 ? y1 - y : BAND_ROWS;
+        encode_source_rows(source, band + row_len, tmp, y, rows);
+
+        for (int i = 0; i < rows; i++) {
+            const uint8_t *row = band + (i + 1) * row_len;
+            const uint8_t *prev = band + i * row_len;
+            uint8_t *dest = filtered + i * (row_len + 1);
+
+            switch (job->preset) {
+            case ENCODE_PRESET_NONE:
+                filter_row(dest, row, prev, row_len, channels, PNG_FILTER_NONE);
+                break;
+            case ENCODE_PRESET_FAST:
+                filter_row(dest, row, prev, row_len, channels, PNG_FILTER_SUB);
+                break;
+            default:
+                filter_row_adaptive(dest, scratch, row, prev, row_len, channels);
+                break;
+            }
+        }
+
+        size_t size = (row_len + 1) * rows;
+        adler = png_adler32(adler, filtered, size);
+        length += size;
+
+        bool last_band = y + rows == y1;
+        if (job->preset == ENCODE_PRESET_NONE) {
+            store_band(&out, filtered, size, last && last_band);
+        } else {
+#ifdef HAVE_ZLIB
+            int flush = !last_band ? Z_NO_FLUSH : last ? Z_FINISH : Z_SYNC_FLUSH;
+            deflate_band(&strm, &out, filtered, size, flush);
+#endif
+        }
+
+        memcpy(band, band + rows * row_len, row_len);
+    }
+
+#ifdef HAVE_ZLIB
+    if (job->preset != ENCODE_PRESET_NONE) {
+        deflateEnd(&strm);
+    }
+#endif
+
+    put_be32(out.data, out.size - 8);
+    uint8_t crc[4];
+    put_be32(crc, png_crc32(0, out.data + 4, out.size - 4));
+    out_append(&out, crc, 4);
+
+    free(band);
+    free(filtered);
+    free(scratch);
+    free(tmp);
+
+    job->parts[task + 1] = (struct encoded_part){ .data = out.data, .size = out.size };
+    job->adlers[task] = adler;
+    job->lengths[task] = length;
+}
+
+void encode_png(const struct encode_source *source, enum encode_preset preset,
+                struct encoded_image *image) {
+#ifndef HAVE_ZLIB
+    static bool warned = false;
+    if (preset != ENCODE_PRESET_NONE && !warned) {
+        WARN("built without zlib, writing uncompressed png");
+        warned = true;
+    }
+    preset = ENCODE_PRESET_NONE;
+    init_crc_table();
+#endif
+
+    struct png_job job = {
+        .source = source,
+        .preset = preset,
+        .rows_per_task = encode_rows_per_task(source, BAND_ROWS),
+    };
+    job.n_tasks = (source->height + job.rows_per_task - 1) / job.rows_per_task;
+    job.adlers = xmalloc(job.n_tasks * sizeof(*job.adlers));
+    job.lengths = xmalloc(job.n_tasks * sizeof(*job.lengths));
+
+    /* signature up to zlib header, one IDAT per task, checksum and IEND */
+    image->n_parts = job.n_tasks + 2;
+    image->parts = xcalloc(image->n_parts, sizeof(*image->parts));
+    job.parts = image->parts;
+
+    struct png_out head = {0};
+    out_append(&head, png_signature, sizeof(png_signature));
+
+    uint8_t ihdr[13];
+    put_be32(ihdr, source->width);
+    put_be32(ihdr + 4, source->height);
+    ihdr[8] = 8; /* bit depth */
+    ihdr[9] = source->channels == 4 ? 6 : 2; /* RGBA or RGB */
+    ihdr[10] = 0; /* deflate */
+    ihdr[11] = 0; /* adaptive filtering */
+    ihdr[12] = 0; /* no interlace */
+    out_chunk(&head, "IHDR", ihdr, sizeof(ihdr));
+
+    /* 32k window, check bits make it a multiple of 31 */
+    const uint8_t zlib_header[2] = {0x78, 0x01};
+    out_chunk(&head, "IDAT", zlib_header, sizeof(zlib_header));
+    image->parts[0] = (struct encoded_part){ .data = head.data, .size = head.size };
+
+    threadpool_run(png_encode_task, &job, job.n_tasks);
+
+    uint32_t adler = job.adlers[0];
+    for (unsigned int i = 1; i < job.n_tasks; i++) {
+        adler = png_adler32_combine(adler, job.adlers[i], job.lengths[i]);
+    }
+
+    struct png_out tail = {0};
+    uint8_t trailer[4];
+    put_be32(trailer, adler);
+    out_chunk(&tail, "IDAT", trailer, sizeof(trailer));
+    out_chunk(&tail, "IEND", NULL, 0);
+    image->parts[job.n_tasks + 1] = (struct encoded_part){ .data = tail.data, .size = tail.size };
+
+    free(job.adlers);
+    free(job.lengths);
+}
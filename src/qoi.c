@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "encode.h"
+#include "threadpool.h"
+#include "xmalloc.h"
+
+#define BAND_ROWS 64
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN 62
+
+static const uint8_t qoi_end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+union qoi_pixel {
+    struct {
+        uint8_t r, g, b, a;
+    };
+    uint32_t v;
+};
+
+struct qoi_job {
+    const struct encode_source *source;
+    int rows_per_task;
+    struct encoded_part *parts;
+};
+
+static unsigned int qoi_hash(union qoi_pixel px) {
+    return (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+}
+
+/*
+ * Every task starts with the last pixel of the previous row range as previous pixel, so
+ * diffs and runs work like in a single stream. Index entries decoder got from earlier
+ * ranges are unknown here, those are just never referenced. Runs end at range boundary.
+ */
+static void qoi_encode_task(void *data, unsigned int task) {
+    struct qoi_job *job = data;
+    const struct encode_source *source = job->source;
+    int w = source->width;
+    int channels = source->channels;
+    int y0 = task * job->rows_per_task;
+    int y1 = y0 + job->rows_per_task > source->height ? source->height : y0 + job->rows_per_task;
+
+    uint8_t *band = xmalloc((size_t)w * channels * BAND_ROWS);
+    size_t tmp_size = encode_source_tmp_size(source, BAND_ROWS);
+    uint8_t *tmp = tmp_size > 0 ? xmalloc(tmp_size) : NULL;
+    /* worst case is a full RGB(A) op for every pixel */
+    uint8_t *out = xmalloc((size_t)w * (y1 - y0) * (channels + 1));
+    size_t pos = 0;
+
+    union qoi_pixel index[64] = {0};
+    /* at the start of the image decoder's index is all zeros, so it's valid */
+    uint64_t index_valid = task == 0 ? UINT64_MAX : 0;
+    union qoi_pixel prev = { .r = 0, .g = 0, .b = 0, .a = 255 };
+    int run = 0;
+
+    if (y0 > 0) {
+        encode_source_rows(source, band, tmp, y0 - 1, 1);
+        const uint8_t *p = band + (size_t)(w - 1) * channels;
+        prev = (union qoi_pixel){ .r = p[0], .g = p[1], .b = p[2], .a = channels == 4 ? p[3] : 255 };
+    }
+
+    for (int y = y0; y < y1; y += BAND_ROWS) {
+        int rows = y + BAND_ROWS > y1 ? y1 - y : BAND_ROWS;
+        encode_source_rows(source, band, tmp, y, rows);
+
+        const uint8_t *p = band;
+        const uint8_t *end = band + (size_t)w * rows * channels;
+        for (; p < end; p += channels) {
+            union qoi_pixel px = { .r = p[0], .g = p[1], .b = p[2], .a = channels == 4 ? p[3] : 255 };
+
+            if (px.v == prev.v) {
+                run++;
+                if (run == QOI_MAX_RUN) {
+                    out[pos++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0) {
+                out[pos++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            unsigned int h = qoi_hash(px);
+            if ((index_valid & (1ull << h)) && index[h].v == px.v) {
+                out[pos++] = QOI_OP_INDEX | h;
+            } else {
+                index[h] = px;
+                index_valid |= 1ull << h;
+
+                if (px.a == prev.a) {
+                    int8_t vr = px.r - prev.r;
+                    int8_t vg = px.g - prev.g;
+                    int8_t vb = px.b - prev.b;
+                    int8_t vg_r = vr - vg;
+                    int8_t vg_b = vb - vg;
+
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                        out[pos++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                    } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32
+                               && vg_b > -9 && vg_b < 8) {
+                        out[pos++] = QOI_OP_LUMA | (vg + 32);
+                        out[pos++] = (vg_r + 8) << 4 | (vg_b + 8);
+                    } else {
+                        out[pos++] = QOI_OP_RGB;
+                        out[pos++] = px.r;
+                        out[pos++] = px.g;
+                        out[pos++] = px.b;
+                    }
+                } else {
+                    out[pos++] = QOI_OP_RGBA;
+                    out[pos++] = px.r;
+                    out[pos++] = px.g;
+                    out[pos++] = px.b;
+                    out[pos++] = px.a;
+                }
+            }
+            prev = px;
+        }
+    }
+
+    if (run > 0) {
+        out[pos++] = QOI_OP_RUN | (run - 1);
+    }
+
+    free(band);
+    free(tmp);
+
+    job->parts[task + 1] = (struct encoded_part){ .data = out, .size = pos };
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void encode_qoi(const struct encode_source *source, struct encoded_image *image) {
+    struct qoi_job job = {
+        .source = source,
+        .rows_per_task = encode_rows_per_task(source, BAND_ROWS),
+    };
+    unsigned int tasks = (source->height + job.rows_per_task - 1) / job.rows_per_task;
+
+    /* header, one part per task, end marker */
+    image->n_parts = tasks + 2;
+    image->parts = xcalloc(image->n_parts, sizeof(*image->parts));
+    job.parts = image->parts;
+
+    uint8_t *header = xmalloc(QOI_HEADER_SIZE);
+    memcpy(header, "qoif", 4);
+    put_be32(header + 4, source->width);
+    put_be32(header + 8, source->height);
+    header[12] = source->channels;
+    header[13] = 0; /* sRGB with linear alpha */
+    image->parts[0] = (struct encoded_part){ .data = header, .size = QOI_HEADER_SIZE };
+
+    threadpool_run(qoi_encode_task, &job, tasks);
+
+    uint8_t *end = xmalloc(sizeof(qoi_end_marker));
+    memcpy(end, qoi_end_marker, sizeof(qoi_end_marker));
+    image->parts[tasks + 1] = (struct encoded_part){ .data = end, .size = sizeof(qoi_end_marker) };
+}
@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "rotate.h"
+#include "common.h"
+#include "threadpool.h"
+
+/* images smaller than this are not worth waking up worker threads for */
+#define PARALLEL_MIN_BYTES (1024 * 1024)
+
+/* 32x32 tile of 4 byte pixels is 4K, so source and destination tiles both stay in L1 */
+#define TILE_SIZE 32
+
+/* copies size x size block of 4 byte pixels, rows of src become columns of dest */
+typedef void (*transpose_block_func)(const uint8_t *src, ptrdiff_t src_step,
+                                     uint8_t *dest, ptrdiff_t dest_step);
+
+typedef struct { uint8_t b[3]; } pixel24_t;
+
+/*
+ * Describes where pixel x, y of source ends up in destination:
+ * dest + origin + x * dx + y * dy (all in bytes).
+ */
+struct mapping {
+    bool swap_axes;
+    ptrdiff_t origin, dx, dy;
+};
+
+/* flip_x and flip_y refer to destination axes */
+static void get_axes(enum wl_output_transform transform,
+                     bool *swap_axes, bool *flip_x, bool *flip_y) {
+    switch (transform) {
+    case WL_OUTPUT_TRANSFORM_NORMAL:      *swap_axes = false; *flip_x = false; *flip_y = false; break;
+    case WL_OUTPUT_TRANSFORM_180:         *swap_axes = false; *flip_x = true;  *flip_y = true;  break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED:     *swap_axes = false; *flip_x = true;  *flip_y = false; break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_180: *swap_axes = false; *flip_x = false; *flip_y = true;  break;
+    case WL_OUTPUT_TRANSFORM_90:          *swap_axes = true;  *flip_x = true;  *flip_y = false; break;
+    case WL_OUTPUT_TRANSFORM_270:         *swap_axes = true;  *flip_x = false; *flip_y = true;  break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_90:  *swap_axes = true;  *flip_x = false; *flip_y = false; break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_270: *swap_axes = true;  *flip_x = true;  *flip_y = true;  break;
+    default:
+        DIE("UNREACHABLE: wl_output_transform is %d", transform);
+    }
+}
+
+static struct mapping get_mapping(int w, int h, int bpp, enum wl_output_transform transform) {
+    bool swap_axes, flip_x, flip_y;
+    get_axes(transform, &swap_axes, &flip_x, &flip_y);
+
+    int dest_w = swap_axes ? h : w;
+    int dest_h = swap_axes ? w : h;
+    ptrdiff_t dest_stride = (ptrdiff_t)dest_w * bpp;
+    ptrdiff_t step_x = flip_x ? -bpp : bpp;
+    ptrdiff_t step_y = flip_y ? -dest_stride : dest_stride;
+
+    struct mapping m = {
+        .swap_axes = swap_axes,
+        .origin = (flip_x ? (ptrdiff_t)(dest_w - 1) * bpp : 0)
+                + (flip_y ? (ptrdiff_t)(dest_h - 1) * dest_stride : 0),
+        .dx = swap_axes ? step_y : step_x,
+        .dy = swap_axes ? step_x : step_y,
+    };
+    return m;
+}
+
+/* generic copy of a rectangle with pixel type known at compile time */
+#define DEFINE_COPY_RECT(name, type) \
+static void name(uint8_t *dest, const uint8_t *src, ptrdiff_t src_stride, \
+                 ptrdiff_t dx, ptrdiff_t dy, int x0, int y0, int w, int h) { \
+    for (int y = y0; y < y0 + h; y++) { \
+        const type *s = (const type *)(src + y * src_stride); \
+        uint8_t *d = dest + y * dy; \
+        for (int x = x0; x < x0 + w; x++) { \
+            *(type *)(d + x * dx) = s[x]; \
+        } \
+    } \
+}
+
+DEFINE_COPY_RECT(copy_rect_16, uint16_t)
+DEFINE_COPY_RECT(copy_rect_24, pixel24_t)
+DEFINE_COPY_RECT(copy_rect_32, uint32_t)
+
+static void copy_rect(uint8_t *dest, const uint8_t *src, ptrdiff_t src_stride, int bpp,
+                      ptrdiff_t dx, ptrdiff_t dy, int x0, int y0, int w, int h) {
+    switch (bpp) {
+    case 2:
+        copy_rect_16(dest, src, src_stride, dx, dy, x0, y0, w, h);
+        break;
+    case 3:
+        copy_rect_24(dest, src, src_stride, dx, dy, x0, y0, w, h);
+        break;
+    case 4:
+        copy_rect_32(dest, src, src_stride, dx, dy, x0, y0, w, h);
+        break;
+    default:
+        for (int y = y0; y < y0 + h; y++) {
+            for (int x = x0; x < x0 + w; x++) {
+                memcpy(dest + x * dx + y * dy, src + y * src_stride + x * bpp, bpp);
+            }
+        }
+        break;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+#ifdef __SSE2__
+static void transpose_4x4_sse2(const uint8_t *src, ptrdiff_t src_step,
+                               uint8_t *dest, ptrdiff_t dest_step) {
+    __m128i r0 = _mm_loadu_si128((const __m128i *)(src + 0 * src_step));
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(src + 1 * src_step));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(src + 2 * src_step));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(src + 3 * src_step));
+
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    _mm_storeu_si128((__m128i *)(dest + 0 * dest_step), _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(dest + 1 * dest_step), _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(dest + 2 * dest_step), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *)(dest + 3 * dest_step), _mm_unpackhi_epi64(t2, t3));
+}
+#endif /* #ifdef __SSE2__ */
+
+__attribute__((target("avx2")))
+static void transpose_8x8_avx2(const uint8_t *src, ptrdiff_t src_step,
+                               uint8_t *dest, ptrdiff_t dest_step) {
+    __m256i r0 = _mm256_loadu_si256((const __m256i *)(src + 0 * src_step));
+    __m256i r1 = _mm256_loadu_si256((const __m256i *)(src + 1 * src_step));
+    __m256i r2 = _mm256_loadu_si256((const __m256i *)(src + 2 * src_step));
+    __m256i r3 = _mm256_loadu_si256((const __m256i *)(src + 3 * src_step));
+    __m256i r4 = _mm256_loadu_si256((const __m256i *)(src + 4 * src_step));
+    __m256i r5 = _mm256_loadu_si256((const __m256i *)(src + 5 * src_step));
+    __m256i r6 = _mm256_loadu_si256((const __m256i *)(src + 6 * src_step));
+    __m256i r7 = _mm256_loadu_si256((const __m256i *)(src + 7 * src_step));
+
+    __m256i t0 = _mm256_unpacklo_epi32(r0, r1);
+    __m256i t1 = _mm256_unpackhi_epi32(r0, r1);
+    __m256i t2 = _mm256_unpacklo_epi32(r2, r3);
+    __m256i t3 = _mm256_unpackhi_epi32(r2, r3);
+    __m256i t4 = _mm256_unpacklo_epi32(r4, r5);
+    __m256i t5 = _mm256_unpackhi_epi32(r4, r5);
+    __m256i t6 = _mm256_unpacklo_epi32(r6, r7);
+    __m256i t7 = _mm256_unpackhi_epi32(r6, r7);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    _mm256_storeu_si256((__m256i *)(dest + 0 * dest_step), _mm256_permute2x128_si256(u0, u4, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + 1 * dest_step), _mm256_permute2x128_si256(u1, u5, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + 2 * dest_step), _mm256_permute2x128_si256(u2, u6, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + 3 * dest_step), _mm256_permute2x128_si256(u3, u7, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + 4 * dest_step), _mm256_permute2x128_si256(u0, u4, 0x31));
+    _mm256_storeu_si256((__m256i *)(dest + 5 * dest_step), _mm256_permute2x128_si256(u1, u5, 0x31));
+    _mm256_storeu_si256((__m256i *)(dest + 6 * dest_step), _mm256_permute2x128_si256(u2, u6, 0x31));
+    _mm256_storeu_si256((__m256i *)(dest + 7 * dest_step), _mm256_permute2x128_si256(u3, u7, 0x31));
+}
+#endif /* #ifdef HAVE_X86_KERNELS */
+
+#ifdef __ARM_NEON
+static void transpose_4x4_neon(const uint8_t *src, ptrdiff_t src_step,
+                               uint8_t *dest, ptrdiff_t dest_step) {
+    uint32x4_t r0 = vreinterpretq_u32_u8(vld1q_u8(src + 0 * src_step));
+    uint32x4_t r1 = vreinterpretq_u32_u8(vld1q_u8(src + 1 * src_step));
+    uint32x4_t r2 = vreinterpretq_u32_u8(vld1q_u8(src + 2 * src_step));
+    uint32x4_t r3 = vreinterpretq_u32_u8(vld1q_u8(src + 3 * src_step));
+
+    uint32x4x2_t p01 = vtrnq_u32(r0, r1);
+    uint32x4x2_t p23 = vtrnq_u32(r2, r3);
+
+    uint32x4_t c0 = vcombine_u32(vget_low_u32(p01.val[0]), vget_low_u32(p23.val[0]));
+    uint32x4_t c1 = vcombine_u32(vget_low_u32(p01.val[1]), vget_low_u32(p23.val[1]));
+    uint32x4_t c2 = vcombine_u32(vget_high_u32(p01.val[0]), vget_high_u32(p23.val[0]));
+    uint32x4_t c3 = vcombine_u32(vget_high_u32(p01.val[1]), vget_high_u32(p23.val[1]));
+
+    vst1q_u8(dest + 0 * dest_step, vreinterpretq_u8_u32(c0));
+    vst1q_u8(dest + 1 * dest_step, vreinterpretq_u8_u32(c1));
+    vst1q_u8(dest + 2 * dest_step, vreinterpretq_u8_u32(c2));
+    vst1q_u8(dest + 3 * dest_step, vreinterpretq_u8_u32(c3));
+}
+#endif /* #ifdef __ARM_NEON */
+
+/* picks the widest block transpose supported by the cpu we are running on */
+static transpose_block_func select_transpose_block(int *block_size) {
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        *block_size = 8;
+        return transpose_8x8_avx2;
+    }
+#ifdef __SSE2__
+    *block_size = 4;
+    return transpose_4x4_sse2;
+#endif
+#elif defined(__ARM_NEON)
+    *block_size = 4;
+    return transpose_4x4_neon;
+#endif
+    *block_size = 0;
+    return NULL;
+}
+
+static void transpose_tile_32(uint8_t *dest, const uint8_t *src, ptrdiff_t src_stride,
+                              ptrdiff_t dx, ptrdiff_t dy, int x0, int y0, int w, int h,
+                              transpose_block_func block, int size) {
+    int full_w = block ? w - w % size : 0;
+    int full_h = block ? h - h % size : 0;
+
+    for (int by = y0; by < y0 + full_h; by += size) {
+        /*
+         * Element j of a transposed row must land at the lowest address first,
+         * so when dest columns go right to left source rows are read bottom to top.
+         */
+        int first_y = dy > 0 ? by : by + size - 1;
+        ptrdiff_t src_step = dy > 0 ? src_stride : -src_stride;
+
+        for (int bx = x0; bx < x0 + full_w; bx += size) {
+            block(src + first_y * src_stride + bx * 4, src_step,
+                  dest + bx * dx + first_y * dy, dx);
+        }
+    }
+
+    /* leftovers that don't fill a whole block */
+    copy_rect_32(dest, src, src_stride, dx, dy, x0 + full_w, y0, w - full_w, h);
+    copy_rect_32(dest, src, src_stride, dx, dy, x0, y0 + full_h, full_w, h - full_h);
+}
+
+void rotate_image_rect(void *dest, const void *src, int w, int h,
+                       int bytes_per_pixel, enum wl_output_transform transform,
+                       int x, int y, int rect_w, int rect_h) {
+    const int bpp = bytes_per_pixel;
+    const ptrdiff_t src_stride = (ptrdiff_t)w * bpp;
+    const struct mapping m = get_mapping(w, h, bpp, transform);
+    const uint8_t *s = src;
+    uint8_t *d = (uint8_t *)dest + m.origin;
+
+    if (!m.swap_axes) {
+        for (int row = y; row < y + rect_h; row++) {
+            if (m.dx > 0) {
+                memcpy(d + x * m.dx + row * m.dy, s + row * src_stride + x * bpp,
+                       (size_t)rect_w * bpp);
+            } else {
+                copy_rect(d, s, src_stride, bpp, m.dx, m.dy, x, row, rect_w, 1);
+            }
+        }
+        return;
+    }
+
+    int block_size = 0;
+    transpose_block_func block = bpp == 4 ? select_transpose_block(&block_size) : NULL;
+
+    for (int ty = y; ty < y + rect_h; ty += TILE_SIZE) {
+        int th = ty + TILE_SIZE > y + rect_h ? y + rect_h - ty : TILE_SIZE;
+        for (int tx = x; tx < x + rect_w; tx += TILE_SIZE) {
+            int tw = tx + TILE_SIZE > x + rect_w ? x + rect_w - tx : TILE_SIZE;
+            if (bpp == 4) {
+                transpose_tile_32(d, s, src_stride, m.dx, m.dy, tx, ty, tw, th,
+                                  block, block_size);
+            } else {
+                copy_rect(d, s, src_stride, bpp, m.dx, m.dy, tx, ty, tw, th);
+            }
+        }
+    }
+}
+
+void rotate_rect(int w, int h, enum wl_output_transform transform,
+                 int *x, int *y, int *rect_w, int *rect_h) {
+    bool swap_axes, flip_x, flip_y;
+    get_axes(transform, &swap_axes, &flip_x, &flip_y);
+
+    int dest_w = swap_axes ? h : w;
+    int dest_h = swap_axes ? w : h;
+    /* source x runs along destination y when axes are swapped */
+    int rx = swap_axes ? *y : *x;
+    int ry = swap_axes ? *x : *y;
+    int rw = swap_axes ? *rect_h : *rect_w;
+    int rh = swap_axes ? *rect_w : *rect_h;
+
+    *x = flip_x ? dest_w - (rx + rw) : rx;
+    *y = flip_y ? dest_h - (ry + rh) : ry;
+    *rect_w = rw;
+    *rect_h = rh;
+}
+
+static enum wl_output_transform inverse_transform(enum wl_output_transform transform) {
+    /* flipped transforms are reflections and undo themselves */
+    switch (transform) {
+    case WL_OUTPUT_TRANSFORM_90:
+        return WL_OUTPUT_TRANSFORM_270;
+    case WL_OUTPUT_TRANSFORM_270:
+        return WL_OUTPUT_TRANSFORM_90;
+    default:
+        return transform;
+    }
+}
+
+void unrotate_point(int w, int h, enum wl_output_transform transform, int *x, int *y) {
+    bool swap_axes, flip_x, flip_y;
+    get_axes(transform, &swap_axes, &flip_x, &flip_y);
+
+    int one_w = 1, one_h = 1;
+    rotate_rect(swap_axes ? h : w, swap_axes ? w : h, inverse_transform(transform),
+                x, y, &one_w, &one_h);
+}
+
+void rotate_image_rows(void *dest, const void *src, int w, int h,
+                       int bytes_per_pixel, enum wl_output_transform transform,
+                       int y, int rows) {
+    bool swap_axes, flip_x, flip_y;
+    get_axes(transform, &swap_axes, &flip_x, &flip_y);
+
+    int dest_w = swap_axes ? h : w;
+    int dest_h = swap_axes ? w : h;
+
+    /* source rectangle that ends up in these rows */
+    int rx = 0, ry = y, rw = dest_w, rh = rows;
+    rotate_rect(dest_w, dest_h, inverse_transform(transform), &rx, &ry, &rw, &rh);
+
+    /* shifted so that row y of the full image lands at the start of dest */
+    uint8_t *d = (uint8_t *)dest - (ptrdiff_t)y * dest_w * bytes_per_pixel;
+    rotate_image_rect(d, src, w, h, bytes_per_pixel, transform, rx, ry, rw, rh);
+}
+
+struct rotate_job {
+    void *dest;
+    const void *src;
+    int w, h, bytes_per_pixel;
+    enum wl_output_transform transform;
+    int band_h;
+};
+
+static void rotate_band(void *data, unsigned int task) {
+    const struct rotate_job *job = data;
+
+    int y = task * job->band_h;
+    int band_h = y + job->band_h > job->h ? job->h - y : job->band_h;
+
+    rotate_image_rect(job->dest, job->src, job->w, job->h, job->bytes_per_pixel,
+                      job->transform, 0, y, job->w, band_h);
+}
+
+void rotate_image(void *dest, const void *src, int w, int h,
+                  int bytes_per_pixel, enum wl_output_transform transform) {
+    size_t size = (size_t)w * h * bytes_per_pixel;
+    unsigned int threads = threadpool_size();
+
+    if (threads <= 1 || size < PARALLEL_MIN_BYTES) {
+        rotate_image_rect(dest, src, w, h, bytes_per_pixel, transform, 0, 0, w, h);
+        return;
+    }
+
+    /* several bands per thread so faster threads can pick up slack, each a whole tile row */
+    int band_h = (h + threads * 4 - 1) / (threads * 4);
+    band_h = (band_h + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE;
+
+    struct rotate_job job = {
+        .dest = dest,
+        .src = src,
+        .w = w,
+        .h = h,
+        .bytes_per_pixel = bytes_per_pixel,
+        .transform = transform,
+        .band_h = band_h,
+    };
+    threadpool_run(rotate_band, &job, (h + band_h - 1) / band_h);
+}
+
+void rotate_image_reference(void *dest, const void *src, int w, int h,
+                            int bytes_per_pixel, enum wl_output_transform transform) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    int x, y, new_x, new_y;
+
+    switch (transform) {
+    case WL_OUTPUT_TRANSFORM_NORMAL:
+        memcpy(dest, src, w * h * bytes_per_pixel);
+        break;
+
+    case WL_OUTPUT_TRANSFORM_90:
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                new_x = h - 1 - y;
+                new_y = x;
+
+                memcpy(d + (new_y * h + new_x) * bytes_per_pixel,
+                       s + (y * w + x) * bytes_per_pixel,
+                       bytes_per_pixel);
+            }
+        }
+        break;
+
+    case WL_OUTPUT_TRANSFORM_180:
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                new_x = w - 1 - x;
+                new_y = h - 1 - y;
+
+                memcpy(d + (new_y * w + new_x) * bytes_per_pixel,
+                       s + (y * w + x) * bytes_per_pixel,
+                       bytes_per_pixel);
+            }
+        }
+        break;
+
+    case WL_OUTPUT_TRANSFORM_270:
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                new_x = y;
+                new_y = w - 1 - x;
+
+                memcpy(d + (new_y * h + new_x) * bytes_per_pixel,
+                       s + (y * w + x) * bytes_per_pixel,
+                       bytes_per_pixel);
+            }
+        }
+        break;
+
+    case WL_OUTPUT_TRANSFORM_FLIPPED:
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                new_x = w - 1 - x;
+                new_y = y;
+
+                memcpy(d + (new_y * w + new_x) * bytes_per_pixel,
+                       s + (y * w + x) * bytes_per_pixel,
+                       bytes_per_pixel);
+            }
+        }
+        break;
+
+    case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                new_x = y;
+                new_y = x;
+
+                memcpy(d + (new_y * h + new_x) * bytes_per_pixel,
+                       s + (y * w + x) * bytes_per_pixel,
+                       bytes_per_pixel);
+            }
+        }
+        break;
+
+    case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                new_x = x;
+                new_y = h - 1 - y;
+
+                memcpy(d + (new_y * w + new_x) * bytes_per_pixel,
+                       s + (y * w + x) * bytes_per_pixel,
+                       bytes_per_pixel);
+            }
+        }
+        break;
+
+    case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                new_x = h - 1 - y;
+                new_y = w - 1 - x;
+
+                memcpy(d + (new_y * h + new_x) * bytes_per_pixel,
+                       s + (y * w + x) * bytes_per_pixel,
+                       bytes_per_pixel);
+            }
+        }
+        break;
+    }
+}
+
@@ -0,0 +1,35 @@
+#ifndef ROTATE_H
+#define ROTATE_H
+
+#include <wayland-client.h>
+
+/*
+ * Copies w x h image from src to dest applying transform. Both images are tightly packed,
+ * dest is h x w for transforms that swap axes.
+ */
+void rotate_image(void *dest, const void *src, int w, int h,
+                  int bytes_per_pixel, enum wl_output_transform transform);
+
+/* same as rotate_image, but only pixels inside rectangle x, y, rect_w, rect_h of src are copied */
+void rotate_image_rect(void *dest, const void *src, int w, int h,
+                       int bytes_per_pixel, enum wl_output_transform transform,
+                       int x, int y, int rect_w, int rect_h);
+
+/* writes only rows y to y + rows of what rotate_image would produce into dest */
+void rotate_image_rows(void *dest, const void *src, int w, int h,
+                       int bytes_per_pixel, enum wl_output_transform transform,
+                       int y, int rows);
+
+/* maps rectangle of w x h src to where rotate_image puts it in dest */
+void rotate_rect(int w, int h, enum wl_output_transform transform,
+                 int *x, int *y, int *rect_w, int *rect_h);
+
+/* maps pixel x, y of what rotate_image makes out of w x h src back to its place in src */
+void unrotate_point(int w, int h, enum wl_output_transform transform, int *x, int *y);
+
+/* naive per-pixel implementation, optimized kernels are checked against this one */
+void rotate_image_reference(void *dest, const void *src, int w, int h,
+                            int bytes_per_pixel, enum wl_output_transform transform);
+
+#endif /* #ifndef ROTATE_H */
+
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/sysmacros.h>
 #include <wayland-client.h>
 
 #include "ext-image-copy-capture-v1.h"
@@ -12,10 +13,73 @@
 #include "common.h"
 #include "wayland.h"
 #include "screenshot.h"
-#include "shm.h"
+#include "dmabuf.h"
+#include "buffer_cache.h"
 #include "config.h"
 #include "xmalloc.h"
 #include "utils.h"
+#include "timing.h"
+#include "damage.h"
+#include "timer.h"
+
+/* transient failures are retried this many times before output is given up on */
+#define CAPTURE_MAX_RETRIES 3
+/* compositor that's under load gets a bit more time with every retry */
+#define CAPTURE_RETRY_DELAY_MS 20
+
+static void start_capture(struct screenshot *sshot);
+
+static uint64_t timestamp_to_ns(uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    uint64_t sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+    return sec * 1000000000 + tv_nsec;
+}
+
+static void update_damage(struct screenshot *sshot) {
+    struct buffer *prev = sshot->prev_buffer;
+    struct buffer *cur = sshot->buffer;
+
+    if (prev->width != cur->width || prev->height != cur->height || prev->stride != cur->stride) {
+        damage_add(&sshot->damage, 0, 0, cur->width, cur->height);
+        return;
+    }
+
+    uint64_t start = timing_now();
+    dmabuf_begin_cpu_access(prev);
+    dmabuf_begin_cpu_access(cur);
+    find_damage(&sshot->damage, prev->data, cur->data, cur->width, cur->height, cur->stride,
+                get_bytes_per_pixel(sshot->format), &sshot->damage_hint);
+    dmabuf_end_cpu_access(cur);
+    dmabuf_end_cpu_access(prev);
+    timing_record_bytes("diff", sshot->output->name, start, 2 * (size_t)cur->stride * cur->height);
+
+    DEBUG("%zu damaged rects on %s", sshot->damage.size / sizeof(struct rect), sshot->output->name);
+}
+
+static void screenshot_ready(struct screenshot *sshot) {
+    uint64_t now = timing_now();
+    timing_record_span("capture", sshot->output->name, sshot->capture_start, now);
+    if (sshot->presented != 0 && sshot->presented <= now) {
+        timing_record_span("presentation-to-ready", sshot->output->name, sshot->presented, now);
+    }
+
+    if (sshot->prev_buffer != NULL) {
+        update_damage(sshot);
+    }
+
+    sshot->state = SCREENSHOT_READY;
+    if (sshot->on_ready) {
+        sshot->on_ready(sshot, sshot->on_ready_data);
+    }
+}
+
+/* -e frames are sealed and handed to child as they are, which shm pool can't do */
+static struct buffer *get_capture_buffer(struct output *output, enum wl_shm_format format,
+                                         int32_t width, int32_t height, int32_t stride) {
+    if (config.export_frames) {
+        return get_sealable_buffer(output, format, width, height, stride);
+    }
+    return get_shm_buffer(output, format, width, height, stride);
+}
 
 static void frame_buffer_handler(void *data, struct zwlr_screencopy_frame_v1 *frame,
                                  uint32_t format,
@@ -23,9 +87,9 @@ static void frame_buffer_handler(void *data, struct zwlr_screencopy_frame_v1 *fr
     struct screenshot *sshot = data;
 
     sshot->format = format;
-    create_buffer(&sshot->buffer, format, width, height, stride);
+    sshot->buffer = get_capture_buffer(sshot->output, format, width, height, stride);
 
-    zwlr_screencopy_frame_v1_copy(frame, sshot->buffer.wl_buffer);
+    zwlr_screencopy_frame_v1_copy(frame, sshot->buffer->wl_buffer);
 }
 
 static void frame_flags_handler(void *data,
@@ -39,14 +103,85 @@ static void frame_ready_handler(void *data, struct zwlr_screencopy_frame_v1 *fra
                                 uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
     struct screenshot *sshot = data;
 
-    sshot->ready = true;
+    sshot->presented = timestamp_to_ns(tv_sec_hi, tv_sec_lo, tv_nsec);
     zwlr_screencopy_frame_v1_destroy(frame);
+    sshot->screencopy_frame = NULL;
+    screenshot_ready(sshot);
+}
+
+/* drops whatever is in flight, including the buffer capture was going into */
+static void abort_capture(struct screenshot *sshot) {
+    if (sshot->retry_timer != NULL) {
+        timer_cancel(sshot->retry_timer);
+        sshot->retry_timer = NULL;
+    }
+    if (sshot->screencopy_frame != NULL) {
+        zwlr_screencopy_frame_v1_destroy(sshot->screencopy_frame);
+        sshot->screencopy_frame = NULL;
+    }
+    if (sshot->frame != NULL) {
+        ext_image_copy_capture_frame_v1_destroy(sshot->frame);
+        sshot->frame = NULL;
+    }
+    if (sshot->dmabuf_pending) {
+        cancel_dmabuf_buffer(sshot->buffer);
+        buffer_cache_drop(sshot->buffer);
+        sshot->buffer = NULL;
+        sshot->dmabuf_pending = false;
+    }
+    if (sshot->buffer != NULL) {
+        buffer_cache_release(sshot->buffer);
+        sshot->buffer = NULL;
+    }
+}
+
+static void screenshot_failed(struct screenshot *sshot, const char *reason) {
+    abort_capture(sshot);
+
+    if (sshot->prev_buffer != NULL) {
+        /* refresh failed, previous frame is still good */
+        WARN("failed to refresh %s (%s), keeping previous frame", sshot->output->name, reason);
+        sshot->buffer = sshot->prev_buffer;
+        sshot->prev_buffer = NULL;
+        sshot->damage.size = 0;
+        screenshot_ready(sshot);
+        return;
+    }
+
+    WARN("failed to capture %s (%s), leaving it unfrozen", sshot->output->name, reason);
+    sshot->state = SCREENSHOT_FAILED;
+}
+
+/* returns false once retries run out, screenshot is failed then */
+static bool can_retry(struct screenshot *sshot, const char *reason) {
+    if (sshot->failures++ >= CAPTURE_MAX_RETRIES) {
+        screenshot_failed(sshot, reason);
+        return false;
+    }
+    DEBUG("capture of %s failed (%s), retrying", sshot->output->name, reason);
+    return true;
+}
+
+static void retry_timer_expired(void *data) {
+    struct screenshot *sshot = data;
+
+    sshot->retry_timer = NULL;
+    start_capture(sshot);
+}
+
+/* capture has to be aborted already */
+static void schedule_retry(struct screenshot *sshot) {
+    uint64_t delay = (uint64_t)CAPTURE_RETRY_DELAY_MS * sshot->failures * 1000000;
+    sshot->retry_timer = timer_add(timing_now() + delay, retry_timer_expired, sshot);
 }
 
 static void frame_failed_handler(void *data, struct zwlr_screencopy_frame_v1 *frame) {
     struct screenshot *sshot = data;
 
-    DIE("failed to capture screenshot");
+    if (can_retry(sshot, "compositor refused")) {
+        abort_capture(sshot);
+        schedule_retry(sshot);
+    }
 }
 
 static const struct zwlr_screencopy_frame_v1_listener screencopy_frame_listener = {
@@ -66,7 +201,9 @@ static void copy_capture_damage_handler(void *data,
                                         struct ext_image_copy_capture_frame_v1 *_,
                                         int32_t x, int32_t y,
                                         int32_t width, int32_t height) {
-    // noop
+    struct screenshot *sshot = data;
+
+    damage_add(&sshot->damage_hint, x, y, width, height);
 }
 
 static void copy_capture_presentation_time_handler(void *data,
@@ -74,15 +211,24 @@ static void copy_capture_presentation_time_handler(void *data,
                                                    uint32_t tv_sec_hi,
                                                    uint32_t tv_sec_lo,
                                                    uint32_t tv_nsec) {
-    // noop
+    struct screenshot *sshot = data;
+
+    sshot->presented = timestamp_to_ns(tv_sec_hi, tv_sec_lo, tv_nsec);
 }
 
 static void copy_capture_frame_ready_handler(void *data,
                                              struct ext_image_copy_capture_frame_v1 *frame) {
     struct screenshot *sshot = data;
 
-    sshot->ready = true;
     ext_image_copy_capture_frame_v1_destroy(frame);
+    sshot->frame = NULL;
+    screenshot_ready(sshot);
+}
+
+static void destroy_session(struct screenshot *sshot) {
+    ext_image_copy_capture_session_v1_destroy(sshot->session);
+    sshot->session = NULL;
+    sshot->dmabuf_formats.size = 0;
 }
 
 static void copy_capture_failed_handler(void *data,
@@ -103,7 +249,37 @@ static void copy_capture_failed_handler(void *data,
             reason_str = "unknown reason";
     }
 
-    DIE("failed to capture screenshot: %s", reason_str);
+    /*
+     * compositor imported the dmabuf but couldn't copy into it, and would fail the same way
+     * if it came back from cache, so it goes and the rest of this screenshot uses shm
+     */
+    if (reason != EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED
+            && sshot->buffer != NULL && sshot->buffer->dmabuf) {
+        WARN("failed to capture %s into dmabuf, falling back to shm", sshot->output->name);
+        buffer_cache_retire(sshot->buffer);
+        sshot->dmabuf_failed = true;
+    }
+
+    if (!can_retry(sshot, reason_str)) {
+        return;
+    }
+    abort_capture(sshot);
+
+    switch (reason) {
+        case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS:
+            /* new constraints are followed by done, which starts capture again */
+            if (sshot->constraints_done) {
+                start_capture(sshot);
+            }
+            break;
+        case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED:
+            /* session is gone, retry starts a new one */
+            destroy_session(sshot);
+            schedule_retry(sshot);
+            break;
+        default:
+            schedule_retry(sshot);
+    }
 }
 
 static const struct ext_image_copy_capture_frame_v1_listener image_copy_frame_listener = {
@@ -114,11 +290,20 @@ static const struct ext_image_copy_capture_frame_v1_listener image_copy_frame_li
     .failed = copy_capture_failed_handler,
 };
 
+/* constraints are sent again in full whenever they change */
+static void new_constraints(struct screenshot *sshot) {
+    if (sshot->constraints_done) {
+        sshot->constraints_done = false;
+        sshot->dmabuf_formats.size = 0;
+    }
+}
+
 static void session_buffer_size_handler(void *data,
                                         struct ext_image_copy_capture_session_v1 *_,
                                         uint32_t width,
                                         uint32_t height) {
     struct screenshot *sshot = data;
+    new_constraints(sshot);
     DEBUG("session_buffer_size: %ux%u", width, height);
     sshot->session_width = width;
     sshot->session_height = height;
@@ -128,6 +313,7 @@ static void session_shm_format_handler(void *data,
                                        struct ext_image_copy_capture_session_v1 *_,
                                        uint32_t format) {
     struct screenshot *sshot = data;
+    new_constraints(sshot);
     DEBUG("session_shm_format: 0x%" PRIx32, format);
     sshot->format = format;
 }
@@ -135,34 +321,144 @@ static void session_shm_format_handler(void *data,
 static void session_dmabuf_device_handler(void *data,
                                           struct ext_image_copy_capture_session_v1 *_,
                                           struct wl_array *device) {
-    // noop
+    struct screenshot *sshot = data;
+
+    new_constraints(sshot);
+    if (device->size != sizeof(dev_t)) {
+        WARN("dmabuf_device: unexpected dev_t size %zu", device->size);
+        return;
+    }
+    memcpy(&sshot->dmabuf_device, device->data, sizeof(dev_t));
+    DEBUG("session_dmabuf_device: %u:%u",
+          major(sshot->dmabuf_device), minor(sshot->dmabuf_device));
 }
 
 static void session_dmabuf_format_handler(void *data,
                                           struct ext_image_copy_capture_session_v1 *_,
                                           uint32_t format,
                                           struct wl_array *modifiers) {
-    // noop
+    struct screenshot *sshot = data;
+
+    new_constraints(sshot);
+    uint64_t *modifier;
+    wl_array_for_each(modifier, modifiers) {
+        struct dmabuf_format *f = wl_array_add(&sshot->dmabuf_formats, sizeof(*f));
+        if (f == NULL) {
+            DIE("wl_array_add() failed");
+        }
+        f->format = format;
+        f->modifier = *modifier;
+    }
+    DEBUG("session_dmabuf_format: 0x%08" PRIx32 " with %zu modifiers",
+          format, modifiers->size / sizeof(uint64_t));
 }
 
-static void session_done_handler(void *data, struct ext_image_copy_capture_session_v1 *session) {
-    struct screenshot *sshot = data;
+static void capture_frame(struct screenshot *sshot) {
     struct ext_image_copy_capture_frame_v1 *frame =
-        ext_image_copy_capture_session_v1_create_frame(session);
+        ext_image_copy_capture_session_v1_create_frame(sshot->session);
     ext_image_copy_capture_frame_v1_add_listener(frame, &image_copy_frame_listener, sshot);
 
+    ext_image_copy_capture_frame_v1_attach_buffer(frame, sshot->buffer->wl_buffer);
+    ext_image_copy_capture_frame_v1_capture(frame);
+    sshot->frame = frame;
+}
+
+static void create_shm_buffer(struct screenshot *sshot) {
     uint32_t format = sshot->format;
     uint32_t width = sshot->session_width;
     uint32_t height = sshot->session_height;
     uint32_t stride = width * get_bytes_per_pixel(format);
 
-    create_buffer(&sshot->buffer, format, width, height, stride);
-    ext_image_copy_capture_frame_v1_attach_buffer(frame, sshot->buffer.wl_buffer);
-    ext_image_copy_capture_frame_v1_capture(frame);
+    sshot->buffer = get_capture_buffer(sshot->output, format, width, height, stride);
+}
+
+static void dmabuf_buffer_done(struct buffer *buffer, bool success, void *data) {
+    struct screenshot *sshot = data;
+
+    sshot->dmabuf_pending = false;
+    if (!success) {
+        WARN("falling back to shm for %s", sshot->output->name);
+        sshot->dmabuf_failed = true;
+        buffer_cache_drop(sshot->buffer);
+        create_shm_buffer(sshot);
+    }
+    capture_frame(sshot);
+}
+
+/* udmabuf memory is plain linear memory, so only linear modifier can be used */
+static bool try_dmabuf_buffer(struct screenshot *sshot) {
+    uint32_t drm_format = drm_format_from_shm(sshot->format);
+
+    bool supported = false;
+    struct dmabuf_format *f;
+    wl_array_for_each(f, &sshot->dmabuf_formats) {
+        if (f->format == drm_format && f->modifier == 0) {
+            supported = true;
+            break;
+        }
+    }
+    if (!supported) {
+        DEBUG("compositor can't capture 0x%08" PRIx32 " into linear dmabuf", drm_format);
+        return false;
+    }
+
+    uint32_t width = sshot->session_width;
+    uint32_t height = sshot->session_height;
+    uint32_t stride = width * get_bytes_per_pixel(sshot->format);
+
+    sshot->buffer = buffer_cache_find(sshot->output, true, sshot->format, width, height, stride);
+    if (sshot->buffer != NULL) {
+        /* already imported by compositor */
+        capture_frame(sshot);
+        return true;
+    }
+
+    sshot->buffer = buffer_cache_new(sshot->output, true, sshot->format, width, height, stride);
+    if (!create_dmabuf_buffer(sshot->buffer, drm_format, width, height, stride,
+                              dmabuf_buffer_done, sshot)) {
+        buffer_cache_drop(sshot->buffer);
+        sshot->buffer = NULL;
+        return false;
+    }
+    sshot->dmabuf_pending = true;
+    return true;
+}
+
+static void begin_capture(struct screenshot *sshot) {
+    /* if compositor accepts dmabuf capture continues in dmabuf_buffer_done */
+    if (config.dmabuf && !config.export_frames && !sshot->dmabuf_failed
+            && try_dmabuf_buffer(sshot)) {
+        return;
+    }
+
+    create_shm_buffer(sshot);
+    capture_frame(sshot);
+}
+
+static void session_done_handler(void *data, struct ext_image_copy_capture_session_v1 *session) {
+    struct screenshot *sshot = data;
+
+    sshot->constraints_done = true;
+    /* done is sent again if constraints change, but capture is already under way by then */
+    if (sshot->buffer != NULL || sshot->retry_timer != NULL
+            || sshot->state != SCREENSHOT_CAPTURING) {
+        return;
+    }
+    begin_capture(sshot);
 }
 
 static void session_stopped_handler(void *data, struct ext_image_copy_capture_session_v1 *session) {
-    DIE("capture session stopped");
+    struct screenshot *sshot = data;
+
+    if (sshot->state != SCREENSHOT_CAPTURING) {
+        /* nothing to lose yet, next refresh starts a new session */
+        DEBUG("capture session of %s stopped", sshot->output->name);
+        destroy_session(sshot);
+    } else if (can_retry(sshot, "session stopped")) {
+        abort_capture(sshot);
+        destroy_session(sshot);
+        schedule_retry(sshot);
+    }
 }
 
 static const struct ext_image_copy_capture_session_v1_listener session_listener = {
@@ -174,55 +470,159 @@ static const struct ext_image_copy_capture_session_v1_listener session_listener
     .stopped = session_stopped_handler,
 };
 
-struct screenshot *take_screenshot(struct output *output) {
-    struct screenshot *screenshot = xcalloc(1, sizeof(*screenshot));
-    screenshot->output = output;
+static void capture_output(struct screenshot *screenshot) {
+    struct zwlr_screencopy_frame_v1 *frame;
+    if (screenshot->region_only) {
+        struct rect *r = &screenshot->region;
+        frame = zwlr_screencopy_manager_v1_capture_output_region(wayland.screencopy_manager,
+                                                                 config.cursor,
+                                                                 screenshot->output->wl_output,
+                                                                 r->x, r->y, r->w, r->h);
+    } else {
+        frame = zwlr_screencopy_manager_v1_capture_output(wayland.screencopy_manager,
+                                                          config.cursor,
+                                                          screenshot->output->wl_output);
+    }
+    zwlr_screencopy_frame_v1_add_listener(frame, &screencopy_frame_listener, screenshot);
+    screenshot->screencopy_frame = frame;
+}
+
+static void create_session(struct screenshot *screenshot) {
+    /* ext capture sources are whole outputs, region is cropped by overlay viewport */
+    struct ext_image_capture_source_v1 *source =
+        ext_output_image_capture_source_manager_v1_create_source(
+            wayland.output_image_capture_source_manager,
+            screenshot->output->wl_output
+        );
+
+    uint32_t options = 0;
+    if (config.cursor) {
+        options |= EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS;
+    };
+
+    screenshot->session =
+        ext_image_copy_capture_manager_v1_create_session(wayland.image_copy_capture_manager,
+                                                         source, options);
+    ext_image_copy_capture_session_v1_add_listener(screenshot->session,
+                                                   &session_listener,
+                                                   screenshot);
+    screenshot->constraints_done = false;
+
+    ext_image_capture_source_v1_destroy(source);
+    DEBUG("destroyed source");
+}
 
+/* with a fresh session capture starts once constraints are done */
+static void start_capture(struct screenshot *screenshot) {
     if (wayland.screencopy_manager) {
-        struct zwlr_screencopy_frame_v1 *frame =
-            zwlr_screencopy_manager_v1_capture_output(wayland.screencopy_manager,
-                                                      config.cursor,
-                                                      screenshot->output->wl_output);
-        zwlr_screencopy_frame_v1_add_listener(frame, &screencopy_frame_listener, screenshot);
+        capture_output(screenshot);
+    } else if (screenshot->session == NULL) {
+        create_session(screenshot);
     } else {
-        struct ext_image_capture_source_v1 *source =
-            ext_output_image_capture_source_manager_v1_create_source(
-                wayland.output_image_capture_source_manager,
-                screenshot->output->wl_output
-            );
+        begin_capture(screenshot);
+    }
+}
+
+struct screenshot *take_screenshot(struct output *output, const struct rect *region,
+                                   screenshot_ready_func on_ready, void *data) {
+    struct screenshot *screenshot = xcalloc(1, sizeof(*screenshot));
+    screenshot->output = output;
+    screenshot->region = *region;
+    screenshot->on_ready = on_ready;
+    screenshot->on_ready_data = data;
+    screenshot->capture_start = timing_now();
+    wl_array_init(&screenshot->dmabuf_formats);
+    wl_array_init(&screenshot->damage_hint);
+    wl_array_init(&screenshot->damage);
+
+    screenshot->region_only = wayland.screencopy_manager != NULL
+                              && !output_region_is_whole(output, region);
+    start_capture(screenshot);
 
-        uint32_t options = 0;
-        if (config.cursor) {
-            options |= EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS;
-        };
+    return screenshot;
+}
 
-        screenshot->session =
-            ext_image_copy_capture_manager_v1_create_session(wayland.image_copy_capture_manager,
-                                                             source, options);
-        ext_image_copy_capture_session_v1_add_listener(screenshot->session,
-                                                       &session_listener,
-                                                       screenshot);
+static bool screenshots_settled(struct wl_list *screenshots) {
+    struct screenshot *screenshot;
+    wl_list_for_each(screenshot, screenshots, link) {
+        if (screenshot->state == SCREENSHOT_CAPTURING) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        ext_image_capture_source_v1_destroy(source);
-        DEBUG("destroyed source");
+struct capture_deadline {
+    struct wl_list *screenshots;
+    bool expired;
+};
+
+static void capture_deadline_expired(void *data) {
+    struct capture_deadline *deadline = data;
+
+    deadline->expired = true;
+    struct screenshot *screenshot;
+    wl_list_for_each(screenshot, deadline->screenshots, link) {
+        if (screenshot->state == SCREENSHOT_CAPTURING) {
+            screenshot_failed(screenshot, "timed out");
+        }
     }
+}
 
-    wl_display_roundtrip(wayland.display);
-    wl_display_dispatch(wayland.display);
-    if (!screenshot->ready) {
-        DIE("screenshot not ready after roundrip and dispatch (wtf)");
+void wait_for_screenshots(struct wl_list *screenshots) {
+    struct capture_deadline deadline = { .screenshots = screenshots };
+    struct timer *timer = timer_add(timing_now() + config.capture_timeout_ms * 1000000,
+                                    capture_deadline_expired, &deadline);
+
+    /* all capture requests are already queued, frames for every output arrive in one loop */
+    while (!screenshots_settled(screenshots)) {
+        wayland_dispatch_timed();
+    }
+    if (!deadline.expired) {
+        timer_cancel(timer);
     }
 
-    DEBUG("captured sshot of %s (logical %ix%i) size %ix%i stride %i",
-          screenshot->output->name,
-          screenshot->output->logical_geometry.w, screenshot->output->logical_geometry.h,
-          screenshot->buffer.width, screenshot->buffer.height, screenshot->buffer.stride);
+    struct screenshot *screenshot;
+    wl_list_for_each(screenshot, screenshots, link) {
+        if (screenshot->state != SCREENSHOT_READY) {
+            continue;
+        }
+        DEBUG("captured sshot of %s (logical %ix%i) size %ix%i stride %i",
+              screenshot->output->name,
+              screenshot->output->logical_geometry.w, screenshot->output->logical_geometry.h,
+              screenshot->buffer->width, screenshot->buffer->height, screenshot->buffer->stride);
+    }
+}
 
-    return screenshot;
+void refresh_screenshot(struct screenshot *screenshot) {
+    if (screenshot->prev_buffer != NULL) {
+        buffer_cache_release(screenshot->prev_buffer);
+    }
+    /* prev_buffer stays in use, so the new frame is captured into another buffer */
+    screenshot->prev_buffer = screenshot->buffer;
+    screenshot->buffer = NULL;
+
+    screenshot->state = SCREENSHOT_CAPTURING;
+    screenshot->failures = 0;
+    screenshot->presented = 0;
+    screenshot->damage_hint.size = 0;
+    screenshot->damage.size = 0;
+    screenshot->capture_start = timing_now();
+
+    start_capture(screenshot);
 }
 
 void screenshot_cleanup(struct screenshot *screenshot) {
-    destroy_buffer(&screenshot->buffer);
+    abort_capture(screenshot);
+    if (screenshot->session) {
+        ext_image_copy_capture_session_v1_destroy(screenshot->session);
+    }
+    if (screenshot->prev_buffer) {
+        buffer_cache_release(screenshot->prev_buffer);
+    }
+    wl_array_release(&screenshot->dmabuf_formats);
+    wl_array_release(&screenshot->damage_hint);
+    wl_array_release(&screenshot->damage);
     wl_list_remove(&screenshot->link);
     free(screenshot);
 }
@@ -3,25 +3,85 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include <wayland-client.h>
 
 #include "wayland.h"
+#include "damage.h"
+
+struct screenshot;
+
+enum screenshot_state {
+    SCREENSHOT_CAPTURING,
+    SCREENSHOT_READY,
+    /* retries ran out or deadline passed, output is left unfrozen */
+    SCREENSHOT_FAILED,
+};
+
+typedef void (*screenshot_ready_func)(struct screenshot *screenshot, void *data);
 
 struct screenshot {
-    struct buffer buffer;
+    struct buffer *buffer; /* owned by buffer cache */
+    /* previous capture, kept after refresh_screenshot() to find what changed */
+    struct buffer *prev_buffer;
     struct output *output;
+    /* part of output that's frozen, relative to output in logical coordinates */
+    struct rect region;
+    /* buffer holds just the region, otherwise it holds whole output and region is cut out */
+    bool region_only;
+
+    screenshot_ready_func on_ready;
+    void *on_ready_data;
 
     uint32_t flags;
     enum wl_shm_format format;
-    bool ready;
+    enum screenshot_state state;
+    /* failed attempts at the current capture */
+    unsigned int failures;
+
+    /* whatever is in flight, so it can be dropped on failure or deadline */
+    struct zwlr_screencopy_frame_v1 *screencopy_frame;
+    struct ext_image_copy_capture_frame_v1 *frame;
+    bool dmabuf_pending;
+    struct timer *retry_timer;
+
+    /* CLOCK_MONOTONIC ns, presented is 0 if compositor didn't tell us */
+    uint64_t capture_start, presented;
 
     struct ext_image_copy_capture_session_v1 *session;
+    /* constraints below are complete, next constraint event starts a new batch */
+    bool constraints_done;
     uint32_t session_width, session_height;
+    dev_t dmabuf_device;
+    struct wl_array dmabuf_formats; /* struct dmabuf_format */
+    /* compositor couldn't import or fill a dmabuf, later captures go to shm */
+    bool dmabuf_failed;
+
+    /* struct rect, damage reported by compositor and what actually differs from prev_buffer */
+    struct wl_array damage_hint;
+    struct wl_array damage;
 
     struct wl_list link;
 };
 
-struct screenshot *take_screenshot(struct output *output);
+/*
+ * Sends capture request for region of output, frame is received later by wait_for_screenshots().
+ * on_ready (can be NULL) is called with data as soon as the frame is ready. Transient failures
+ * are retried a few times before the screenshot is marked as failed.
+ */
+struct screenshot *take_screenshot(struct output *output, const struct rect *region,
+                                   screenshot_ready_func on_ready, void *data);
+/*
+ * Dispatches wayland events until every screenshot in the list is ready or failed. Captures
+ * that take longer than config.capture_timeout_ms fail, so one stuck output can't hold up others.
+ */
+void wait_for_screenshots(struct wl_list *screenshots);
+/*
+ * Captures output again into another buffer, keeping the ext capture session alive.
+ * Once ready, damage holds regions that changed since the previous capture. If capture
+ * fails the previous frame is made current again and reported as ready with no damage.
+ */
+void refresh_screenshot(struct screenshot *screenshot);
 void screenshot_cleanup(struct screenshot *screenshot);
 
 #endif /* #ifndef SCREENSHOT_H */
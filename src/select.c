@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/input-event-codes.h>
+#include <wayland-client.h>
+
+#include "wlr-layer-shell-unstable-v1.h"
+#include "viewporter.h"
+#include "cursor-shape-v1.h"
+
+#include "common.h"
+#include "select.h"
+#include "overlay.h"
+#include "wayland.h"
+#include "buffer_cache.h"
+#include "xmalloc.h"
+
+/* premultiplied ARGB8888, light tint over selected area */
+#define SELECTION_COLOR 0x40404040
+
+/*
+ * Selection is a subsurface stretching a single pixel, so following the pointer only
+ * damages the area it covers instead of redrawing the frozen screen underneath.
+ */
+struct selection_view {
+    struct overlay *overlay;
+    /* overlay position and size in global logical coordinates */
+    struct rect area;
+
+    struct wl_surface *wl_surface;
+    struct wl_subsurface *subsurface;
+    struct wp_viewport *viewport;
+    struct buffer *buffer;
+    bool visible;
+};
+
+struct selector {
+    struct selection_view *views;
+    size_t n_views;
+
+    struct wl_pointer *pointer;
+    struct wl_keyboard *keyboard;
+    struct wp_cursor_shape_device_v1 *cursor_shape;
+
+    /* view pointer is over and pointer position in global logical coordinates */
+    struct selection_view *focus;
+    int32_t x, y;
+    /* pointer position is clamped to box around all overlays */
+    int32_t min_x, min_y, max_x, max_y;
+
+    bool dragging;
+    int32_t start_x, start_y;
+
+    bool done, cancelled;
+    struct rect selection;
+};
+
+static void get_selection(struct selector *selector, struct rect *rect) {
+    rect->x = selector->start_x < selector->x ? selector->start_x : selector->x;
+    rect->y = selector->start_y < selector->y ? selector->start_y : selector->y;
+    rect->w = abs(selector->x - selector->start_x);
+    rect->h = abs(selector->y - selector->start_y);
+}
+
+static void view_hide(struct selection_view *view) {
+    if (!view->visible) {
+        return;
+    }
+    wl_surface_attach(view->wl_surface, NULL, 0, 0);
+    wl_surface_commit(view->wl_surface);
+    view->visible = false;
+}
+
+static void update_views(struct selector *selector) {
+    struct rect selection;
+    get_selection(selector, &selection);
+
+    for (size_t i = 0; i < selector->n_views; i++) {
+        struct selection_view *view = &selector->views[i];
+        struct rect part;
+
+        if (!rect_intersect(&selection, &view->area, &part)) {
+            view_hide(view);
+            continue;
+        }
+
+        if (!view->visible) {
+            attach_buffer(view->wl_surface, view->buffer);
+            wl_surface_damage_buffer(view->wl_surface, 0, 0, 1, 1);
+            view->visible = true;
+        }
+        wp_viewport_set_destination(view->viewport, part.w, part.h);
+        wl_surface_commit(view->wl_surface);
+
+        /* position is parent state, committing parent without new buffer repaints nothing */
+        wl_subsurface_set_position(view->subsurface, part.x - view->area.x, part.y - view->area.y);
+        wl_surface_commit(view->overlay->wl_surface);
+    }
+}
+
+static struct selection_view *find_view(struct selector *selector, struct wl_surface *surface) {
+    for (size_t i = 0; i < selector->n_views; i++) {
+        if (selector->views[i].overlay->wl_surface == surface) {
+            return &selector->views[i];
+        }
+    }
+    return NULL;
+}
+
+static void update_position(struct selector *selector, wl_fixed_t surface_x, wl_fixed_t surface_y) {
+    if (selector->focus == NULL) {
+        return;
+    }
+    int32_t x = selector->focus->area.x + wl_fixed_to_int(surface_x);
+    int32_t y = selector->focus->area.y + wl_fixed_to_int(surface_y);
+    selector->x = x < selector->min_x ? selector->min_x : x > selector->max_x ? selector->max_x : x;
+    selector->y = y < selector->min_y ? selector->min_y : y > selector->max_y ? selector->max_y : y;
+}
+
+static void pointer_enter(void *data, struct wl_pointer *pointer, uint32_t serial,
+                          struct wl_surface *surface, wl_fixed_t surface_x, wl_fixed_t surface_y) {
+    struct selector *selector = data;
+
+    selector->focus = find_view(selector, surface);
+    update_position(selector, surface_x, surface_y);
+
+    if (selector->cursor_shape != NULL) {
+        wp_cursor_shape_device_v1_set_shape(selector->cursor_shape, serial,
+                                            WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_CROSSHAIR);
+    }
+}
+
+static void pointer_leave(void *data, struct wl_pointer *pointer, uint32_t serial,
+                          struct wl_surface *surface) {
+    struct selector *selector = data;
+
+    selector->focus = NULL;
+}
+
+static void pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time,
+                           wl_fixed_t surface_x, wl_fixed_t surface_y) {
+    struct selector *selector = data;
+
+    update_position(selector, surface_x, surface_y);
+    /* otherwise redrawn once per frame event */
+    if (selector->dragging && wl_pointer_get_version(pointer) < 5) {
+        update_views(selector);
+    }
+}
+
+static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial,
+                           uint32_t time, uint32_t button, uint32_t state) {
+    struct selector *selector = data;
+    bool pressed = state == WL_POINTER_BUTTON_STATE_PRESSED;
+
+    if (button == BTN_RIGHT && pressed) {
+        selector->cancelled = true;
+        selector->done = true;
+    } else if (button == BTN_LEFT && pressed && selector->focus != NULL) {
+        selector->dragging = true;
+        selector->start_x = selector->x;
+        selector->start_y = selector->y;
+    } else if (button == BTN_LEFT && !pressed && selector->dragging) {
+        selector->dragging = false;
+        get_selection(selector, &selector->selection);
+        if (selector->selection.w == 0 && selector->selection.h == 0 && selector->focus != NULL) {
+            selector->selection = selector->focus->area;
+        } else if (selector->selection.w == 0 || selector->selection.h == 0) {
+            /* nothing to select, let user try again */
+            return;
+        }
+        selector->done = true;
+    }
+}
+
+static void pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time,
+                         uint32_t axis, wl_fixed_t value) {
+    // no-op
+}
+
+static void pointer_frame(void *data, struct wl_pointer *pointer) {
+    struct selector *selector = data;
+
+    if (selector->dragging) {
+        update_views(selector);
+    }
+}
+
+static void pointer_axis_source(void *data, struct wl_pointer *pointer, uint32_t axis_source) {
+    // no-op
+}
+
+static void pointer_axis_stop(void *data, struct wl_pointer *pointer, uint32_t time,
+                              uint32_t axis) {
+    // no-op
+}
+
+static void pointer_axis_discrete(void *data, struct wl_pointer *pointer, uint32_t axis,
+                                  int32_t discrete) {
+    // no-op
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+    .enter = pointer_enter,
+    .leave = pointer_leave,
+    .motion = pointer_motion,
+    .button = pointer_button,
+    .axis = pointer_axis,
+    .frame = pointer_frame,
+    .axis_source = pointer_axis_source,
+    .axis_stop = pointer_axis_stop,
+    .axis_discrete = pointer_axis_discrete,
+};
+
+static void keyboard_keymap(void *data, struct wl_keyboard *keyboard, uint32_t format,
+                            int32_t fd, uint32_t size) {
+    /* only escape is handled, and evdev keycode is enough for that */
+    close(fd);
+}
+
+static void keyboard_enter(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+                           struct wl_surface *surface, struct wl_array *keys) {
+    // no-op
+}
+
+static void keyboard_leave(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+                           struct wl_surface *surface) {
+    // no-op
+}
+
+static void keyboard_key(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+                         uint32_t time, uint32_t key, uint32_t state) {
+    struct selector *selector = data;
+
+    if (key == KEY_ESC && state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+        selector->cancelled = true;
+        selector->done = true;
+    }
+}
+
+static void keyboard_modifiers(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+                               uint32_t mods_depressed, uint32_t mods_latched,
+                               uint32_t mods_locked, uint32_t group) {
+    // no-op
+}
+
+static void keyboard_repeat_info(void *data, struct wl_keyboard *keyboard,
+                                 int32_t rate, int32_t delay) {
+    // no-op
+}
+
+static const struct wl_keyboard_listener keyboard_listener = {
+    .keymap = keyboard_keymap,
+    .enter = keyboard_enter,
+    .leave = keyboard_leave,
+    .key = keyboard_key,
+    .modifiers = keyboard_modifiers,
+    .repeat_info = keyboard_repeat_info,
+};
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+    int *pending = data;
+
+    (*pending)--;
+    wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done,
+};
+
+static void view_init(struct selection_view *view, struct overlay *overlay) {
+    view->overlay = overlay;
+    view->area = (struct rect){
+        .x = overlay->output->logical_geometry.x + overlay->region.x,
+        .y = overlay->output->logical_geometry.y + overlay->region.y,
+        .w = overlay->region.w,
+        .h = overlay->region.h,
+    };
+
+    view->wl_surface = wl_compositor_create_surface(wayland.compositor);
+    if (view->wl_surface == NULL) {
+        DIE("couldn't create a wl_surface");
+    }
+    view->subsurface = wl_subcompositor_get_subsurface(wayland.subcompositor,
+                                                       view->wl_surface, overlay->wl_surface);
+    if (view->subsurface == NULL) {
+        DIE("couldn't create a wl_subsurface");
+    }
+    /* commits on selection shouldn't wait for overlay */
+    wl_subsurface_set_desync(view->subsurface);
+
+    view->viewport = wp_viewporter_get_viewport(wayland.viewporter, view->wl_surface);
+    if (view->viewport == NULL) {
+        DIE("could not create viewport");
+    }
+
+    /* pointer has to stay on overlay surface, or its coordinates would be relative to this */
+    struct wl_region *empty = wl_compositor_create_region(wayland.compositor);
+    wl_surface_set_input_region(view->wl_surface, empty);
+    wl_region_destroy(empty);
+
+    view->buffer = get_shm_buffer(overlay->output, WL_SHM_FORMAT_ARGB8888, 1, 1, 4);
+    *(uint32_t *)view->buffer->data = SELECTION_COLOR;
+
+    /* escape has to reach us, pointer input doesn't need this */
+    zwlr_layer_surface_v1_set_keyboard_interactivity(overlay->layer_surface, 1);
+    wl_surface_commit(overlay->wl_surface);
+}
+
+/* pending is decremented once overlay is drawn without the selection */
+static void view_finish(struct selection_view *view, int *pending) {
+    view_hide(view);
+    wp_viewport_destroy(view->viewport);
+    wl_subsurface_destroy(view->subsurface);
+    wl_surface_destroy(view->wl_surface);
+    buffer_cache_release(view->buffer);
+
+    struct wl_callback *callback = wl_surface_frame(view->overlay->wl_surface);
+    wl_callback_add_listener(callback, &frame_listener, pending);
+    (*pending)++;
+
+    zwlr_layer_surface_v1_set_keyboard_interactivity(view->overlay->layer_surface, 0);
+    wl_surface_commit(view->overlay->wl_surface);
+}
+
+bool select_region(struct wl_list *overlays, const bool *stop, struct rect *selection) {
+    struct selector selector = {0};
+
+    if (!(wayland.seat_capabilities & WL_SEAT_CAPABILITY_POINTER)) {
+        WARN("seat has no pointer, can't select region");
+        return false;
+    }
+
+    selector.n_views = wl_list_length(overlays);
+    selector.views = xcalloc(selector.n_views, sizeof(*selector.views));
+    selector.min_x = selector.min_y = INT32_MAX;
+    selector.max_x = selector.max_y = INT32_MIN;
+    struct overlay *overlay;
+    size_t i = 0;
+    wl_list_for_each(overlay, overlays, link) {
+        struct selection_view *view = &selector.views[i++];
+        view_init(view, overlay);
+
+        struct rect *a = &view->area;
+        selector.min_x = a->x < selector.min_x ? a->x : selector.min_x;
+        selector.min_y = a->y < selector.min_y ? a->y : selector.min_y;
+        selector.max_x = a->x + a->w > selector.max_x ? a->x + a->w : selector.max_x;
+        selector.max_y = a->y + a->h > selector.max_y ? a->y + a->h : selector.max_y;
+    }
+
+    selector.pointer = wl_seat_get_pointer(wayland.seat);
+    wl_pointer_add_listener(selector.pointer, &pointer_listener, &selector);
+    if (wayland.cursor_shape_manager != NULL) {
+        selector.cursor_shape = wp_cursor_shape_manager_v1_get_pointer(wayland.cursor_shape_manager,
+                                                                       selector.pointer);
+    }
+    if (wayland.seat_capabilities & WL_SEAT_CAPABILITY_KEYBOARD) {
+        selector.keyboard = wl_seat_get_keyboard(wayland.seat);
+        wl_keyboard_add_listener(selector.keyboard, &keyboard_listener, &selector);
+    }
+
+    while (!selector.done && !*stop) {
+        wayland_dispatch_timed();
+    }
+
+    if (selector.cursor_shape != NULL) {
+        wp_cursor_shape_device_v1_destroy(selector.cursor_shape);
+    }
+    /* release request needs seat version 3 */
+    if (wl_pointer_get_version(selector.pointer) >= 3) {
+        wl_pointer_release(selector.pointer);
+    } else {
+        wl_pointer_destroy(selector.pointer);
+    }
+    if (selector.keyboard != NULL && wl_keyboard_get_version(selector.keyboard) >= 3) {
+        wl_keyboard_release(selector.keyboard);
+    } else if (selector.keyboard != NULL) {
+        wl_keyboard_destroy(selector.keyboard);
+    }
+    /* child might capture the screen right away, so tint has to be gone by then */
+    int pending = 0;
+    for (i = 0; i < selector.n_views; i++) {
+        view_finish(&selector.views[i], &pending);
+    }
+    free(selector.views);
+    while (pending > 0) {
+        wayland_dispatch_timed();
+    }
+
+    if (!selector.done) {
+        DEBUG("timed out while selecting region");
+        return false;
+    }
+    if (selector.cancelled) {
+        return false;
+    }
+    *selection = selector.selection;
+    DEBUG("selected %d,%d %dx%d", selection->x, selection->y, selection->w, selection->h);
+    return true;
+}
@@ -0,0 +1,17 @@
+#ifndef SELECT_H
+#define SELECT_H
+
+#include <stdbool.h>
+#include <wayland-util.h>
+
+#include "damage.h"
+
+/*
+ * Lets user drag a rectangle over overlays in the list and stores it in selection in global
+ * logical coordinates. Clicking without dragging selects the frozen part of that output.
+ * Returns false if user cancelled with Escape or right button, or once *stop is set by a
+ * timer (see timer.h).
+ */
+bool select_region(struct wl_list *overlays, const bool *stop, struct rect *selection);
+
+#endif /* #ifndef SELECT_H */
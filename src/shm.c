@@ -5,48 +5,395 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <wayland-client.h>
 
 #include "shm.h"
 #include "common.h"
 #include "wayland.h"
+#include "config.h"
+
+/* page aligned offsets so that every buffer starts on its own page */
+#define SHM_ALIGNMENT 4096
+
+/* used when Hugepagesize can't be read from /proc/meminfo */
+#define DEFAULT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+static struct {
+    int fd;
+    struct wl_shm_pool *wl_pool;
+    uint8_t *data;
+    size_t size;
+    /* wl_shm_pool can't shrink, compositor keeps mapping this much even if pool is smaller */
+    size_t wl_size;
+    struct wl_list buffers; /* struct buffer::pool_link, sorted by offset */
+
+    enum shm_backing backing;
+    size_t granularity; /* pool size is always a multiple of this */
+} pool = {
+    .fd = -1,
+    .granularity = SHM_ALIGNMENT,
+};
+
+static const char *backing_str(enum shm_backing backing) {
+    switch (backing) {
+    case SHM_BACKING_HUGETLB:
+        return "hugetlb";
+    case SHM_BACKING_THP:
+        return "transparent huge pages";
+    case SHM_BACKING_DEFAULT:
+    default:
+        return "regular pages";
+    }
+}
+
+static size_t get_huge_page_size(void) {
+    size_t size = DEFAULT_HUGE_PAGE_SIZE;
+
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL) {
+        return size;
+    }
+
+    char line[128];
+    unsigned long kb;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+            size = kb * 1024;
+            break;
+        }
+    }
+    fclose(f);
+
+    return size;
+}
+
+/* shmem only gets THP if shmem_enabled allows it, madvise() succeeds either way */
+static void check_shmem_thp(void) {
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (f == NULL) {
+        DEBUG("shm pool: THP for shmem is not supported by kernel");
+        return;
+    }
+
+    char line[128] = {0};
+    if (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        DEBUG("shm pool: shmem_enabled: %s", line);
+        if (strstr(line, "[never]") != NULL || strstr(line, "[deny]") != NULL) {
+            WARN("THP for shmem is disabled system-wide, regular pages will be used");
+        }
+    }
+    fclose(f);
+}
+
+static int create_memfd(enum shm_backing backing) {
+    int fd;
+
+    if (backing == SHM_BACKING_HUGETLB) {
+        fd = memfd_create("frzscr-wayland-shm", MFD_CLOEXEC | MFD_HUGETLB);
+        if (fd >= 0) {
+            pool.backing = SHM_BACKING_HUGETLB;
+            pool.granularity = get_huge_page_size();
+            return fd;
+        }
+        EWARN("failed to create hugetlb memfd, falling back to regular pages");
+    }
+
+    fd = memfd_create("frzscr-wayland-shm", MFD_CLOEXEC);
+    if (fd < 0) {
+        EDIE("failed to create memfd");
+    }
+
+    pool.backing = backing == SHM_BACKING_THP ? SHM_BACKING_THP : SHM_BACKING_DEFAULT;
+    pool.granularity = pool.backing == SHM_BACKING_THP ? get_huge_page_size() : SHM_ALIGNMENT;
+    if (pool.backing == SHM_BACKING_THP) {
+        check_shmem_thp();
+    }
+
+    return fd;
+}
+
+/* populates page tables so copies into the buffers don't take a fault every 4K */
+static void prefault(uint8_t *data, size_t size) {
+    if (madvise(data, size, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+
+    /* older than 5.14, touch every page ourselves */
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < size; i += page_size) {
+        ((volatile uint8_t *)data)[i] = 0;
+    }
+}
+
+static void shm_pool_grow(size_t requested) {
+    if (pool.fd < 0) {
+        wl_list_init(&pool.buffers);
+        pool.fd = create_memfd(config.shm_backing);
+    }
+
+    size_t size = ALIGN_UP(requested, pool.granularity);
+    if (size <= pool.size) {
+        return;
+    }
+    if (size > INT32_MAX) {
+        DIE("shm pool can't be bigger than %d bytes (requested %zu)", INT32_MAX, size);
+    }
+
+    /*
+     * shmem picks page size when a page is first faulted in, fallocate() or MAP_POPULATE
+     * would allocate regular pages before MADV_HUGEPAGE is set, so THP pool only gets
+     * resized here and is populated once mapped
+     */
+    bool thp = pool.backing == SHM_BACKING_THP;
+    int ret = 0;
+    if (thp) {
+        if (ftruncate(pool.fd, size) < 0) {
+            EDIE("ftruncate() failed");
+        }
+    } else {
+        ret = posix_fallocate(pool.fd, pool.size, size - pool.size);
+    }
+    if (ret != 0 && pool.backing == SHM_BACKING_HUGETLB && pool.size == 0) {
+        /* most likely not enough huge pages reserved, it's not too late to switch */
+        errno = ret;
+        EWARN("failed to allocate huge pages, falling back to regular pages");
+        close(pool.fd);
+        pool.fd = create_memfd(SHM_BACKING_DEFAULT);
+        size = ALIGN_UP(requested, pool.granularity);
+        ret = posix_fallocate(pool.fd, 0, size);
+    }
+    if (ret != 0) {
+        errno = ret;
+        EDIE("posix_fallocate() failed");
+    }
+
+    uint8_t *data = MAP_FAILED;
+    if (pool.data != NULL) {
+        data = mremap(pool.data, pool.size, size, MREMAP_MAYMOVE);
+    }
+    if (data == MAP_FAILED) {
+        /* first mapping, or kernel can't mremap hugetlb (before 6.1) */
+        int flags = MAP_SHARED | (config.shm_prefault && !thp ? MAP_POPULATE : 0);
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, pool.fd, 0);
+        if (data == MAP_FAILED) {
+            EDIE("failed to map shm pool");
+        }
+        if (pool.data != NULL && munmap(pool.data, pool.size) < 0) {
+            EWARN("munmap() failed");
+        }
+    }
+
+    /* child is spawned without copying the pool, fork would copy its page tables otherwise */
+    if (madvise(data, size, MADV_DONTFORK) < 0) {
+        EWARN("madvise(MADV_DONTFORK) failed");
+    }
+    if (thp && madvise(data, size, MADV_HUGEPAGE) < 0) {
+        EWARN("madvise(MADV_HUGEPAGE) failed");
+    }
+    if (config.shm_prefault && (pool.size > 0 || thp)) {
+        /* MAP_POPULATE only covered the initial mapping, and isn't used with THP */
+        prefault(data + pool.size, size - pool.size);
+    }
+
+    if (data != pool.data) {
+        struct buffer *buffer;
+        wl_list_for_each(buffer, &pool.buffers, pool_link) {
+            buffer->data = data + buffer->offset;
+        }
+        pool.data = data;
+    }
+
+    if (pool.wl_pool == NULL) {
+        pool.wl_pool = wl_shm_create_pool(wayland.shm, pool.fd, size);
+        pool.wl_size = size;
+    } else if (size > pool.wl_size) {
+        wl_shm_pool_resize(pool.wl_pool, size);
+        pool.wl_size = size;
+    }
+
+    DEBUG("shm pool: resized from %zu to %zu bytes (%s%s)", pool.size, size,
+          backing_str(pool.backing), config.shm_prefault ? ", prefaulted" : "");
+    pool.size = size;
+}
+
+/*
+ * Gives memory past the last buffer back once it's free. Compositor's mapping stays as big as
+ * it was, but there are no buffers there for it to read, and growing again fills it back in.
+ */
+static void shm_pool_trim(void) {
+    size_t end = 0;
+    if (!wl_list_empty(&pool.buffers)) {
+        struct buffer *last = wl_container_of(pool.buffers.prev, last, pool_link);
+        end = last->offset + last->size;
+    }
+
+    /* mapping can't be empty, one unit of granularity stays */
+    size_t size = ALIGN_UP(end > 0 ? end : 1, pool.granularity);
+    if (size >= pool.size) {
+        return;
+    }
+
+    if (munmap(pool.data + size, pool.size - size) < 0) {
+        EWARN("munmap() failed");
+        return;
+    }
+    if (ftruncate(pool.fd, size) < 0) {
+        EWARN("ftruncate() failed");
+    }
+
+    DEBUG("shm pool: trimmed from %zu to %zu bytes", pool.size, size);
+    pool.size = size;
+}
+
+/* hole in the middle of pool doesn't need its memory until another buffer is put there */
+static void shm_pool_punch_hole(size_t offset, size_t size) {
+    size_t start = ALIGN_UP(offset, pool.granularity);
+    size_t end = (offset + size) / pool.granularity * pool.granularity;
+    if (start >= end) {
+        return;
+    }
+
+    if (fallocate(pool.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) < 0) {
+        EWARN("failed to free %zu bytes at offset %zu of shm pool", end - start, start);
+    }
+}
+
+void shm_pool_reserve(size_t size) {
+    shm_pool_grow(size);
+}
+
+void shm_pool_cleanup(void) {
+    if (pool.wl_pool) {
+        wl_shm_pool_destroy(pool.wl_pool);
+    }
+    if (pool.data && munmap(pool.data, pool.size) < 0) {
+        EWARN("munmap() failed");
+    }
+    if (pool.fd >= 0) {
+        close(pool.fd);
+    }
+
+    pool.fd = -1;
+    pool.wl_pool = NULL;
+    pool.data = NULL;
+    pool.size = 0;
+    pool.wl_size = 0;
+}
 
 int create_buffer(struct buffer *buffer, enum wl_shm_format format,
                   uint32_t width, uint32_t height, uint32_t stride) {
     buffer->height = height;
     buffer->width = width;
     buffer->stride = stride;
+    buffer->size = ALIGN_UP((size_t)stride * height, SHM_ALIGNMENT);
+    buffer->memfd = -1;
 
-    size_t size = stride * height;
+    if (pool.fd < 0) {
+        shm_pool_grow(buffer->size);
+    }
 
-    int fd = memfd_create("frzscr-wayland-shm", MFD_CLOEXEC);
-    if (fd < 0) {
-        EDIE("failed to crate memfd");
+    /* first fit: look for a hole between existing buffers, append at the end otherwise */
+    size_t offset = 0;
+    struct wl_list *insert_after = &pool.buffers;
+    struct buffer *other;
+    wl_list_for_each(other, &pool.buffers, pool_link) {
+        if (other->offset - offset >= buffer->size) {
+            break;
+        }
+        offset = other->offset + other->size;
+        insert_after = &other->pool_link;
     }
 
-    if (posix_fallocate(fd, 0, size) < 0) {
-        EDIE("posix_fallocate() failed");
-    };
+    if (offset + buffer->size > pool.size) {
+        /* grow a bit more than needed so that the next buffer probably fits too */
+        size_t size = pool.size + pool.size / 2;
+        shm_pool_grow(size > offset + buffer->size ? size : offset + buffer->size);
+    }
+
+    buffer->offset = offset;
+    buffer->data = pool.data + offset;
+    wl_list_insert(insert_after, &buffer->pool_link);
+
+    buffer->wl_buffer = wl_shm_pool_create_buffer(pool.wl_pool, offset,
+                                                  width, height, stride, format);
+
+    DEBUG("shm pool: allocated %zu bytes at offset %zu", buffer->size, buffer->offset);
+
+    return 0;
+}
+
+/*
+ * Pool memfd can't be sealed while its other buffers are still written to, so frames that
+ * are handed to child get their own. Compositor keeps its side of wl_shm_pool alive for as
+ * long as the buffer exists, so the pool is destroyed right away.
+ */
+int create_sealable_buffer(struct buffer *buffer, enum wl_shm_format format,
+                           uint32_t width, uint32_t height, uint32_t stride) {
+    buffer->height = height;
+    buffer->width = width;
+    buffer->stride = stride;
+    buffer->size = ALIGN_UP((size_t)stride * height, SHM_ALIGNMENT);
+    buffer->offset = 0;
 
-    buffer->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    buffer->memfd = memfd_create("frzscr-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (buffer->memfd < 0) {
+        EDIE("failed to create memfd");
+    }
+    if (ftruncate(buffer->memfd, buffer->size) < 0) {
+        EDIE("ftruncate() failed");
+    }
+
+    buffer->data = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->memfd, 0);
     if (buffer->data == MAP_FAILED) {
-        EDIE("mmap failed");
+        EDIE("failed to map memfd");
+    }
+    if (madvise(buffer->data, buffer->size, MADV_DONTFORK) < 0) {
+        EWARN("madvise(MADV_DONTFORK) failed");
+    }
+    if (config.shm_prefault) {
+        prefault(buffer->data, buffer->size);
     }
 
-    struct wl_shm_pool *pool = wl_shm_create_pool(wayland.shm, fd, size);
-    buffer->wl_buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, format);
+    struct wl_shm_pool *wl_pool = wl_shm_create_pool(wayland.shm, buffer->memfd, buffer->size);
+    buffer->wl_buffer = wl_shm_pool_create_buffer(wl_pool, 0, width, height, stride, format);
+    wl_shm_pool_destroy(wl_pool);
 
-    wl_shm_pool_destroy(pool);
-    close(fd);
+    DEBUG("shm: allocated %zu bytes in a memfd of their own", buffer->size);
 
     return 0;
 }
 
 void destroy_buffer(struct buffer *buffer) {
     wl_buffer_destroy(buffer->wl_buffer);
-    if (munmap(buffer->data, buffer->stride * buffer->height) < 0) {
-        EWARN("munmap() failed");
+    buffer->wl_buffer = NULL;
+
+    if (buffer->memfd >= 0) {
+        if (munmap(buffer->data, buffer->size) < 0) {
+            EWARN("munmap() failed");
+        }
+        close(buffer->memfd);
+        buffer->memfd = -1;
+        buffer->data = NULL;
+        return;
     }
+
+    bool last = buffer->pool_link.next == &pool.buffers;
+    wl_list_remove(&buffer->pool_link);
+    if (last) {
+        shm_pool_trim();
+    } else {
+        shm_pool_punch_hole(buffer->offset, buffer->size);
+    }
+
+    buffer->data = NULL;
 }
 
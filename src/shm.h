@@ -2,12 +2,24 @@
 #define SHM_H
 
 #include <wayland-client.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "wayland.h"
 
+/*
+ * All buffers are carved out of a single memfd that is mapped once and shared with
+ * compositor through a single wl_shm_pool. Pool grows on demand, but it's cheaper
+ * to reserve enough space up front.
+ */
+void shm_pool_reserve(size_t size);
+void shm_pool_cleanup(void);
+
 int create_buffer(struct buffer *buffer, enum wl_shm_format format,
                   uint32_t width, uint32_t height, uint32_t stride);
+/* buffer backed by a memfd of its own instead of shm pool, see buffer->memfd */
+int create_sealable_buffer(struct buffer *buffer, enum wl_shm_format format,
+                           uint32_t width, uint32_t height, uint32_t stride);
 
 void destroy_buffer(struct buffer *buffer);
 
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+#include "common.h"
+#include "config.h"
+#include "xmalloc.h"
+
+/* more than this is pointless, we are limited by memory bandwidth long before that */
+#define THREADPOOL_MAX_THREADS 32
+
+static struct {
+    bool started;
+    bool stopping;
+    unsigned int n_workers;
+    pthread_t *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+
+    /* current job, protected by lock */
+    uint64_t generation;
+    threadpool_task_func func;
+    void *data;
+    unsigned int n_tasks;
+    unsigned int next_task;
+    unsigned int finished_tasks;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* must be called with lock held, returns with lock held */
+static void do_tasks_locked(void) {
+    while (pool.next_task < pool.n_tasks) {
+        unsigned int task = pool.next_task++;
+
+        pthread_mutex_unlock(&pool.lock);
+        pool.func(pool.data, task);
+        pthread_mutex_lock(&pool.lock);
+
+        if (++pool.finished_tasks == pool.n_tasks) {
+            pthread_cond_broadcast(&pool.done_cond);
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    uint64_t seen_generation = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (!pool.stopping && pool.generation == seen_generation) {
+            pthread_cond_wait(&pool.work_cond, &pool.lock);
+        }
+        if (pool.stopping) {
+            break;
+        }
+        seen_generation = pool.generation;
+        do_tasks_locked();
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+unsigned int threadpool_size(void) {
+    unsigned int n = config.threads;
+    if (n == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        n = online > 0 ? online : 1;
+    }
+    if (n > THREADPOOL_MAX_THREADS) {
+        n = THREADPOOL_MAX_THREADS;
+    }
+    return n;
+}
+
+static void threadpool_start(void) {
+    pool.started = true;
+    pool.n_workers = threadpool_size() - 1;
+    pool.workers = xcalloc(pool.n_workers, sizeof(*pool.workers));
+
+    /* workers inherit signal mask, keep signals for signalfd on the main thread only */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (unsigned int i = 0; i < pool.n_workers; i++) {
+        int ret = pthread_create(&pool.workers[i], NULL, worker_main, NULL);
+        if (ret != 0) {
+            errno = ret;
+            EWARN("failed to create worker thread, continuing with %u", i);
+            pool.n_workers = i;
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    DEBUG("started %u worker threads", pool.n_workers);
+}
+
+void threadpool_run(threadpool_task_func func, void *data, unsigned int n_tasks) {
+    if (!pool.started) {
+        threadpool_start();
+    }
+
+    if (pool.n_workers == 0 || n_tasks <= 1) {
+        for (unsigned int i = 0; i < n_tasks; i++) {
+            func(data, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.func = func;
+    pool.data = data;
+    pool.n_tasks = n_tasks;
+    pool.next_task = 0;
+    pool.finished_tasks = 0;
+    pool.generation += 1;
+    pthread_cond_broadcast(&pool.work_cond);
+
+    do_tasks_locked();
+    while (pool.finished_tasks < pool.n_tasks) {
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void threadpool_cleanup(void) {
+    if (!pool.started) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (unsigned int i = 0; i < pool.n_workers; i++) {
+        pthread_join(pool.workers[i], NULL);
+    }
+    free(pool.workers);
+
+    pool.workers = NULL;
+    pool.n_workers = 0;
+    pool.started = false;
+    pool.stopping = false;
+}
+
@@ -0,0 +1,19 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+typedef void (*threadpool_task_func)(void *data, unsigned int task);
+
+/*
+ * Calls func(data, task) for every task in [0, n_tasks) spread across worker threads
+ * and returns when all of them are done. Calling thread takes tasks too. Worker threads
+ * are started on first use, config.threads controls how many.
+ */
+void threadpool_run(threadpool_task_func func, void *data, unsigned int n_tasks);
+
+/* number of threads that threadpool_run will use, including calling thread */
+unsigned int threadpool_size(void);
+
+void threadpool_cleanup(void);
+
+#endif /* #ifndef THREADPOOL_H */
+
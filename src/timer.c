@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <wayland-util.h>
+
+#include "timer.h"
+#include "timing.h"
+#include "common.h"
+#include "xmalloc.h"
+
+struct timer {
+    uint64_t deadline;
+    timer_func func;
+    void *data;
+    struct wl_list link;
+};
+
+static struct {
+    int fd;
+    /* struct timer sorted by deadline, timerfd is armed for the first one */
+    struct wl_list timers;
+} timers = { .fd = -1 };
+
+int timer_fd(void) {
+    if (timers.fd < 0) {
+        timers.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (timers.fd < 0) {
+            EDIE("failed to create timerfd");
+        }
+        wl_list_init(&timers.timers);
+    }
+    return timers.fd;
+}
+
+static void arm(void) {
+    struct itimerspec spec = {0};
+    if (!wl_list_empty(&timers.timers)) {
+        struct timer *first = wl_container_of(timers.timers.next, first, link);
+        /* zero would disarm timer, deadline that's already passed fires right away */
+        uint64_t deadline = first->deadline > 0 ? first->deadline : 1;
+        spec.it_value.tv_sec = deadline / 1000000000;
+        spec.it_value.tv_nsec = deadline % 1000000000;
+    }
+    if (timerfd_settime(timer_fd(), TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        EDIE("timerfd_settime() failed");
+    }
+}
+
+struct timer *timer_add(uint64_t deadline, timer_func func, void *data) {
+    timer_fd();
+
+    struct timer *timer = xmalloc(sizeof(*timer));
+    timer->deadline = deadline;
+    timer->func = func;
+    timer->data = data;
+
+    /* insert after last timer with earlier or same deadline */
+    struct wl_list *prev = &timers.timers;
+    struct timer *t;
+    wl_list_for_each(t, &timers.timers, link) {
+        if (t->deadline > deadline) {
+            break;
+        }
+        prev = &t->link;
+    }
+    wl_list_insert(prev, &timer->link);
+
+    if (timers.timers.next == &timer->link) {
+        arm();
+    }
+    return timer;
+}
+
+void timer_cancel(struct timer *timer) {
+    bool first = timers.timers.next == &timer->link;
+    wl_list_remove(&timer->link);
+    free(timer);
+    if (first) {
+        arm();
+    }
+}
+
+void timer_dispatch(void) {
+    uint64_t expirations;
+    if (read(timer_fd(), &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        EDIE("failed to read timerfd");
+    }
+
+    uint64_t now = timing_now();
+    while (!wl_list_empty(&timers.timers)) {
+        struct timer *timer = wl_container_of(timers.timers.next, timer, link);
+        if (timer->deadline > now) {
+            break;
+        }
+        /* func may add or cancel other timers */
+        wl_list_remove(&timer->link);
+        DEBUG("timer fired %.3f ms late", (now - timer->deadline) / 1e6);
+        timer->func(timer->data);
+        free(timer);
+    }
+    arm();
+}
+
+void timer_cleanup(void) {
+    if (timers.fd < 0) {
+        return;
+    }
+    struct timer *timer, *tmp;
+    wl_list_for_each_safe(timer, tmp, &timers.timers, link) {
+        wl_list_remove(&timer->link);
+        free(timer);
+    }
+    close(timers.fd);
+    timers.fd = -1;
+}
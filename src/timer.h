@@ -0,0 +1,25 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timed actions driven by a single timerfd that sits in the epoll loop next to the
+ * wayland and signal fds. Deadlines are CLOCK_MONOTONIC ns, the clock timing_now() uses.
+ */
+
+struct timer;
+
+typedef void (*timer_func)(void *data);
+
+/* fd to poll for EPOLLIN, created on first use */
+int timer_fd(void);
+/* calls func(data) once deadline has passed, timer is freed after that */
+struct timer *timer_add(uint64_t deadline, timer_func func, void *data);
+/* frees timer that hasn't fired yet */
+void timer_cancel(struct timer *timer);
+/* runs expired timers in deadline order, call when timer_fd() is readable */
+void timer_dispatch(void);
+void timer_cleanup(void);
+
+#endif /* #ifndef TIMER_H */
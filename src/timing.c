@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "timing.h"
+#include "common.h"
+#include "config.h"
+#include "xmalloc.h"
+
+struct timing_event {
+    const char *phase;
+    char *output;
+    uint64_t start, end;
+    size_t bytes;
+};
+
+static struct {
+    struct timing_event *events;
+    size_t n_events, capacity;
+} timing = {0};
+
+uint64_t timing_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(const char *phase, const char *output,
+                   uint64_t start, uint64_t end, size_t bytes) {
+    if (!log_enable_debug && config.trace_file == NULL) {
+        return;
+    }
+
+    if (timing.n_events == timing.capacity) {
+        timing.capacity = timing.capacity ? timing.capacity * 2 : 32;
+        timing.events = xrealloc(timing.events, timing.capacity * sizeof(*timing.events));
+    }
+
+    timing.events[timing.n_events++] = (struct timing_event){
+        .phase = phase,
+        .output = xstrdup(output),
+        .start = start,
+        .end = end,
+        .bytes = bytes,
+    };
+}
+
+void timing_record_span(const char *phase, const char *output, uint64_t start, uint64_t end) {
+    record(phase, output, start, end, 0);
+}
+
+void timing_record(const char *phase, const char *output, uint64_t start) {
+    record(phase, output, start, timing_now(), 0);
+}
+
+void timing_record_bytes(const char *phase, const char *output, uint64_t start, size_t bytes) {
+    record(phase, output, start, timing_now(), bytes);
+}
+
+static void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/* https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU */
+static void write_trace(const char *path) {
+    FILE *f = STREQ(path, "-") ? stdout : fopen(path, "w");
+    if (f == NULL) {
+        EWARN("failed to open %s for writing", path);
+        return;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+    for (size_t i = 0; i < timing.n_events; i++) {
+        const struct timing_event *e = &timing.events[i];
+
+        fprintf(f, "%s\n{\"name\":", i > 0 ? "," : "");
+        write_json_string(f, e->phase);
+        fprintf(f, ",\"cat\":\"frzscr\",\"ph\":\"X\",\"pid\":%d,\"tid\":1"
+                   ",\"ts\":%" PRIu64 ".%03" PRIu64 ",\"dur\":%" PRIu64 ".%03" PRIu64,
+                getpid(), e->start / 1000, e->start % 1000,
+                (e->end - e->start) / 1000, (e->end - e->start) % 1000);
+        if (e->output != NULL || e->bytes > 0) {
+            fputs(",\"args\":{", f);
+            if (e->output != NULL) {
+                fputs("\"output\":", f);
+                write_json_string(f, e->output);
+            }
+            if (e->bytes > 0) {
+                fprintf(f, "%s\"bytes\":%zu", e->output != NULL ? "," : "", e->bytes);
+            }
+            fputc('}', f);
+        }
+        fputc('}', f);
+    }
+    fputs("\n]}\n", f);
+
+    if (f == stdout) {
+        fflush(f);
+    } else if (fclose(f) != 0) {
+        EWARN("failed to write %s", path);
+    }
+}
+
+void timing_report(void) {
+    for (size_t i = 0; i < timing.n_events; i++) {
+        const struct timing_event *e = &timing.events[i];
+        uint64_t dur = e->end - e->start;
+
+        if (e->bytes > 0 && dur > 0) {
+            /* bytes per ns is GB/s */
+            DEBUG("timing: %-24s %-12s %10.3f ms %8.2f GB/s", e->phase,
+                  e->output ? e->output : "", dur / 1e6, (double)e->bytes / dur);
+        } else {
+            DEBUG("timing: %-24s %-12s %10.3f ms", e->phase, e->output ? e->output : "",
+                  dur / 1e6);
+        }
+    }
+
+    if (config.trace_file != NULL) {
+        write_trace(config.trace_file);
+    }
+}
+
+void timing_cleanup(void) {
+    for (size_t i = 0; i < timing.n_events; i++) {
+        free(timing.events[i].output);
+    }
+    free(timing.events);
+    timing.events = NULL;
+    timing.n_events = timing.capacity = 0;
+}
+
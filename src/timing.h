@@ -0,0 +1,22 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CLOCK_MONOTONIC in nanoseconds, same clock compositors use for presentation timestamps */
+uint64_t timing_now(void);
+
+/* records that phase took from start until now, output can be NULL */
+void timing_record(const char *phase, const char *output, uint64_t start);
+/* same as timing_record, but with explicit end */
+void timing_record_span(const char *phase, const char *output, uint64_t start, uint64_t end);
+/* same as timing_record, also reports throughput for processing bytes */
+void timing_record_bytes(const char *phase, const char *output, uint64_t start, size_t bytes);
+
+/* prints summary with -v and writes trace-event json with -T */
+void timing_report(void);
+void timing_cleanup(void);
+
+#endif /* #ifndef TIMING_H */
+
@@ -3,114 +3,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <inttypes.h>
+#include <ctype.h>
 
 #include "utils.h"
 #include "common.h"
 
-void rotate_image(void *dest, const void *src, int w, int h,
-                  int bytes_per_pixel, enum wl_output_transform transform) {
-    uint8_t *d = dest;
-    const uint8_t *s = src;
-    int x, y, new_x, new_y;
-
-    switch (transform) {
-    case WL_OUTPUT_TRANSFORM_NORMAL:
-        memcpy(dest, src, w * h * bytes_per_pixel);
-        break;
-
-    case WL_OUTPUT_TRANSFORM_90:
-        for (y = 0; y < h; y++) {
-            for (x = 0; x < w; x++) {
-                new_x = h - 1 - y;
-                new_y = x;
-
-                memcpy(d + (new_y * h + new_x) * bytes_per_pixel,
-                       s + (y * w + x) * bytes_per_pixel,
-                       bytes_per_pixel);
-            }
-        }
-        break;
-
-    case WL_OUTPUT_TRANSFORM_180:
-        for (y = 0; y < h; y++) {
-            for (x = 0; x < w; x++) {
-                new_x = w - 1 - x;
-                new_y = h - 1 - y;
-
-                memcpy(d + (new_y * w + new_x) * bytes_per_pixel,
-                       s + (y * w + x) * bytes_per_pixel,
-                       bytes_per_pixel);
-            }
-        }
-        break;
-
-    case WL_OUTPUT_TRANSFORM_270:
-        for (y = 0; y < h; y++) {
-            for (x = 0; x < w; x++) {
-                new_x = y;
-                new_y = w - 1 - x;
-
-                memcpy(d + (new_y * h + new_x) * bytes_per_pixel,
-                       s + (y * w + x) * bytes_per_pixel,
-                       bytes_per_pixel);
-            }
-        }
-        break;
-
-    case WL_OUTPUT_TRANSFORM_FLIPPED:
-        for (y = 0; y < h; y++) {
-            for (x = 0; x < w; x++) {
-                new_x = w - 1 - x;
-                new_y = y;
-
-                memcpy(d + (new_y * w + new_x) * bytes_per_pixel,
-                       s + (y * w + x) * bytes_per_pixel,
-                       bytes_per_pixel);
-            }
-        }
-        break;
-
-    case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-        for (y = 0; y < h; y++) {
-            for (x = 0; x < w; x++) {
-                new_x = y;
-                new_y = x;
-
-                memcpy(d + (new_y * h + new_x) * bytes_per_pixel,
-                       s + (y * w + x) * bytes_per_pixel,
-                       bytes_per_pixel);
-            }
-        }
-        break;
-
-    case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-        for (y = 0; y < h; y++) {
-            for (x = 0; x < w; x++) {
-                new_x = x;
-                new_y = h - 1 - y;
-
-                memcpy(d + (new_y * w + new_x) * bytes_per_pixel,
-                       s + (y * w + x) * bytes_per_pixel,
-                       bytes_per_pixel);
-            }
-        }
-        break;
-
-    case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-        for (y = 0; y < h; y++) {
-            for (x = 0; x < w; x++) {
-                new_x = h - 1 - y;
-                new_y = w - 1 - x;
-
-                memcpy(d + (new_y * h + new_x) * bytes_per_pixel,
-                       s + (y * w + x) * bytes_per_pixel,
-                       bytes_per_pixel);
-            }
-        }
-        break;
-    }
-}
-
 bool str_to_ulong(const char *str, unsigned long *res) {
     char *endptr = NULL;
 
@@ -135,6 +33,80 @@ bool is_valid_signal(int sig) {
     return sigaddset(&set, sig) == 0;
 }
 
+bool parse_geometry(const char *str, int32_t *x, int32_t *y, int32_t *w, int32_t *h) {
+    int n = -1;
+
+    if (sscanf(str, "%" SCNd32 ",%" SCNd32 " %" SCNd32 "x%" SCNd32 "%n", x, y, w, h, &n) != 4
+            || n < 0 || str[n] != '\0') {
+        ERR("failed to parse geometry %s: expected X,Y WxH", str);
+        return false;
+    } else if (*w <= 0 || *h <= 0) {
+        ERR("failed to parse geometry %s: size has to be positive", str);
+        return false;
+    }
+    return true;
+}
+
+bool parse_duration(const char *str, uint64_t *ms) {
+    const char *p = str;
+    uint64_t whole = 0, frac = 0, res;
+    bool has_frac = false, nonzero = false;
+
+    if (!isdigit((unsigned char)*p)) {
+        goto invalid;
+    }
+    for (; isdigit((unsigned char)*p); p++) {
+        /* checked against the limit as it goes, so it can't overflow before scaling */
+        if (whole > DURATION_MAX_MS) {
+            goto too_big;
+        }
+        whole = whole * 10 + (*p - '0');
+        nonzero |= *p != '0';
+    }
+    if (*p == '.') {
+        p++;
+        has_frac = true;
+        if (!isdigit((unsigned char)*p)) {
+            goto invalid;
+        }
+        /* anything below a millisecond is dropped */
+        for (uint64_t scale = 100; isdigit((unsigned char)*p); p++, scale /= 10) {
+            frac += (*p - '0') * scale;
+            nonzero |= *p != '0';
+        }
+    }
+
+    if (STREQ(p, "ms") && !has_frac) {
+        res = whole;
+    } else if (*p == '\0' || STREQ(p, "s")) {
+        if (whole > DURATION_MAX_MS / 1000) {
+            goto too_big;
+        }
+        res = whole * 1000 + frac;
+    } else {
+        goto invalid;
+    }
+
+    if (res > DURATION_MAX_MS) {
+        goto too_big;
+    }
+    if (res == 0 && nonzero) {
+        /* zero means no timeout, which is not what was asked for */
+        ERR("failed to parse duration %s: shorter than a millisecond", str);
+        return false;
+    }
+    *ms = res;
+    return true;
+
+too_big:
+    ERR("failed to parse duration %s: too big (at most %" PRIu64 " ms)", str,
+        (uint64_t)DURATION_MAX_MS);
+    return false;
+invalid:
+    ERR("failed to parse duration %s: expected seconds or milliseconds (eg 2, 1.5s or 250ms)", str);
+    return false;
+}
+
 // some bs
 uint32_t get_bytes_per_pixel(uint32_t format) {
     switch (format) {
@@ -153,3 +125,106 @@ uint32_t get_bytes_per_pixel(uint32_t format) {
             return 4;
     }
 }
+
+/* wl_shm formats are little endian, so byte order in memory is reversed from the name */
+bool get_pixel_layout(uint32_t format, struct pixel_layout *layout) {
+    switch (format) {
+    case WL_SHM_FORMAT_XRGB8888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 4, .r = 2, .g = 1, .b = 0, .a = -1 };
+        return true;
+    case WL_SHM_FORMAT_ARGB8888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 4, .r = 2, .g = 1, .b = 0, .a = 3 };
+        return true;
+    case WL_SHM_FORMAT_XBGR8888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 4, .r = 0, .g = 1, .b = 2, .a = -1 };
+        return true;
+    case WL_SHM_FORMAT_ABGR8888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 4, .r = 0, .g = 1, .b = 2, .a = 3 };
+        return true;
+    case WL_SHM_FORMAT_RGBX8888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 4, .r = 3, .g = 2, .b = 1, .a = -1 };
+        return true;
+    case WL_SHM_FORMAT_RGBA8888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 4, .r = 3, .g = 2, .b = 1, .a = 0 };
+        return true;
+    case WL_SHM_FORMAT_BGRX8888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 4, .r = 1, .g = 2, .b = 3, .a = -1 };
+        return true;
+    case WL_SHM_FORMAT_BGRA8888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 4, .r = 1, .g = 2, .b = 3, .a = 0 };
+        return true;
+    case WL_SHM_FORMAT_RGB888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 3, .r = 2, .g = 1, .b = 0, .a = -1 };
+        return true;
+    case WL_SHM_FORMAT_BGR888:
+        *layout = (struct pixel_layout){ .bytes_per_pixel = 3, .r = 0, .g = 1, .b = 2, .a = -1 };
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* extends n bit value to 16 bits, so that max maps to max */
+static uint16_t scale_channel(uint32_t value, int bits) {
+    return value * 65535 / ((1u << bits) - 1);
+}
+
+bool decode_pixel(uint32_t format, const void *pixel, struct color *color) {
+    const uint8_t *p = pixel;
+    /* wl_shm formats are little endian, pixel can be the last one in buffer */
+    uint32_t v32 = 0;
+    for (uint32_t i = 0; i < get_bytes_per_pixel(format); i++) {
+        v32 |= (uint32_t)p[i] << (i * 8);
+    }
+    uint32_t v16 = v32 & 0xffff;
+    uint32_t v24 = v32 & 0xffffff;
+
+    uint32_t r, g, b;
+    int bits;
+    switch (format) {
+    case WL_SHM_FORMAT_XRGB8888:
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_RGB888:
+        r = v24 >> 16 & 0xff; g = v24 >> 8 & 0xff; b = v24 & 0xff; bits = 8;
+        break;
+    case WL_SHM_FORMAT_XBGR8888:
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_BGR888:
+        r = v24 & 0xff; g = v24 >> 8 & 0xff; b = v24 >> 16 & 0xff; bits = 8;
+        break;
+    case WL_SHM_FORMAT_RGBX8888:
+    case WL_SHM_FORMAT_RGBA8888:
+        r = v32 >> 24; g = v32 >> 16 & 0xff; b = v32 >> 8 & 0xff; bits = 8;
+        break;
+    case WL_SHM_FORMAT_BGRX8888:
+    case WL_SHM_FORMAT_BGRA8888:
+        r = v32 >> 8 & 0xff; g = v32 >> 16 & 0xff; b = v32 >> 24; bits = 8;
+        break;
+    case WL_SHM_FORMAT_XRGB2101010:
+    case WL_SHM_FORMAT_ARGB2101010:
+        r = v32 >> 20 & 0x3ff; g = v32 >> 10 & 0x3ff; b = v32 & 0x3ff; bits = 10;
+        break;
+    case WL_SHM_FORMAT_XBGR2101010:
+    case WL_SHM_FORMAT_ABGR2101010:
+        r = v32 & 0x3ff; g = v32 >> 10 & 0x3ff; b = v32 >> 20 & 0x3ff; bits = 10;
+        break;
+    case WL_SHM_FORMAT_RGB565:
+        r = v16 >> 11; g = v16 >> 5 & 0x3f; b = v16 & 0x1f;
+        /* green has an extra bit */
+        *color = (struct color){ scale_channel(r, 5), scale_channel(g, 6), scale_channel(b, 5) };
+        return true;
+    case WL_SHM_FORMAT_BGR565:
+        r = v16 & 0x1f; g = v16 >> 5 & 0x3f; b = v16 >> 11;
+        *color = (struct color){ scale_channel(r, 5), scale_channel(g, 6), scale_channel(b, 5) };
+        return true;
+    case WL_SHM_FORMAT_XRGB4444:
+    case WL_SHM_FORMAT_ARGB4444:
+        r = v16 >> 8 & 0xf; g = v16 >> 4 & 0xf; b = v16 & 0xf; bits = 4;
+        break;
+    default:
+        return false;
+    }
+
+    *color = (struct color){ scale_channel(r, bits), scale_channel(g, bits), scale_channel(b, bits) };
+    return true;
+}
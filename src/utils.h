@@ -2,15 +2,42 @@
 #define UTILS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <wayland-client.h>
 
-void rotate_image(void *dest, const void *src, int w, int h,
-                  int bytes_per_pixel, enum wl_output_transform transform);
-
 bool str_to_ulong(const char *str, unsigned long *res);
 
 bool is_valid_signal(int sig);
 
+/* parses "X,Y WxH" as printed by slurp, size has to be positive */
+bool parse_geometry(const char *str, int32_t *x, int32_t *y, int32_t *w, int32_t *h);
+
+/* durations are turned into nanosecond deadlines, this keeps them inside uint64_t */
+#define DURATION_MAX_MS (INT64_MAX / 1000000)
+
+/*
+ * parses "2", "1.5", "1.5s" or "250ms", plain numbers are seconds. Durations longer than
+ * DURATION_MAX_MS or that round down to zero milliseconds are rejected.
+ */
+bool parse_duration(const char *str, uint64_t *ms);
+
 uint32_t get_bytes_per_pixel(uint32_t format);
 
+struct pixel_layout {
+    int bytes_per_pixel;
+    /* byte offsets of 8 bit channels inside a pixel, a is -1 if there's no alpha */
+    int r, g, b, a;
+};
+
+/* returns false for formats that don't store channels in separate bytes */
+bool get_pixel_layout(uint32_t format, struct pixel_layout *layout);
+
+/* channels scaled to 16 bits whatever depth format has */
+struct color {
+    uint16_t r, g, b;
+};
+
+/* reads single pixel of any format get_bytes_per_pixel knows, returns false for unknown ones */
+bool decode_pixel(uint32_t format, const void *pixel, struct color *color);
+
 #endif /* #ifndef UTILS_H */
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
 
@@ -10,10 +12,19 @@
 #include "ext-image-copy-capture-v1.h"
 #include "ext-image-capture-source-v1.h"
 #include "viewporter.h"
+#include "linux-dmabuf-v1.h"
+#include "alpha-modifier-v1.h"
+#include "cursor-shape-v1.h"
 
 #include "wayland.h"
 #include "common.h"
 #include "xmalloc.h"
+#include "shm.h"
+#include "dmabuf.h"
+#include "buffer_cache.h"
+#include "config.h"
+#include "damage.h"
+#include "timer.h"
 
 struct wayland wayland = {0};
 
@@ -57,6 +68,25 @@ static const struct zxdg_output_v1_listener xdg_output_listener = {
     .done = xdg_output_done_handler,
 };
 
+static void output_destroy(struct output *output) {
+    buffer_cache_invalidate(output);
+    if (output->xdg_output) {
+        zxdg_output_v1_destroy(output->xdg_output);
+    }
+    if (output->wl_output) {
+        wl_output_destroy(output->wl_output);
+    }
+    free(output->name);
+    wl_list_remove(&output->link);
+    free(output);
+}
+
+static void output_get_xdg_output(struct output *output) {
+    output->xdg_output =
+        zxdg_output_manager_v1_get_xdg_output(wayland.xdg_output_manager, output->wl_output);
+    zxdg_output_v1_add_listener(output->xdg_output, &xdg_output_listener, output);
+}
+
 static void output_geometry_handler(void *data, struct wl_output *wl_output,
                                     int32_t x, int32_t y, int32_t phys_w, int32_t phys_h,
                                     int32_t subpixel,
@@ -64,12 +94,23 @@ static void output_geometry_handler(void *data, struct wl_output *wl_output,
                                     int32_t transform) {
     struct output *output = data;
 
+    if (output->transform != (enum wl_output_transform)transform) {
+        buffer_cache_invalidate(output);
+    }
     output->transform = transform;
 }
 
 static void output_mode_handler(void *data, struct wl_output *wl_output, uint32_t flags,
                                 int32_t width, int32_t height, int32_t refresh) {
-    // no-op
+    struct output *output = data;
+
+    if (flags & WL_OUTPUT_MODE_CURRENT) {
+        if (output->mode.w != width || output->mode.h != height) {
+            buffer_cache_invalidate(output);
+        }
+        output->mode.w = width;
+        output->mode.h = height;
+    }
 }
 
 static void output_done_handler(void *data, struct wl_output *wl_output) {
@@ -82,10 +123,25 @@ static const struct wl_output_listener output_listener = {
     .done = output_done_handler,
 };
 
+static void seat_capabilities(void *data, struct wl_seat *seat, uint32_t capabilities) {
+    wayland.seat_capabilities = capabilities;
+}
+
+static void seat_name(void *data, struct wl_seat *seat, const char *name) {
+    // no-op
+}
+
+static const struct wl_seat_listener seat_listener = {
+    .capabilities = seat_capabilities,
+    .name = seat_name,
+};
+
 static void registry_global(void *data, struct wl_registry *registry, uint32_t id,
                             const char *interface, uint32_t version) {
     #define MATCH_INTERFACE(i) STREQ(interface, i.name)
     #define BIND_INTERFACE(i, ver) (wl_registry_bind(registry, id, &i, ver))
+    /* selecting region and picking color read the pointer over overlays */
+    bool needs_input = config.select_region || config.pick_color;
 
     if (MATCH_INTERFACE(wl_compositor_interface)) {
         wayland.compositor = BIND_INTERFACE(wl_compositor_interface, 6);
@@ -95,8 +151,13 @@ static void registry_global(void *data, struct wl_registry *registry, uint32_t i
         struct output *output = xcalloc(1, sizeof(*output));
 
         wl_list_insert(&wayland.outputs, &output->link);
+        output->global_name = id;
         output->wl_output = BIND_INTERFACE(wl_output_interface, 1);
         wl_output_add_listener(output->wl_output, &output_listener, output);
+        /* hotplugged after startup (daemon mode) */
+        if (wayland.xdg_output_manager != NULL) {
+            output_get_xdg_output(output);
+        }
     } else if (MATCH_INTERFACE(zwlr_layer_shell_v1_interface)) {
         wayland.layer_shell = BIND_INTERFACE(zwlr_layer_shell_v1_interface, 1);
     } else if (MATCH_INTERFACE(zwlr_screencopy_manager_v1_interface)) {
@@ -109,6 +170,18 @@ static void registry_global(void *data, struct wl_registry *registry, uint32_t i
         wayland.image_copy_capture_manager = BIND_INTERFACE(ext_image_copy_capture_manager_v1_interface, 1);
     } else if (MATCH_INTERFACE(ext_output_image_capture_source_manager_v1_interface)) {
         wayland.output_image_capture_source_manager = BIND_INTERFACE(ext_output_image_capture_source_manager_v1_interface, 1);
+    } else if (MATCH_INTERFACE(wp_alpha_modifier_v1_interface)) {
+        wayland.alpha_modifier = BIND_INTERFACE(wp_alpha_modifier_v1_interface, 1);
+    } else if (needs_input && MATCH_INTERFACE(wl_seat_interface) && wayland.seat == NULL) {
+        /* pointer frame events need version 5 */
+        wayland.seat = BIND_INTERFACE(wl_seat_interface, version < 5 ? version : 5);
+        wl_seat_add_listener(wayland.seat, &seat_listener, NULL);
+    } else if (needs_input && MATCH_INTERFACE(wl_subcompositor_interface)) {
+        wayland.subcompositor = BIND_INTERFACE(wl_subcompositor_interface, 1);
+    } else if (needs_input && MATCH_INTERFACE(wp_cursor_shape_manager_v1_interface)) {
+        wayland.cursor_shape_manager = BIND_INTERFACE(wp_cursor_shape_manager_v1_interface, 1);
+    } else if (config.dmabuf && MATCH_INTERFACE(zwp_linux_dmabuf_v1_interface)) {
+        wayland.linux_dmabuf = BIND_INTERFACE(zwp_linux_dmabuf_v1_interface, version < 3 ? version : 3);
     }
 
     #undef MATCH_INTERFACE
@@ -116,7 +189,18 @@ static void registry_global(void *data, struct wl_registry *registry, uint32_t i
 }
 
 static void registry_global_remove(void *data, struct wl_registry *registry, uint32_t id) {
-    // no-op
+    struct output *output;
+    wl_list_for_each(output, &wayland.outputs, link) {
+        if (output->global_name == id) {
+            DEBUG("output %s was removed", output->name);
+            if (wl_list_empty(&wayland.overlays) && wl_list_empty(&wayland.screenshots)) {
+                output_destroy(output);
+            } else {
+                output->removed = true;
+            }
+            return;
+        }
+    }
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -168,30 +252,67 @@ void wayland_init(void) {
     if (wl_list_empty(&wayland.outputs)) {
         DIE("no outputs found");
     }
+    if ((config.select_region || config.pick_color)
+        && (wayland.seat == NULL || wayland.subcompositor == NULL)) {
+        DIE("didn't get a wl_seat and wl_subcompositor needed for pointer input");
+    }
 
     struct output *output;
     wl_list_for_each(output, &wayland.outputs, link) {
-        output->xdg_output =
-            zxdg_output_manager_v1_get_xdg_output(wayland.xdg_output_manager, output->wl_output);
-        zxdg_output_v1_add_listener(output->xdg_output, &xdg_output_listener, output);
+        if (output->xdg_output == NULL) {
+            output_get_xdg_output(output);
+        }
     }
     if (wl_display_roundtrip(wayland.display) < 0) {
         DIE("wl_display_roundtrip() failed");
     }
 }
 
+void wayland_dispatch_timed(void) {
+    /* events another dispatch already read have to be handled before polling */
+    while (wl_display_prepare_read(wayland.display) != 0) {
+        if (wl_display_dispatch_pending(wayland.display) < 0) {
+            EDIE("wl_display_dispatch_pending() failed");
+        }
+    }
+    wl_display_flush(wayland.display);
+
+    struct pollfd fds[] = {
+        { .fd = wayland.fd, .events = POLLIN },
+        { .fd = timer_fd(), .events = POLLIN },
+    };
+    if (poll(fds, 2, -1) < 0) {
+        wl_display_cancel_read(wayland.display);
+        if (errno == EINTR) {
+            return;
+        }
+        EDIE("poll() failed");
+    }
+
+    /* read_events reports hangups and errors too */
+    if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+        if (wl_display_read_events(wayland.display) < 0) {
+            EDIE("wl_display_read_events() failed");
+        }
+    } else {
+        wl_display_cancel_read(wayland.display);
+    }
+    if (wl_display_dispatch_pending(wayland.display) < 0) {
+        EDIE("wl_display_dispatch_pending() failed");
+    }
+    if (fds[1].revents & POLLIN) {
+        timer_dispatch();
+    }
+}
+
 void wayland_cleanup(void) {
+    buffer_cache_cleanup();
+    shm_pool_cleanup();
+    dmabuf_cleanup();
+
     struct output *output, *output_tmp;
     wl_list_for_each_safe(output, output_tmp, &wayland.outputs, link) {
-        if (output->xdg_output) {
-            zxdg_output_v1_destroy(output->xdg_output);
-        }
-        if (output->wl_output) {
-            wl_output_destroy(output->wl_output);
-        }
-        free(output->name);
-        wl_list_remove(&output->link);
-        free(output);
+        output_destroy(output);
     }
     if (wayland.viewporter) {
         wp_viewporter_destroy(wayland.viewporter);
@@ -208,6 +329,21 @@ void wayland_cleanup(void) {
     if (wayland.output_image_capture_source_manager) {
         ext_output_image_capture_source_manager_v1_destroy(wayland.output_image_capture_source_manager);
     }
+    if (wayland.linux_dmabuf) {
+        zwp_linux_dmabuf_v1_destroy(wayland.linux_dmabuf);
+    }
+    if (wayland.alpha_modifier) {
+        wp_alpha_modifier_v1_destroy(wayland.alpha_modifier);
+    }
+    if (wayland.cursor_shape_manager) {
+        wp_cursor_shape_manager_v1_destroy(wayland.cursor_shape_manager);
+    }
+    if (wayland.subcompositor) {
+        wl_subcompositor_destroy(wayland.subcompositor);
+    }
+    if (wayland.seat) {
+        wl_seat_destroy(wayland.seat);
+    }
     if (wayland.layer_shell) {
         zwlr_layer_shell_v1_destroy(wayland.layer_shell);
     }
@@ -225,3 +361,33 @@ void wayland_cleanup(void) {
         wl_display_disconnect(wayland.display);
     }
 }
+
+bool output_intersect(const struct output *output, const struct rect *rect, struct rect *region) {
+    struct rect output_rect = {
+        .x = output->logical_geometry.x,
+        .y = output->logical_geometry.y,
+        .w = output->logical_geometry.w,
+        .h = output->logical_geometry.h,
+    };
+
+    if (!rect_intersect(rect, &output_rect, region)) {
+        return false;
+    }
+    region->x -= output->logical_geometry.x;
+    region->y -= output->logical_geometry.y;
+    return true;
+}
+
+bool output_region_is_whole(const struct output *output, const struct rect *region) {
+    return region->x == 0 && region->y == 0
+        && region->w == output->logical_geometry.w && region->h == output->logical_geometry.h;
+}
+
+void wayland_prune_outputs(void) {
+    struct output *output, *output_tmp;
+    wl_list_for_each_safe(output, output_tmp, &wayland.outputs, link) {
+        if (output->removed) {
+            output_destroy(output);
+        }
+    }
+}
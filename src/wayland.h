@@ -1,7 +1,9 @@
 #ifndef WAYLAND_H
 #define WAYLAND_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <wayland-client.h>
 
 struct wayland {
@@ -17,6 +19,14 @@ struct wayland {
     struct ext_output_image_capture_source_manager_v1 *output_image_capture_source_manager;
     struct zxdg_output_manager_v1 *xdg_output_manager;
     struct wp_viewporter *viewporter;
+    struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+    struct wp_alpha_modifier_v1 *alpha_modifier;
+
+    /* only bound with -G or -p */
+    struct wl_seat *seat;
+    uint32_t seat_capabilities;
+    struct wl_subcompositor *subcompositor;
+    struct wp_cursor_shape_manager_v1 *cursor_shape_manager;
 
     struct wl_list outputs;
     struct wl_list overlays;
@@ -28,6 +38,22 @@ struct buffer {
     struct wl_buffer *wl_buffer;
     void *data;
     int32_t width, height, stride;
+
+    /* location inside shm pool */
+    size_t offset, size;
+    struct wl_list pool_link;
+
+    /* udmabuf backed buffers live outside of shm pool */
+    bool dmabuf;
+    int dmabuf_fd;
+    /* so do -e frames, each has a memfd of its own that can be sealed, -1 otherwise */
+    int memfd;
+
+    /* see buffer_cache.h */
+    struct output *output;
+    uint32_t format;
+    bool in_use, busy, stale, release_listener;
+    struct wl_list cache_link;
 };
 
 struct output {
@@ -36,13 +62,33 @@ struct output {
     struct {
         int32_t x, y, w, h;
     } logical_geometry;
+    struct {
+        int32_t w, h;
+    } mode;
     enum wl_output_transform transform;
     char *name;
 
+    uint32_t global_name;
+    /* global went away while output was frozen, destroyed by wayland_prune_outputs() */
+    bool removed;
+
     struct wl_list link;
 };
 
 void wayland_init(void);
 void wayland_cleanup(void);
+/* like wl_display_dispatch, but also returns to run timers (see timer.h) once they're due */
+void wayland_dispatch_timed(void);
+/* destroys outputs that were removed while they were in use */
+void wayland_prune_outputs(void);
+
+struct rect;
+/*
+ * Clips rect in global logical coordinates to output and stores it in region, relative to
+ * output. Returns false if they don't overlap.
+ */
+bool output_intersect(const struct output *output, const struct rect *rect, struct rect *region);
+/* region is relative to output */
+bool output_region_is_whole(const struct output *output, const struct rect *region);
 
 #endif /* #ifndef WAYLAND_H */
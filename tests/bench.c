@@ -0,0 +1,580 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <wayland-client.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "common.h"
+#include "config.h"
+#include "damage.h"
+#include "dump.h"
+#include "encode.h"
+#include "rotate.h"
+#include "screenshot.h"
+#include "shm.h"
+#include "timing.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "wayland.h"
+#include "xmalloc.h"
+
+/* every case runs at least this many times and for at least this long */
+#define MIN_ITERATIONS 3
+#define MIN_DURATION_NS 200000000ull
+
+int log_enable_debug = 0;
+struct wayland wayland = {0};
+
+static const struct {
+    const char *name;
+    int w, h;
+} resolutions[] = {
+    { "1080p", 1920, 1080 },
+    { "1440p", 2560, 1440 },
+    { "4K", 3840, 2160 },
+    { "5K", 5120, 2880 },
+    { "8K", 7680, 4320 },
+};
+
+/* one format for every size get_bytes_per_pixel knows about */
+static const uint32_t formats[] = {
+    WL_SHM_FORMAT_RGB565,
+    WL_SHM_FORMAT_BGR888,
+    WL_SHM_FORMAT_XRGB8888,
+};
+
+/* get_pixel_layout has no 16 bit formats, alpha takes another path in conversions */
+static const struct {
+    const char *name;
+    uint32_t format;
+} layout_formats[] = {
+    { "bgr888", WL_SHM_FORMAT_BGR888 },
+    { "xrgb8888", WL_SHM_FORMAT_XRGB8888 },
+    { "argb8888", WL_SHM_FORMAT_ARGB8888 },
+};
+
+static const char *transform_names[] = {
+    [WL_OUTPUT_TRANSFORM_NORMAL] = "normal",
+    [WL_OUTPUT_TRANSFORM_90] = "90",
+    [WL_OUTPUT_TRANSFORM_180] = "180",
+    [WL_OUTPUT_TRANSFORM_270] = "270",
+    [WL_OUTPUT_TRANSFORM_FLIPPED] = "flipped",
+    [WL_OUTPUT_TRANSFORM_FLIPPED_90] = "flipped-90",
+    [WL_OUTPUT_TRANSFORM_FLIPPED_180] = "flipped-180",
+    [WL_OUTPUT_TRANSFORM_FLIPPED_270] = "flipped-270",
+};
+
+#define ARRAY_LENGTH(a) (sizeof(a) / sizeof((a)[0]))
+
+/* largest frame any case needs, 8K at 4 bytes per pixel */
+#define MAX_FRAME_SIZE ((size_t)7680 * 4320 * 4)
+
+struct sample {
+    uint64_t ns;
+    uint64_t cycles;
+};
+
+/* TSC ticks at nominal frequency, so with turbo it's not exactly core cycles */
+static uint64_t cycles_now(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static struct sample sample_start(void) {
+    return (struct sample){ .ns = timing_now(), .cycles = cycles_now() };
+}
+
+static void sample_add_since(struct sample *total, const struct sample *start) {
+    total->cycles += cycles_now() - start->cycles;
+    total->ns += timing_now() - start->ns;
+}
+
+static bool sample_done(const struct sample *total, int iterations) {
+    return iterations >= MIN_ITERATIONS && total->ns >= MIN_DURATION_NS;
+}
+
+static void print_result(const char *what, const char *resolution, int bytes_per_pixel,
+                         const struct sample *total, int iterations, size_t pixels, size_t bytes) {
+    double ns = (double)total->ns / iterations;
+    printf("%-24s %-6s %d bpp %9.3f ms %8.2f GB/s", what, resolution, bytes_per_pixel,
+           ns / 1e6, bytes / ns);
+#ifdef HAVE_RDTSC
+    printf(" %7.3f cycles/px\n", (double)total->cycles / iterations / pixels);
+#else
+    printf("       n/a cycles/px\n");
+#endif
+}
+
+/* not zeroes, so that pages are really there and nothing takes a shortcut */
+static uint8_t *create_image(void) {
+    uint8_t *image = xmalloc(MAX_FRAME_SIZE);
+    for (size_t i = 0; i < MAX_FRAME_SIZE; i++) {
+        image[i] = i * 31 + 7;
+    }
+    return image;
+}
+
+static void bench_rotate(void) {
+    uint8_t *src = create_image();
+    uint8_t *dest = create_image();
+
+    printf("rotate_image, %u threads\n", threadpool_size());
+    for (size_t r = 0; r < ARRAY_LENGTH(resolutions); r++) {
+        int w = resolutions[r].w, h = resolutions[r].h;
+        for (size_t f = 0; f < ARRAY_LENGTH(formats); f++) {
+            int bytes_per_pixel = get_bytes_per_pixel(formats[f]);
+            size_t pixels = (size_t)w * h;
+
+            for (int t = WL_OUTPUT_TRANSFORM_NORMAL; t <= WL_OUTPUT_TRANSFORM_FLIPPED_270; t++) {
+                /* warm up caches, TLB and worker threads */
+                rotate_image(dest, src, w, h, bytes_per_pixel, t);
+
+                struct sample total = {0};
+                int iterations = 0;
+                while (!sample_done(&total, iterations)) {
+                    struct sample start = sample_start();
+                    rotate_image(dest, src, w, h, bytes_per_pixel, t);
+                    sample_add_since(&total, &start);
+                    iterations++;
+                }
+
+                /* every pixel is read once and written once */
+                print_result(transform_names[t], resolutions[r].name, bytes_per_pixel,
+                             &total, iterations, pixels, pixels * bytes_per_pixel * 2);
+            }
+        }
+    }
+
+    free(src);
+    free(dest);
+}
+
+/*
+ * Identical frames are the worst case without a hint, every tile is compared to the end.
+ * With a hint that covers the first row, as ext-image-copy-capture damage would after a
+ * small change, only one row of tiles is.
+ */
+static void bench_damage(void) {
+    uint8_t *a = create_image();
+    uint8_t *b = xmalloc(MAX_FRAME_SIZE);
+    memcpy(b, a, MAX_FRAME_SIZE);
+
+    struct wl_array damage, no_hint, row_hint;
+    wl_array_init(&damage);
+    wl_array_init(&no_hint);
+    wl_array_init(&row_hint);
+
+    printf("find_damage\n");
+    for (size_t r = 0; r < ARRAY_LENGTH(resolutions); r++) {
+        int w = resolutions[r].w, h = resolutions[r].h;
+        row_hint.size = 0;
+        damage_add(&row_hint, 0, 0, w, 1);
+
+        for (size_t f = 0; f < ARRAY_LENGTH(formats); f++) {
+            int bytes_per_pixel = get_bytes_per_pixel(formats[f]);
+            int stride = w * bytes_per_pixel;
+            size_t pixels = (size_t)w * h;
+
+            const struct {
+                const char *name;
+                const struct wl_array *hint;
+            } cases[] = {
+                { "find_damage", &no_hint },
+                { "find_damage row hint", &row_hint },
+            };
+            for (size_t c = 0; c < ARRAY_LENGTH(cases); c++) {
+                struct sample total = {0};
+                int iterations = 0;
+                while (!sample_done(&total, iterations)) {
+                    damage.size = 0;
+                    struct sample start = sample_start();
+                    find_damage(&damage, a, b, w, h, stride, bytes_per_pixel, cases[c].hint);
+                    sample_add_since(&total, &start);
+                    iterations++;
+                }
+
+                /* both frames, whether they were compared or skipped */
+                print_result(cases[c].name, resolutions[r].name, bytes_per_pixel,
+                             &total, iterations, pixels, pixels * bytes_per_pixel * 2);
+            }
+        }
+    }
+
+    wl_array_release(&damage);
+    wl_array_release(&no_hint);
+    wl_array_release(&row_hint);
+    free(a);
+    free(b);
+}
+
+/* dump and encoders only look at buffer, output and format */
+static void fake_screenshot(struct screenshot *screenshot, struct buffer *buffer,
+                            struct output *output, uint8_t *data, uint32_t format,
+                            int w, int h, enum wl_output_transform transform) {
+    int bytes_per_pixel = get_bytes_per_pixel(format);
+
+    *buffer = (struct buffer){0};
+    buffer->data = data;
+    buffer->width = w;
+    buffer->height = h;
+    buffer->stride = w * bytes_per_pixel;
+    buffer->size = (size_t)buffer->stride * h;
+
+    *output = (struct output){0};
+    output->name = "BENCH-1";
+    output->transform = transform;
+
+    *screenshot = (struct screenshot){0};
+    screenshot->buffer = buffer;
+    screenshot->output = output;
+    screenshot->format = format;
+}
+
+/* dump_screenshots converts a band of rows at a time with get_pixel_layout */
+static void bench_dump(uint8_t *image) {
+    const struct {
+        const char *name;
+        enum dump_format format;
+    } dump_formats[] = {
+        { "dump ppm", DUMP_FORMAT_PPM },
+        { "dump farbfeld", DUMP_FORMAT_FARBFELD },
+    };
+
+    printf("dump_screenshots to /dev/null\n");
+    for (size_t r = 0; r < ARRAY_LENGTH(resolutions); r++) {
+        int w = resolutions[r].w, h = resolutions[r].h;
+        for (size_t f = 0; f < ARRAY_LENGTH(layout_formats); f++) {
+            uint32_t format = layout_formats[f].format;
+            int bytes_per_pixel = get_bytes_per_pixel(format);
+            size_t pixels = (size_t)w * h;
+
+            for (size_t d = 0; d < ARRAY_LENGTH(dump_formats); d++) {
+                struct screenshot screenshot;
+                struct buffer buffer;
+                struct output output;
+                fake_screenshot(&screenshot, &buffer, &output, image, format, w, h,
+                                WL_OUTPUT_TRANSFORM_NORMAL);
+                struct wl_list screenshots;
+                wl_list_init(&screenshots);
+                wl_list_insert(&screenshots, &screenshot.link);
+
+                struct sample total = {0};
+                int iterations = 0;
+                while (!sample_done(&total, iterations)) {
+                    struct sample start = sample_start();
+                    dump_screenshots(&screenshots, "/dev/null", dump_formats[d].format);
+                    sample_add_since(&total, &start);
+                    iterations++;
+                }
+
+                char what[64];
+                snprintf(what, sizeof(what), "%s %s", dump_formats[d].name,
+                         layout_formats[f].name);
+                print_result(what, resolutions[r].name, bytes_per_pixel,
+                             &total, iterations, pixels, pixels * bytes_per_pixel);
+            }
+        }
+    }
+}
+
+/* encoders pull rows through encode_source in bands of this many */
+#define ENCODE_BAND_ROWS 64
+
+static void bench_encode_source(uint8_t *image) {
+    const enum wl_output_transform transforms[] = {
+        WL_OUTPUT_TRANSFORM_NORMAL,
+        WL_OUTPUT_TRANSFORM_90,
+    };
+
+    printf("encode_source_rows\n");
+    for (size_t r = 0; r < ARRAY_LENGTH(resolutions); r++) {
+        int w = resolutions[r].w, h = resolutions[r].h;
+        for (size_t f = 0; f < ARRAY_LENGTH(layout_formats); f++) {
+            uint32_t format = layout_formats[f].format;
+            int bytes_per_pixel = get_bytes_per_pixel(format);
+            size_t pixels = (size_t)w * h;
+
+            for (size_t t = 0; t < ARRAY_LENGTH(transforms); t++) {
+                struct screenshot screenshot;
+                struct buffer buffer;
+                struct output output;
+                fake_screenshot(&screenshot, &buffer, &output, image, format, w, h,
+                                transforms[t]);
+
+                struct encode_source source;
+                if (!encode_source_init(&source, &screenshot)) {
+                    DIE("encode_source_init() failed for %s", layout_formats[f].name);
+                }
+                uint8_t *tmp = xmalloc(encode_source_tmp_size(&source, ENCODE_BAND_ROWS) + 1);
+                uint8_t *band = xmalloc((size_t)source.width * source.channels * ENCODE_BAND_ROWS);
+
+                struct sample total = {0};
+                int iterations = 0;
+                while (!sample_done(&total, iterations)) {
+                    struct sample start = sample_start();
+                    for (int y = 0; y < source.height; y += ENCODE_BAND_ROWS) {
+                        int rows = source.height - y < ENCODE_BAND_ROWS
+                                   ? source.height - y : ENCODE_BAND_ROWS;
+                        encode_source_rows(&source, band, tmp, y, rows);
+                    }
+                    sample_add_since(&total, &start);
+                    iterations++;
+                }
+
+                char what[64];
+                snprintf(what, sizeof(what), "encode %s %s", layout_formats[f].name,
+                         transform_names[transforms[t]]);
+                print_result(what, resolutions[r].name, bytes_per_pixel,
+                             &total, iterations, pixels, pixels * bytes_per_pixel);
+
+                free(tmp);
+                free(band);
+            }
+        }
+    }
+}
+
+/* picker decodes a handful of pixels, whole frames just make the cost per pixel measurable */
+static void bench_decode_pixel(uint8_t *image) {
+    const struct {
+        const char *name;
+        uint32_t format;
+    } decode_formats[] = {
+        { "rgb565", WL_SHM_FORMAT_RGB565 },
+        { "bgr888", WL_SHM_FORMAT_BGR888 },
+        { "xrgb8888", WL_SHM_FORMAT_XRGB8888 },
+        { "xrgb2101010", WL_SHM_FORMAT_XRGB2101010 },
+    };
+
+    printf("decode_pixel\n");
+    for (size_t r = 0; r < ARRAY_LENGTH(resolutions); r++) {
+        int w = resolutions[r].w, h = resolutions[r].h;
+        for (size_t f = 0; f < ARRAY_LENGTH(decode_formats); f++) {
+            uint32_t format = decode_formats[f].format;
+            int bytes_per_pixel = get_bytes_per_pixel(format);
+            size_t pixels = (size_t)w * h;
+
+            struct sample total = {0};
+            int iterations = 0;
+            /* keeps compiler from dropping decodes nobody looks at */
+            volatile uint16_t sink = 0;
+            while (!sample_done(&total, iterations)) {
+                struct sample start = sample_start();
+                uint16_t sum = 0;
+                for (size_t i = 0; i < pixels; i++) {
+                    struct color color;
+                    decode_pixel(format, image + i * bytes_per_pixel, &color);
+                    sum += color.r ^ color.g ^ color.b;
+                }
+                sink = sum;
+                sample_add_since(&total, &start);
+                iterations++;
+            }
+            (void)sink;
+
+            char what[64];
+            snprintf(what, sizeof(what), "decode %s", decode_formats[f].name);
+            print_result(what, resolutions[r].name, bytes_per_pixel,
+                         &total, iterations, pixels, pixels * bytes_per_pixel);
+        }
+    }
+}
+
+static void bench_formats(void) {
+    uint8_t *image = create_image();
+
+    bench_dump(image);
+    bench_encode_source(image);
+    bench_decode_pixel(image);
+
+    free(image);
+}
+
+static void handle_global(void *data, struct wl_registry *registry, uint32_t name,
+                          const char *interface, uint32_t version) {
+    if (STREQ(interface, wl_shm_interface.name)) {
+        wayland.shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    }
+}
+
+static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name) {
+    // no-op
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = handle_global,
+    .global_remove = handle_global_remove,
+};
+
+static void roundtrip(void) {
+    if (wl_display_roundtrip(wayland.display) < 0) {
+        EDIE("wl_display_roundtrip() failed");
+    }
+}
+
+static bool connect_shm(void) {
+    wayland.display = wl_display_connect(NULL);
+    if (wayland.display == NULL) {
+        return false;
+    }
+
+    wayland.registry = wl_display_get_registry(wayland.display);
+    wl_registry_add_listener(wayland.registry, &registry_listener, NULL);
+    roundtrip();
+
+    return wayland.shm != NULL;
+}
+
+/*
+ * Buffers are XRGB8888 like most screencopy frames. Each iteration leaves the pool empty,
+ * so create_buffer has to grow it again like on the first freeze of an output.
+ */
+static void bench_shm(void) {
+    if (!connect_shm()) {
+        WARN("no wayland display with wl_shm, skipping create_buffer/destroy_buffer");
+        return;
+    }
+
+    printf("create_buffer/destroy_buffer%s\n", config.shm_prefault ? ", prefaulted" : "");
+    for (size_t r = 0; r < ARRAY_LENGTH(resolutions); r++) {
+        int w = resolutions[r].w, h = resolutions[r].h;
+        int bytes_per_pixel = get_bytes_per_pixel(WL_SHM_FORMAT_XRGB8888);
+        size_t pixels = (size_t)w * h;
+        size_t size = pixels * bytes_per_pixel;
+
+        struct sample create = {0}, fill = {0}, destroy = {0};
+        int iterations = 0;
+        while (iterations < MIN_ITERATIONS || create.ns + fill.ns + destroy.ns < MIN_DURATION_NS) {
+            struct buffer buffer = {0};
+
+            struct sample start = sample_start();
+            create_buffer(&buffer, WL_SHM_FORMAT_XRGB8888, w, h, w * bytes_per_pixel);
+            sample_add_since(&create, &start);
+
+            /* first write pays for page faults unless pool was prefaulted */
+            start = sample_start();
+            memset(buffer.data, 0xff, size);
+            sample_add_since(&fill, &start);
+
+            start = sample_start();
+            destroy_buffer(&buffer);
+            sample_add_since(&destroy, &start);
+
+            /* keeps compositor in step and catches protocol errors */
+            roundtrip();
+            iterations++;
+        }
+
+        print_result("create_buffer", resolutions[r].name, bytes_per_pixel,
+                     &create, iterations, pixels, size);
+        print_result("first fill", resolutions[r].name, bytes_per_pixel,
+                     &fill, iterations, pixels, size);
+        print_result("destroy_buffer", resolutions[r].name, bytes_per_pixel,
+                     &destroy, iterations, pixels, size);
+    }
+
+    shm_pool_cleanup();
+    wl_shm_destroy(wayland.shm);
+    wl_registry_destroy(wayland.registry);
+    wl_display_disconnect(wayland.display);
+}
+
+static void print_help_and_exit(FILE *stream, int exit_status) {
+    const char help_string[] =
+        "bench - throughput of frzscr's image and buffer primitives\n"
+        "\n"
+        "usage:\n"
+        "    bench [-rsdfPh] [-j THREADS]\n"
+        "\n"
+        "command line options:\n"
+        "    -r              benchmark rotate_image\n"
+        "    -s              benchmark create_buffer/destroy_buffer\n"
+        "    -d              benchmark find_damage\n"
+        "    -f              benchmark pixel format conversions of dump and encoders, and\n"
+        "                    decode_pixel\n"
+        "    -j THREADS      number of threads for rotate_image (default: one per cpu)\n"
+        "    -P              prefault shm pool, same as frzscr -P\n"
+        "    -h              print this help message and exit\n"
+        "\n"
+        "Without -r, -s, -d or -f everything is benchmarked.\n"
+        "GB/s of rotate_image and find_damage counts bytes of both images, everything else\n"
+        "counts size of the frame it works on. create_buffer/destroy_buffer need\n"
+        "WAYLAND_DISPLAY with wl_shm and are skipped without one.\n";
+
+    fputs(help_string, stream);
+    exit(exit_status);
+}
+
+int main(int argc, char **argv) {
+    bool rotate = false, shm = false;
+    bool damage = false;
+    bool formats = false;
+    unsigned long threads;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rsdfj:Ph")) != -1) {
+        switch (opt) {
+        case 'r':
+            rotate = true;
+            break;
+        case 's':
+            shm = true;
+            break;
+        case 'd':
+            damage = true;
+            break;
+        case 'f':
+            formats = true;
+            break;
+        case 'j':
+            if (!str_to_ulong(optarg, &threads) || threads < 1) {
+                DIE("invalid thread count specified");
+            } else if (threads > UINT_MAX) {
+                DIE("thread count is too big");
+            }
+            config.threads = threads;
+            break;
+        case 'P':
+            config.shm_prefault = true;
+            break;
+        case 'h':
+            print_help_and_exit(stdout, 0);
+            break;
+        default:
+            print_help_and_exit(stderr, 1);
+        }
+    }
+    if (!rotate && !shm && !damage && !formats) {
+        rotate = shm = damage = formats = true;
+    }
+
+    if (rotate) {
+        bench_rotate();
+    }
+    if (damage) {
+        bench_damage();
+    }
+    if (formats) {
+        bench_formats();
+    }
+    threadpool_cleanup();
+    if (shm) {
+        bench_shm();
+    }
+
+    return 0;
+}
@@ -0,0 +1,1372 @@
+/*
+ * Headless stand-in for a wlroots compositor, just enough of one for frzscr to freeze its
+ * outputs: wl_compositor, wl_shm, wl_output with xdg-output, wlr-screencopy, ext-image-copy-capture
+ * with output capture sources, wlr-layer-shell, viewporter and optionally linux-dmabuf.
+ * Nothing is ever drawn, captures are filled with a synthetic pattern.
+ *
+ * It runs the command given after its options as a client and exits with its status, or 1
+ * if the client exited successfully without ever freezing. Time from starting the client
+ * until every overlay it created is shown, and client's peak memory, are printed on exit.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <wayland-server.h>
+
+#include "wlr-screencopy-unstable-v1-server.h"
+#include "ext-image-copy-capture-v1-server.h"
+#include "ext-image-capture-source-v1-server.h"
+#include "linux-dmabuf-v1-server.h"
+#include "wlr-layer-shell-unstable-v1-server.h"
+#include "xdg-output-unstable-v1-server.h"
+#include "viewporter-server.h"
+
+#include "common.h"
+
+#define MAX_OUTPUTS 16
+
+#define DRM_FORMAT_ARGB8888 0x34325241 /* AR24 */
+#define DRM_FORMAT_XRGB8888 0x34325258 /* XR24 */
+
+int log_enable_debug = 0;
+
+struct mock_output {
+    int index;
+    char name[16];
+    int32_t x; /* outputs are laid out left to right */
+    int32_t w, h; /* mode, in buffer pixels */
+    enum wl_output_transform transform;
+};
+
+struct surface {
+    struct wl_resource *resource;
+    /* pending buffer is forgotten if client destroys it before commit */
+    struct wl_resource *pending_buffer;
+    struct wl_listener pending_buffer_destroy;
+    bool attached;
+    struct layer_surface *layer_surface;
+};
+
+struct layer_surface {
+    struct wl_resource *resource;
+    struct surface *surface;
+    struct mock_output *output;
+    uint32_t width, height;
+    bool configured;
+    bool mapped;
+    struct wl_list link;
+};
+
+struct capture_session {
+    struct wl_resource *resource;
+    struct mock_output *output;
+    struct frame *frame; /* at most one at a time */
+    int frames; /* captured so far, first one is damaged in full */
+};
+
+/* wlr-screencopy or ext-image-copy-capture frame */
+struct frame {
+    struct wl_resource *resource;
+    struct mock_output *output;
+    uint32_t format, width, height, stride;
+    struct wl_event_source *delay;
+
+    /* ext only, session is NULL once it's destroyed */
+    bool ext;
+    struct capture_session *session;
+    struct wl_resource *buffer;
+    struct wl_listener buffer_destroy;
+    bool captured;
+};
+
+static struct {
+    struct wl_display *display;
+    struct wl_event_loop *loop;
+
+    struct mock_output outputs[MAX_OUTPUTS];
+    int n_outputs;
+    uint32_t format;
+    uint32_t bytes_per_pixel;
+    int capture_delay_ms;
+    int failed_captures; /* this many captures fail before they start working */
+    int constraint_failures; /* same, but for ext captures and with new constraints */
+    uint8_t captures;
+    bool ext_only;
+    bool dmabuf;
+    bool expect_freeze;
+
+    pid_t client_pid;
+    int client_status;
+    struct rusage client_usage;
+    struct timespec client_start;
+
+    struct wl_list layer_surfaces; /* struct layer_surface::link */
+    uint32_t serial;
+    double freeze_ms; /* negative until every overlay is shown */
+} mock = {
+    .format = WL_SHM_FORMAT_XRGB8888,
+    .bytes_per_pixel = 4,
+    .client_pid = -1,
+    .freeze_ms = -1,
+    .expect_freeze = true,
+};
+
+static const struct {
+    const char *name;
+    uint32_t format;
+    uint32_t bytes_per_pixel;
+} formats[] = {
+    { "xrgb8888", WL_SHM_FORMAT_XRGB8888, 4 },
+    { "argb8888", WL_SHM_FORMAT_ARGB8888, 4 },
+    { "xbgr8888", WL_SHM_FORMAT_XBGR8888, 4 },
+    { "abgr8888", WL_SHM_FORMAT_ABGR8888, 4 },
+    { "xrgb2101010", WL_SHM_FORMAT_XRGB2101010, 4 },
+    { "bgr888", WL_SHM_FORMAT_BGR888, 3 },
+    { "rgb565", WL_SHM_FORMAT_RGB565, 2 },
+};
+
+/* wl_shm has its own codes for the two formats every compositor supports */
+static uint32_t drm_format(uint32_t shm_format) {
+    switch (shm_format) {
+    case WL_SHM_FORMAT_ARGB8888:
+        return DRM_FORMAT_ARGB8888;
+    case WL_SHM_FORMAT_XRGB8888:
+        return DRM_FORMAT_XRGB8888;
+    default:
+        return shm_format;
+    }
+}
+
+static bool is_dmabuf_buffer(struct wl_resource *buffer);
+
+static double ms_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static bool transform_swaps_axes(enum wl_output_transform transform) {
+    return transform & WL_OUTPUT_TRANSFORM_90;
+}
+
+static int32_t logical_width(const struct mock_output *output) {
+    return transform_swaps_axes(output->transform) ? output->h : output->w;
+}
+
+static int32_t logical_height(const struct mock_output *output) {
+    return transform_swaps_axes(output->transform) ? output->w : output->h;
+}
+
+static void destroy_resource(struct wl_client *client, struct wl_resource *resource) {
+    wl_resource_destroy(resource);
+}
+
+/* freeze is done once every overlay client asked for has a buffer */
+static void check_frozen(void) {
+    if (mock.freeze_ms >= 0 || wl_list_empty(&mock.layer_surfaces)) {
+        return;
+    }
+
+    struct layer_surface *layer_surface;
+    wl_list_for_each(layer_surface, &mock.layer_surfaces, link) {
+        if (!layer_surface->mapped) {
+            return;
+        }
+    }
+
+    mock.freeze_ms = ms_since(&mock.client_start);
+    DEBUG("all overlays shown after %.3f ms", mock.freeze_ms);
+}
+
+static void region_add(struct wl_client *client, struct wl_resource *resource,
+                       int32_t x, int32_t y, int32_t width, int32_t height) {
+    // no-op
+}
+
+static void region_subtract(struct wl_client *client, struct wl_resource *resource,
+                            int32_t x, int32_t y, int32_t width, int32_t height) {
+    // no-op
+}
+
+static const struct wl_region_interface region_impl = {
+    .destroy = destroy_resource,
+    .add = region_add,
+    .subtract = region_subtract,
+};
+
+static void surface_set_pending_buffer(struct surface *surface, struct wl_resource *buffer) {
+    if (surface->pending_buffer != NULL) {
+        wl_list_remove(&surface->pending_buffer_destroy.link);
+    }
+    surface->pending_buffer = buffer;
+    if (buffer != NULL) {
+        wl_resource_add_destroy_listener(buffer, &surface->pending_buffer_destroy);
+    }
+}
+
+static void pending_buffer_destroyed(struct wl_listener *listener, void *data) {
+    struct surface *surface = wl_container_of(listener, surface, pending_buffer_destroy);
+
+    wl_list_remove(&surface->pending_buffer_destroy.link);
+    surface->pending_buffer = NULL;
+}
+
+static void surface_attach(struct wl_client *client, struct wl_resource *resource,
+                           struct wl_resource *buffer, int32_t x, int32_t y) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+
+    surface_set_pending_buffer(surface, buffer);
+    surface->attached = true;
+}
+
+static void surface_damage(struct wl_client *client, struct wl_resource *resource,
+                           int32_t x, int32_t y, int32_t width, int32_t height) {
+    // no-op
+}
+
+static void surface_frame(struct wl_client *client, struct wl_resource *resource,
+                          uint32_t callback) {
+    struct wl_resource *callback_resource =
+        wl_resource_create(client, &wl_callback_interface, 1, callback);
+    if (callback_resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    /* there's no refresh cycle, every frame is done right away */
+    wl_callback_send_done(callback_resource, 0);
+    wl_resource_destroy(callback_resource);
+}
+
+static void surface_set_opaque_region(struct wl_client *client, struct wl_resource *resource,
+                                      struct wl_resource *region) {
+    // no-op
+}
+
+static void surface_set_input_region(struct wl_client *client, struct wl_resource *resource,
+                                     struct wl_resource *region) {
+    // no-op
+}
+
+static void layer_surface_send_configure(struct layer_surface *layer_surface) {
+    uint32_t width = layer_surface->width;
+    uint32_t height = layer_surface->height;
+    if (width == 0) {
+        width = logical_width(layer_surface->output);
+    }
+    if (height == 0) {
+        height = logical_height(layer_surface->output);
+    }
+    zwlr_layer_surface_v1_send_configure(layer_surface->resource, ++mock.serial, width, height);
+}
+
+static void surface_commit(struct wl_client *client, struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    struct layer_surface *layer_surface = surface->layer_surface;
+
+    if (surface->attached) {
+        struct wl_resource *buffer = surface->pending_buffer;
+        surface->attached = false;
+        surface_set_pending_buffer(surface, NULL);
+
+        if (buffer != NULL && wl_shm_buffer_get(buffer) == NULL && !is_dmabuf_buffer(buffer)) {
+            wl_client_post_implementation_error(client, "buffer is neither shm nor dmabuf");
+            return;
+        }
+        /* contents would be copied to a texture by now */
+        if (buffer != NULL) {
+            wl_buffer_send_release(buffer);
+        }
+
+        if (layer_surface != NULL && buffer == NULL) {
+            /* unmapped, next commit starts over with configure */
+            layer_surface->mapped = false;
+            layer_surface->configured = false;
+            return;
+        } else if (layer_surface != NULL) {
+            layer_surface->mapped = true;
+        }
+    }
+
+    if (layer_surface == NULL) {
+        return;
+    }
+    if (!layer_surface->configured) {
+        /* initial commit */
+        layer_surface->configured = true;
+        layer_surface_send_configure(layer_surface);
+    } else if (layer_surface->mapped) {
+        check_frozen();
+    }
+}
+
+static void surface_set_buffer_transform(struct wl_client *client, struct wl_resource *resource,
+                                         int32_t transform) {
+    // no-op
+}
+
+static void surface_set_buffer_scale(struct wl_client *client, struct wl_resource *resource,
+                                     int32_t scale) {
+    // no-op
+}
+
+static void surface_offset(struct wl_client *client, struct wl_resource *resource,
+                           int32_t x, int32_t y) {
+    // no-op
+}
+
+static const struct wl_surface_interface surface_impl = {
+    .destroy = destroy_resource,
+    .attach = surface_attach,
+    .damage = surface_damage,
+    .frame = surface_frame,
+    .set_opaque_region = surface_set_opaque_region,
+    .set_input_region = surface_set_input_region,
+    .commit = surface_commit,
+    .set_buffer_transform = surface_set_buffer_transform,
+    .set_buffer_scale = surface_set_buffer_scale,
+    .damage_buffer = surface_damage,
+    .offset = surface_offset,
+};
+
+static void surface_resource_destroy(struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+
+    surface_set_pending_buffer(surface, NULL);
+    if (surface->layer_surface != NULL) {
+        surface->layer_surface->surface = NULL;
+    }
+    free(surface);
+}
+
+static void compositor_create_surface(struct wl_client *client, struct wl_resource *resource,
+                                      uint32_t id) {
+    struct surface *surface = calloc(1, sizeof(*surface));
+    if (surface == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    surface->pending_buffer_destroy.notify = pending_buffer_destroyed;
+
+    surface->resource = wl_resource_create(client, &wl_surface_interface,
+                                           wl_resource_get_version(resource), id);
+    if (surface->resource == NULL) {
+        free(surface);
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(surface->resource, &surface_impl, surface,
+                                   surface_resource_destroy);
+}
+
+static void compositor_create_region(struct wl_client *client, struct wl_resource *resource,
+                                     uint32_t id) {
+    struct wl_resource *region = wl_resource_create(client, &wl_region_interface, 1, id);
+    if (region == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+    .create_surface = compositor_create_surface,
+    .create_region = compositor_create_region,
+};
+
+static void bind_compositor(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &wl_compositor_interface,
+                                                      version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &compositor_impl, NULL, NULL);
+}
+
+static const struct wl_output_interface output_impl = {
+    .release = destroy_resource,
+};
+
+static void bind_output(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct mock_output *output = data;
+
+    struct wl_resource *resource = wl_resource_create(client, &wl_output_interface, version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &output_impl, output, NULL);
+
+    wl_output_send_geometry(resource, output->x, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN,
+                            "frzscr", "mock", output->transform);
+    wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+                        output->w, output->h, 60000);
+    if (version >= WL_OUTPUT_NAME_SINCE_VERSION) {
+        wl_output_send_name(resource, output->name);
+    }
+    if (version >= WL_OUTPUT_DONE_SINCE_VERSION) {
+        wl_output_send_scale(resource, 1);
+        wl_output_send_done(resource);
+    }
+}
+
+static const struct zxdg_output_v1_interface xdg_output_impl = {
+    .destroy = destroy_resource,
+};
+
+static void xdg_output_manager_get_xdg_output(struct wl_client *client,
+                                              struct wl_resource *resource,
+                                              uint32_t id, struct wl_resource *output_resource) {
+    struct mock_output *output = wl_resource_get_user_data(output_resource);
+    uint32_t version = wl_resource_get_version(resource);
+
+    struct wl_resource *xdg_output = wl_resource_create(client, &zxdg_output_v1_interface,
+                                                        version, id);
+    if (xdg_output == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(xdg_output, &xdg_output_impl, output, NULL);
+
+    zxdg_output_v1_send_logical_position(xdg_output, output->x, 0);
+    zxdg_output_v1_send_logical_size(xdg_output, logical_width(output), logical_height(output));
+    if (version >= ZXDG_OUTPUT_V1_NAME_SINCE_VERSION) {
+        zxdg_output_v1_send_name(xdg_output, output->name);
+    }
+    zxdg_output_v1_send_done(xdg_output);
+}
+
+static const struct zxdg_output_manager_v1_interface xdg_output_manager_impl = {
+    .destroy = destroy_resource,
+    .get_xdg_output = xdg_output_manager_get_xdg_output,
+};
+
+static void bind_xdg_output_manager(struct wl_client *client, void *data,
+                                    uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &zxdg_output_manager_v1_interface,
+                                                      version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &xdg_output_manager_impl, NULL, NULL);
+}
+
+static void viewport_set_source(struct wl_client *client, struct wl_resource *resource,
+                                wl_fixed_t x, wl_fixed_t y, wl_fixed_t width, wl_fixed_t height) {
+    // no-op
+}
+
+static void viewport_set_destination(struct wl_client *client, struct wl_resource *resource,
+                                     int32_t width, int32_t height) {
+    // no-op
+}
+
+static const struct wp_viewport_interface viewport_impl = {
+    .destroy = destroy_resource,
+    .set_source = viewport_set_source,
+    .set_destination = viewport_set_destination,
+};
+
+static void viewporter_get_viewport(struct wl_client *client, struct wl_resource *resource,
+                                    uint32_t id, struct wl_resource *surface) {
+    struct wl_resource *viewport = wl_resource_create(client, &wp_viewport_interface, 1, id);
+    if (viewport == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(viewport, &viewport_impl, NULL, NULL);
+}
+
+static const struct wp_viewporter_interface viewporter_impl = {
+    .destroy = destroy_resource,
+    .get_viewport = viewporter_get_viewport,
+};
+
+static void bind_viewporter(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &wp_viewporter_interface,
+                                                      version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &viewporter_impl, NULL, NULL);
+}
+
+static void layer_surface_set_size(struct wl_client *client, struct wl_resource *resource,
+                                   uint32_t width, uint32_t height) {
+    struct layer_surface *layer_surface = wl_resource_get_user_data(resource);
+
+    layer_surface->width = width;
+    layer_surface->height = height;
+}
+
+static void layer_surface_set_anchor(struct wl_client *client, struct wl_resource *resource,
+                                     uint32_t anchor) {
+    // no-op
+}
+
+static void layer_surface_set_exclusive_zone(struct wl_client *client,
+                                             struct wl_resource *resource, int32_t zone) {
+    // no-op
+}
+
+static void layer_surface_set_margin(struct wl_client *client, struct wl_resource *resource,
+                                     int32_t top, int32_t right, int32_t bottom, int32_t left) {
+    // no-op
+}
+
+static void layer_surface_set_keyboard_interactivity(struct wl_client *client,
+                                                     struct wl_resource *resource,
+                                                     uint32_t keyboard_interactivity) {
+    // no-op
+}
+
+static void layer_surface_get_popup(struct wl_client *client, struct wl_resource *resource,
+                                    struct wl_resource *popup) {
+    // no-op
+}
+
+static void layer_surface_ack_configure(struct wl_client *client, struct wl_resource *resource,
+                                        uint32_t serial) {
+    // no-op
+}
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_impl = {
+    .set_size = layer_surface_set_size,
+    .set_anchor = layer_surface_set_anchor,
+    .set_exclusive_zone = layer_surface_set_exclusive_zone,
+    .set_margin = layer_surface_set_margin,
+    .set_keyboard_interactivity = layer_surface_set_keyboard_interactivity,
+    .get_popup = layer_surface_get_popup,
+    .ack_configure = layer_surface_ack_configure,
+    .destroy = destroy_resource,
+};
+
+static void layer_surface_resource_destroy(struct wl_resource *resource) {
+    struct layer_surface *layer_surface = wl_resource_get_user_data(resource);
+
+    if (layer_surface->surface != NULL) {
+        layer_surface->surface->layer_surface = NULL;
+    }
+    wl_list_remove(&layer_surface->link);
+    free(layer_surface);
+}
+
+static void layer_shell_get_layer_surface(struct wl_client *client, struct wl_resource *resource,
+                                          uint32_t id, struct wl_resource *surface_resource,
+                                          struct wl_resource *output_resource,
+                                          uint32_t layer, const char *namespace) {
+    struct surface *surface = wl_resource_get_user_data(surface_resource);
+
+    struct layer_surface *layer_surface = calloc(1, sizeof(*layer_surface));
+    if (layer_surface == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    layer_surface->surface = surface;
+    /* compositor picks output if client doesn't care */
+    layer_surface->output = output_resource != NULL
+                            ? wl_resource_get_user_data(output_resource) : &mock.outputs[0];
+
+    layer_surface->resource = wl_resource_create(client, &zwlr_layer_surface_v1_interface,
+                                                 wl_resource_get_version(resource), id);
+    if (layer_surface->resource == NULL) {
+        free(layer_surface);
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(layer_surface->resource, &layer_surface_impl, layer_surface,
+                                   layer_surface_resource_destroy);
+
+    surface->layer_surface = layer_surface;
+    wl_list_insert(mock.layer_surfaces.prev, &layer_surface->link);
+    DEBUG("layer surface %s on %s", namespace, layer_surface->output->name);
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_impl = {
+    .get_layer_surface = layer_shell_get_layer_surface,
+};
+
+static void bind_layer_shell(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &zwlr_layer_shell_v1_interface,
+                                                      version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &layer_shell_impl, NULL, NULL);
+}
+
+static void frame_send_ready(struct frame *frame) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint32_t tv_sec_hi = (uint64_t)now.tv_sec >> 32, tv_sec_lo = now.tv_sec & 0xffffffff;
+
+    if (!frame->ext) {
+        zwlr_screencopy_frame_v1_send_flags(frame->resource, 0);
+        zwlr_screencopy_frame_v1_send_ready(frame->resource, tv_sec_hi, tv_sec_lo, now.tv_nsec);
+        return;
+    }
+
+    ext_image_copy_capture_frame_v1_send_transform(frame->resource, frame->output->transform);
+    /* first frame of a session is new in full, after that only the capture counter changes */
+    if (frame->session == NULL || frame->session->frames++ == 0) {
+        ext_image_copy_capture_frame_v1_send_damage(frame->resource, 0, 0,
+                                                    frame->width, frame->height);
+    } else {
+        ext_image_copy_capture_frame_v1_send_damage(frame->resource, 0, 0, frame->width, 1);
+    }
+    ext_image_copy_capture_frame_v1_send_presentation_time(frame->resource,
+                                                           tv_sec_hi, tv_sec_lo, now.tv_nsec);
+    ext_image_copy_capture_frame_v1_send_ready(frame->resource);
+}
+
+/* wlr-screencopy has no reasons */
+static void frame_send_failed(struct frame *frame,
+                              enum ext_image_copy_capture_frame_v1_failure_reason reason) {
+    if (!frame->ext) {
+        zwlr_screencopy_frame_v1_send_failed(frame->resource);
+    } else {
+        ext_image_copy_capture_frame_v1_send_failed(frame->resource, reason);
+    }
+}
+
+static int frame_delay_expired(void *data) {
+    struct frame *frame = data;
+
+    wl_event_source_remove(frame->delay);
+    frame->delay = NULL;
+    frame_send_ready(frame);
+    return 0;
+}
+
+/*
+ * Rows of different shades, so that every output and every row differ. First row counts
+ * captures, so a refresh finds exactly that row changed.
+ */
+static void fill_frame(const struct frame *frame, uint8_t *data) {
+    for (uint32_t y = 0; y < frame->height; y++) {
+        uint8_t shade = y == 0 ? mock.captures : y + frame->output->index * 40;
+        memset(data + (size_t)y * frame->stride, shade,
+               (size_t)frame->width * mock.bytes_per_pixel);
+    }
+}
+
+/* shared by both capture protocols, failed or ready is sent eventually */
+static void frame_copy_into(struct frame *frame, struct wl_resource *buffer_resource) {
+    if (mock.failed_captures > 0) {
+        mock.failed_captures--;
+        frame_send_failed(frame, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_UNKNOWN);
+        return;
+    }
+    if (is_dmabuf_buffer(buffer_resource)) {
+        /* there's no gpu to copy with, client has to fall back to shm */
+        DEBUG("failing capture of %s into dmabuf", frame->output->name);
+        frame_send_failed(frame, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_UNKNOWN);
+        return;
+    }
+
+    /* wlr-screencopy dictates stride, ext-image-copy-capture leaves it to client */
+    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
+    uint32_t stride = buffer != NULL ? wl_shm_buffer_get_stride(buffer) : 0;
+    if (buffer == NULL
+            || wl_shm_buffer_get_format(buffer) != frame->format
+            || (uint32_t)wl_shm_buffer_get_width(buffer) != frame->width
+            || (uint32_t)wl_shm_buffer_get_height(buffer) != frame->height
+            || (frame->ext ? stride < frame->stride : stride != frame->stride)) {
+        WARN("client copies into buffer that doesn't match the one asked for");
+        frame_send_failed(frame, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS);
+        return;
+    }
+    frame->stride = stride;
+
+    mock.captures++;
+    wl_shm_buffer_begin_access(buffer);
+    fill_frame(frame, wl_shm_buffer_get_data(buffer));
+    wl_shm_buffer_end_access(buffer);
+
+    if (mock.capture_delay_ms > 0) {
+        frame->delay = wl_event_loop_add_timer(mock.loop, frame_delay_expired, frame);
+        wl_event_source_timer_update(frame->delay, mock.capture_delay_ms);
+    } else {
+        frame_send_ready(frame);
+    }
+}
+
+static void frame_copy(struct wl_client *client, struct wl_resource *resource,
+                       struct wl_resource *buffer_resource) {
+    struct frame *frame = wl_resource_get_user_data(resource);
+
+    frame_copy_into(frame, buffer_resource);
+}
+
+static const struct zwlr_screencopy_frame_v1_interface frame_impl = {
+    .copy = frame_copy,
+    .destroy = destroy_resource,
+};
+
+static void frame_set_buffer(struct frame *frame, struct wl_resource *buffer) {
+    if (frame->buffer != NULL) {
+        wl_list_remove(&frame->buffer_destroy.link);
+    }
+    frame->buffer = buffer;
+    if (buffer != NULL) {
+        wl_resource_add_destroy_listener(buffer, &frame->buffer_destroy);
+    }
+}
+
+static void frame_buffer_destroyed(struct wl_listener *listener, void *data) {
+    struct frame *frame = wl_container_of(listener, frame, buffer_destroy);
+
+    wl_list_remove(&frame->buffer_destroy.link);
+    frame->buffer = NULL;
+}
+
+static void frame_resource_destroy(struct wl_resource *resource) {
+    struct frame *frame = wl_resource_get_user_data(resource);
+
+    if (frame->delay != NULL) {
+        wl_event_source_remove(frame->delay);
+    }
+    frame_set_buffer(frame, NULL);
+    if (frame->session != NULL) {
+        frame->session->frame = NULL;
+    }
+    free(frame);
+}
+
+static struct frame *frame_create(struct wl_client *client, const struct wl_interface *interface,
+                                  int version, uint32_t id, const void *impl,
+                                  struct mock_output *output, int32_t width, int32_t height) {
+    struct frame *frame = calloc(1, sizeof(*frame));
+    if (frame == NULL) {
+        wl_client_post_no_memory(client);
+        return NULL;
+    }
+    frame->output = output;
+    frame->format = mock.format;
+    frame->width = width;
+    frame->height = height;
+    frame->stride = width * mock.bytes_per_pixel;
+    frame->buffer_destroy.notify = frame_buffer_destroyed;
+
+    frame->resource = wl_resource_create(client, interface, version, id);
+    if (frame->resource == NULL) {
+        free(frame);
+        wl_client_post_no_memory(client);
+        return NULL;
+    }
+    wl_resource_set_implementation(frame->resource, impl, frame, frame_resource_destroy);
+    return frame;
+}
+
+static void capture(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+                    struct wl_resource *output_resource, int32_t width, int32_t height) {
+    struct frame *frame = frame_create(client, &zwlr_screencopy_frame_v1_interface,
+                                       wl_resource_get_version(resource), id, &frame_impl,
+                                       wl_resource_get_user_data(output_resource),
+                                       width, height);
+    if (frame == NULL) {
+        return;
+    }
+
+    zwlr_screencopy_frame_v1_send_buffer(frame->resource, frame->format,
+                                         frame->width, frame->height, frame->stride);
+}
+
+static void screencopy_capture_output(struct wl_client *client, struct wl_resource *resource,
+                                      uint32_t id, int32_t overlay_cursor,
+                                      struct wl_resource *output_resource) {
+    struct mock_output *output = wl_resource_get_user_data(output_resource);
+
+    capture(client, resource, id, output_resource, output->w, output->h);
+}
+
+static void screencopy_capture_output_region(struct wl_client *client,
+                                             struct wl_resource *resource,
+                                             uint32_t id, int32_t overlay_cursor,
+                                             struct wl_resource *output_resource,
+                                             int32_t x, int32_t y,
+                                             int32_t width, int32_t height) {
+    struct mock_output *output = wl_resource_get_user_data(output_resource);
+
+    /* region is logical, buffer is in output buffer space */
+    if (transform_swaps_axes(output->transform)) {
+        capture(client, resource, id, output_resource, height, width);
+    } else {
+        capture(client, resource, id, output_resource, width, height);
+    }
+}
+
+static const struct zwlr_screencopy_manager_v1_interface screencopy_manager_impl = {
+    .capture_output = screencopy_capture_output,
+    .capture_output_region = screencopy_capture_output_region,
+    .destroy = destroy_resource,
+};
+
+static void bind_screencopy_manager(struct wl_client *client, void *data,
+                                    uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &zwlr_screencopy_manager_v1_interface,
+                                                      version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &screencopy_manager_impl, NULL, NULL);
+}
+
+static void session_send_constraints(struct capture_session *session) {
+    struct mock_output *output = session->output;
+
+    ext_image_copy_capture_session_v1_send_buffer_size(session->resource, output->w, output->h);
+    ext_image_copy_capture_session_v1_send_shm_format(session->resource, mock.format);
+    if (mock.dmabuf) {
+        struct wl_array device, modifiers;
+        wl_array_init(&device);
+        wl_array_init(&modifiers);
+
+        /* render node is never opened, it only has to look like one */
+        dev_t *dev = wl_array_add(&device, sizeof(*dev));
+        uint64_t *modifier = wl_array_add(&modifiers, sizeof(*modifier));
+        if (dev == NULL || modifier == NULL) {
+            DIE("wl_array_add() failed");
+        }
+        *dev = makedev(226, 128);
+        *modifier = 0; /* linear */
+
+        ext_image_copy_capture_session_v1_send_dmabuf_device(session->resource, &device);
+        ext_image_copy_capture_session_v1_send_dmabuf_format(session->resource,
+                                                             drm_format(mock.format), &modifiers);
+        wl_array_release(&device);
+        wl_array_release(&modifiers);
+    }
+    ext_image_copy_capture_session_v1_send_done(session->resource);
+}
+
+static void ext_frame_attach_buffer(struct wl_client *client, struct wl_resource *resource,
+                                    struct wl_resource *buffer) {
+    struct frame *frame = wl_resource_get_user_data(resource);
+
+    frame_set_buffer(frame, buffer);
+}
+
+static void ext_frame_damage_buffer(struct wl_client *client, struct wl_resource *resource,
+                                    int32_t x, int32_t y, int32_t width, int32_t height) {
+    // no-op
+}
+
+static void ext_frame_capture(struct wl_client *client, struct wl_resource *resource) {
+    struct frame *frame = wl_resource_get_user_data(resource);
+
+    if (frame->session == NULL) {
+        frame_send_failed(frame, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED);
+        return;
+    }
+    if (frame->captured) {
+        wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_ALREADY_CAPTURED,
+                               "capture was already requested");
+        return;
+    }
+    if (frame->buffer == NULL) {
+        wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_NO_BUFFER,
+                               "capture requested without a buffer");
+        return;
+    }
+    frame->captured = true;
+
+    if (mock.constraint_failures > 0) {
+        mock.constraint_failures--;
+        /* as if output changed under the client, same constraints are sent again */
+        frame_send_failed(frame, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS);
+        session_send_constraints(frame->session);
+        return;
+    }
+    frame_copy_into(frame, frame->buffer);
+}
+
+static const struct ext_image_copy_capture_frame_v1_interface ext_frame_impl = {
+    .destroy = destroy_resource,
+    .attach_buffer = ext_frame_attach_buffer,
+    .damage_buffer = ext_frame_damage_buffer,
+    .capture = ext_frame_capture,
+};
+
+static void session_create_frame(struct wl_client *client, struct wl_resource *resource,
+                                 uint32_t id) {
+    struct capture_session *session = wl_resource_get_user_data(resource);
+
+    if (session->frame != NULL) {
+        wl_resource_post_error(resource,
+                               EXT_IMAGE_COPY_CAPTURE_SESSION_V1_ERROR_DUPLICATE_FRAME,
+                               "session already has a frame");
+        return;
+    }
+
+    struct frame *frame = frame_create(client, &ext_image_copy_capture_frame_v1_interface,
+                                       wl_resource_get_version(resource), id, &ext_frame_impl,
+                                       session->output, session->output->w, session->output->h);
+    if (frame == NULL) {
+        return;
+    }
+    frame->ext = true;
+    frame->session = session;
+    session->frame = frame;
+}
+
+static const struct ext_image_copy_capture_session_v1_interface session_impl = {
+    .create_frame = session_create_frame,
+    .destroy = destroy_resource,
+};
+
+static void session_resource_destroy(struct wl_resource *resource) {
+    struct capture_session *session = wl_resource_get_user_data(resource);
+
+    /* frame can outlive its session, but fails if it's captured after */
+    if (session->frame != NULL) {
+        session->frame->session = NULL;
+    }
+    free(session);
+}
+
+static void copy_capture_manager_create_session(struct wl_client *client,
+                                                struct wl_resource *resource, uint32_t id,
+                                                struct wl_resource *source_resource,
+                                                uint32_t options) {
+    struct capture_session *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    session->output = wl_resource_get_user_data(source_resource);
+
+    session->resource = wl_resource_create(client, &ext_image_copy_capture_session_v1_interface,
+                                           wl_resource_get_version(resource), id);
+    if (session->resource == NULL) {
+        free(session);
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(session->resource, &session_impl, session,
+                                   session_resource_destroy);
+
+    session_send_constraints(session);
+}
+
+static void copy_capture_manager_create_pointer_cursor_session(struct wl_client *client,
+                                                               struct wl_resource *resource,
+                                                               uint32_t id,
+                                                               struct wl_resource *source,
+                                                               struct wl_resource *pointer) {
+    wl_client_post_implementation_error(client, "mock compositor has no cursor sessions");
+}
+
+static const struct ext_image_copy_capture_manager_v1_interface copy_capture_manager_impl = {
+    .create_session = copy_capture_manager_create_session,
+    .create_pointer_cursor_session = copy_capture_manager_create_pointer_cursor_session,
+    .destroy = destroy_resource,
+};
+
+static void bind_copy_capture_manager(struct wl_client *client, void *data,
+                                      uint32_t version, uint32_t id) {
+    struct wl_resource *resource =
+        wl_resource_create(client, &ext_image_copy_capture_manager_v1_interface, version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &copy_capture_manager_impl, NULL, NULL);
+}
+
+static const struct ext_image_capture_source_v1_interface source_impl = {
+    .destroy = destroy_resource,
+};
+
+static void output_source_manager_create_source(struct wl_client *client,
+                                                struct wl_resource *resource, uint32_t id,
+                                                struct wl_resource *output_resource) {
+    struct wl_resource *source = wl_resource_create(client, &ext_image_capture_source_v1_interface,
+                                                    1, id);
+    if (source == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(source, &source_impl,
+                                   wl_resource_get_user_data(output_resource), NULL);
+}
+
+static const struct ext_output_image_capture_source_manager_v1_interface
+output_source_manager_impl = {
+    .create_source = output_source_manager_create_source,
+    .destroy = destroy_resource,
+};
+
+static void bind_output_source_manager(struct wl_client *client, void *data,
+                                       uint32_t version, uint32_t id) {
+    struct wl_resource *resource =
+        wl_resource_create(client, &ext_output_image_capture_source_manager_v1_interface,
+                           version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &output_source_manager_impl, NULL, NULL);
+}
+
+/* imported dmabufs are never read, overlays showing them are as good as shm ones */
+static const struct wl_buffer_interface dmabuf_buffer_impl = {
+    .destroy = destroy_resource,
+};
+
+static bool is_dmabuf_buffer(struct wl_resource *buffer) {
+    return wl_resource_instance_of(buffer, &wl_buffer_interface, &dmabuf_buffer_impl);
+}
+
+static void params_add(struct wl_client *client, struct wl_resource *resource, int32_t fd,
+                       uint32_t plane_idx, uint32_t offset, uint32_t stride,
+                       uint32_t modifier_hi, uint32_t modifier_lo) {
+    close(fd);
+}
+
+static struct wl_resource *params_create_buffer(struct wl_client *client, uint32_t id) {
+    struct wl_resource *buffer = wl_resource_create(client, &wl_buffer_interface, 1, id);
+    if (buffer == NULL) {
+        wl_client_post_no_memory(client);
+        return NULL;
+    }
+    wl_resource_set_implementation(buffer, &dmabuf_buffer_impl, NULL, NULL);
+    return buffer;
+}
+
+static void params_create(struct wl_client *client, struct wl_resource *resource,
+                          int32_t width, int32_t height, uint32_t format, uint32_t flags) {
+    struct wl_resource *buffer = params_create_buffer(client, 0);
+    if (buffer != NULL) {
+        zwp_linux_buffer_params_v1_send_created(resource, buffer);
+    }
+}
+
+static void params_create_immed(struct wl_client *client, struct wl_resource *resource,
+                                uint32_t id, int32_t width, int32_t height,
+                                uint32_t format, uint32_t flags) {
+    params_create_buffer(client, id);
+}
+
+static const struct zwp_linux_buffer_params_v1_interface params_impl = {
+    .destroy = destroy_resource,
+    .add = params_add,
+    .create = params_create,
+    .create_immed = params_create_immed,
+};
+
+static void linux_dmabuf_create_params(struct wl_client *client, struct wl_resource *resource,
+                                       uint32_t id) {
+    struct wl_resource *params = wl_resource_create(client, &zwp_linux_buffer_params_v1_interface,
+                                                    wl_resource_get_version(resource), id);
+    if (params == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(params, &params_impl, NULL, NULL);
+}
+
+/* only up to version 3, so feedback requests never come */
+static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_impl = {
+    .destroy = destroy_resource,
+    .create_params = linux_dmabuf_create_params,
+};
+
+static void bind_linux_dmabuf(struct wl_client *client, void *data,
+                              uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &zwp_linux_dmabuf_v1_interface,
+                                                      version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &linux_dmabuf_impl, NULL, NULL);
+
+    uint32_t format = drm_format(mock.format);
+    zwp_linux_dmabuf_v1_send_format(resource, format);
+    if (version >= ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION) {
+        zwp_linux_dmabuf_v1_send_modifier(resource, format, 0, 0);
+    }
+}
+
+static void create_globals(void) {
+    #define CREATE_GLOBAL(i, ver, data, bind) \
+        if (wl_global_create(mock.display, &i, ver, data, bind) == NULL) { \
+            DIE("failed to create %s global", i.name); \
+        }
+
+    CREATE_GLOBAL(wl_compositor_interface, 6, NULL, bind_compositor);
+    CREATE_GLOBAL(zxdg_output_manager_v1_interface, 3, NULL, bind_xdg_output_manager);
+    CREATE_GLOBAL(wp_viewporter_interface, 1, NULL, bind_viewporter);
+    CREATE_GLOBAL(zwlr_layer_shell_v1_interface, 1, NULL, bind_layer_shell);
+    if (!mock.ext_only) {
+        CREATE_GLOBAL(zwlr_screencopy_manager_v1_interface, 1, NULL, bind_screencopy_manager);
+    }
+    CREATE_GLOBAL(ext_image_copy_capture_manager_v1_interface, 1, NULL,
+                  bind_copy_capture_manager);
+    CREATE_GLOBAL(ext_output_image_capture_source_manager_v1_interface, 1, NULL,
+                  bind_output_source_manager);
+    if (mock.dmabuf) {
+        CREATE_GLOBAL(zwp_linux_dmabuf_v1_interface, 3, NULL, bind_linux_dmabuf);
+    }
+    for (int i = 0; i < mock.n_outputs; i++) {
+        CREATE_GLOBAL(wl_output_interface, 4, &mock.outputs[i], bind_output);
+    }
+
+    #undef CREATE_GLOBAL
+
+    if (wl_display_init_shm(mock.display) < 0) {
+        DIE("failed to set up wl_shm");
+    }
+    /* argb8888 and xrgb8888 are always there */
+    if (mock.format != WL_SHM_FORMAT_ARGB8888 && mock.format != WL_SHM_FORMAT_XRGB8888) {
+        wl_display_add_shm_format(mock.display, mock.format);
+    }
+}
+
+static int handle_sigchld(int signo, void *data) {
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        if (pid == mock.client_pid) {
+            mock.client_status = status;
+            mock.client_usage = usage;
+            mock.client_pid = -1;
+        }
+    }
+
+    if (mock.client_pid < 0) {
+        wl_display_terminate(mock.display);
+    }
+    return 0;
+}
+
+static void spawn_client(char **argv) {
+    clock_gettime(CLOCK_MONOTONIC, &mock.client_start);
+
+    mock.client_pid = fork();
+    if (mock.client_pid < 0) {
+        EDIE("fork() failed");
+    } else if (mock.client_pid == 0) {
+        /* event loop blocked SIGCHLD to read it from signalfd */
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        execvp(argv[0], argv);
+        EERR("failed to exec %s", argv[0]);
+        _exit(127);
+    }
+}
+
+static void print_help_and_exit(FILE *stream, int exit_status) {
+    const char help_string[] =
+        "mock-compositor - headless compositor for testing frzscr\n"
+        "\n"
+        "usage:\n"
+        "    mock-compositor [-EDFvh] [-n COUNT] [-m WxH] [-t TRANSFORM] [-f FORMAT] [-d MS]\n"
+        "                    [-x N] [-C N] CMD [ARG]...\n"
+        "\n"
+        "command line options:\n"
+        "    -n COUNT        number of outputs, 1 to 16 (default: 1)\n"
+        "    -m WxH          output mode (default: 1920x1080)\n"
+        "    -t TRANSFORM    wl_output_transform of every output, 0 to 7 (default: 0)\n"
+        "    -f FORMAT       format of captured frames: xrgb8888 (default), argb8888, xbgr8888,\n"
+        "                    abgr8888, xrgb2101010, bgr888 or rgb565\n"
+        "    -d MS           delay captures by MS milliseconds\n"
+        "    -x N            fail first N captures\n"
+        "    -C N            fail first N ext-image-copy-capture captures with buffer_constraints\n"
+        "                    and send constraints again\n"
+        "    -E              only advertise ext-image-copy-capture, not wlr-screencopy\n"
+        "    -D              advertise linux-dmabuf and linear dmabufs in capture constraints,\n"
+        "                    captures into them always fail\n"
+        "    -F              CMD is not frzscr, don't expect it to show overlays\n"
+        "    -v              enable debug output\n"
+        "    -h              print this help message and exit\n"
+        "\n"
+        "CMD is run with WAYLAND_DISPLAY pointing at the mock compositor, its exit status\n"
+        "is returned. Without -F it is 1 if CMD exited successfully but never showed its\n"
+        "overlays.\n";
+
+    fputs(help_string, stream);
+    exit(exit_status);
+}
+
+static void parse_command_line(int argc, char **argv) {
+    int32_t w = 1920, h = 1080;
+    long transform = WL_OUTPUT_TRANSFORM_NORMAL;
+    int opt;
+    char *end;
+
+    mock.n_outputs = 1;
+    /* + stops at CMD, so that its options aren't taken for ours */
+    while ((opt = getopt(argc, argv, "+n:m:t:f:d:x:C:EDFvh")) != -1) {
+        switch (opt) {
+        case 'n':
+            mock.n_outputs = strtol(optarg, &end, 10);
+            if (*end != '\0' || mock.n_outputs < 1 || mock.n_outputs > MAX_OUTPUTS) {
+                DIE("output count has to be between 1 and %d", MAX_OUTPUTS);
+            }
+            break;
+        case 'm':
+            if (sscanf(optarg, "%" SCNd32 "x%" SCNd32, &w, &h) != 2 || w <= 0 || h <= 0) {
+                DIE("invalid mode %s: expected WxH", optarg);
+            }
+            break;
+        case 't':
+            transform = strtol(optarg, &end, 10);
+            if (*end != '\0' || transform < 0 || transform > WL_OUTPUT_TRANSFORM_FLIPPED_270) {
+                DIE("transform has to be between 0 and 7");
+            }
+            break;
+        case 'f': {
+            bool found = false;
+            for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+                if (STREQ(optarg, formats[i].name)) {
+                    mock.format = formats[i].format;
+                    mock.bytes_per_pixel = formats[i].bytes_per_pixel;
+                    found = true;
+                }
+            }
+            if (!found) {
+                DIE("unknown format %s", optarg);
+            }
+            break;
+        }
+        case 'd':
+            mock.capture_delay_ms = strtol(optarg, &end, 10);
+            if (*end != '\0' || mock.capture_delay_ms < 0) {
+                DIE("invalid delay %s", optarg);
+            }
+            break;
+        case 'x':
+            mock.failed_captures = strtol(optarg, &end, 10);
+            if (*end != '\0' || mock.failed_captures < 0) {
+                DIE("invalid number of failed captures %s", optarg);
+            }
+            break;
+        case 'C':
+            mock.constraint_failures = strtol(optarg, &end, 10);
+            if (*end != '\0' || mock.constraint_failures < 0) {
+                DIE("invalid number of failed captures %s", optarg);
+            }
+            break;
+        case 'E':
+            mock.ext_only = true;
+            break;
+        case 'D':
+            mock.dmabuf = true;
+            break;
+        case 'F':
+            mock.expect_freeze = false;
+            break;
+        case 'v':
+            log_enable_debug = 1;
+            break;
+        case 'h':
+            print_help_and_exit(stdout, 0);
+            break;
+        default:
+            print_help_and_exit(stderr, 1);
+        }
+    }
+    if (optind >= argc) {
+        print_help_and_exit(stderr, 1);
+    }
+
+    int32_t x = 0;
+    for (int i = 0; i < mock.n_outputs; i++) {
+        struct mock_output *output = &mock.outputs[i];
+        output->index = i;
+        snprintf(output->name, sizeof(output->name), "MOCK-%d", i + 1);
+        output->x = x;
+        output->w = w;
+        output->h = h;
+        output->transform = transform;
+        x += logical_width(output);
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_command_line(argc, argv);
+    wl_list_init(&mock.layer_surfaces);
+
+    /* tests are run in clean environments that may not have one */
+    char runtime_dir[] = "/tmp/frzscr-mock-XXXXXX";
+    bool own_runtime_dir = getenv("XDG_RUNTIME_DIR") == NULL;
+    if (own_runtime_dir) {
+        if (mkdtemp(runtime_dir) == NULL) {
+            EDIE("failed to create runtime dir");
+        }
+        setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+    }
+
+    mock.display = wl_display_create();
+    if (mock.display == NULL) {
+        DIE("failed to create wl_display");
+    }
+    mock.loop = wl_display_get_event_loop(mock.display);
+    create_globals();
+
+    const char *socket_name = wl_display_add_socket_auto(mock.display);
+    if (socket_name == NULL) {
+        EDIE("failed to add wayland socket");
+    }
+    setenv("WAYLAND_DISPLAY", socket_name, 1);
+    unsetenv("WAYLAND_SOCKET");
+    DEBUG("listening on %s", socket_name);
+
+    /* before spawning, so that SIGCHLD is blocked by the time client can exit */
+    struct wl_event_source *sigchld =
+        wl_event_loop_add_signal(mock.loop, SIGCHLD, handle_sigchld, NULL);
+    if (sigchld == NULL) {
+        DIE("failed to watch SIGCHLD");
+    }
+    spawn_client(&argv[optind]);
+
+    wl_display_run(mock.display);
+
+    int exit_status;
+    if (WIFEXITED(mock.client_status)) {
+        exit_status = WEXITSTATUS(mock.client_status);
+    } else {
+        WARN("client was killed by signal %d", WTERMSIG(mock.client_status));
+        exit_status = 128 + WTERMSIG(mock.client_status);
+    }
+
+    if (mock.freeze_ms >= 0) {
+        fprintf(stderr, "%d outputs %dx%d: frozen after %.3f ms, client max rss %ld KiB\n",
+                mock.n_outputs, mock.outputs[0].w, mock.outputs[0].h,
+                mock.freeze_ms, mock.client_usage.ru_maxrss);
+    } else if (exit_status == 0 && mock.expect_freeze) {
+        ERR("client exited without showing its overlays");
+        exit_status = 1;
+    }
+
+    wl_event_source_remove(sigchld);
+    wl_display_destroy_clients(mock.display);
+    wl_display_destroy(mock.display);
+    if (own_runtime_dir) {
+        rmdir(runtime_dir);
+    }
+
+    return exit_status;
+}
@@ -0,0 +1,5 @@
+#!/bin/sh
+# run by frzscr with -c, asks it to capture the screen again while frozen
+sleep 0.2
+kill -USR1 "$PPID"
+sleep 0.2